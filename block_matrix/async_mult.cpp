@@ -0,0 +1,167 @@
+#include "block_matrix.hpp"
+#include "block_internal.hpp"
+#include "errors.hpp"
+#include "thread_pool.hpp"
+#include <cstdio>
+#include <memory>
+
+// K is split in about this many panels: fewer leave less packing to hide,
+// more reload C tiles from memory once per panel
+static const uint64_t ASYNC_K_PANELS = 4;
+
+// Packed A and B of one k-panel
+template <typename T>
+struct k_panel
+{
+    matrix_of_blocks<T>* A_;
+    matrix_of_blocks<T>* B_;
+};
+
+template <typename T>
+static void drop_panel(k_panel<T>* panel)
+{
+    if (panel->A_ != nullptr)
+        block_distruct(panel->A_);
+    if (panel->B_ != nullptr)
+        block_distruct(panel->B_);
+    panel->A_ = nullptr;
+    panel->B_ = nullptr;
+}
+
+// Columns [k_first, k_first + depth) of A and rows of B, both row-major
+template <typename T>
+static int pack_panel(const T* A, uint64_t lda, const T* B, uint64_t ldb, uint64_t M, uint64_t N, uint64_t k_first,
+                      uint64_t depth, long int num_threads, thread_pool* pool, k_panel<T>* panel)
+{
+    panel->A_ = produce_block_matrix(depth, M, A + k_first, lda, num_threads, pool);
+    panel->B_ = produce_trans_block(N, depth, B + k_first * ldb, ldb, num_threads, pool);
+    if (panel->A_ == nullptr || panel->B_ == nullptr)
+    {
+        drop_panel(panel);
+        return E_BADALLOC;
+    }
+    return E_SUCCESS;
+}
+
+// C = A * B panel by panel of K: one thread packs the next panel while the
+// others compute the current one into C tiles
+template <typename T>
+static int pipelined_mult(const T* A, uint64_t lda, const T* B, uint64_t ldb, typename block_traits<T>::acc_t* C, uint64_t ldc,
+                          uint64_t M, uint64_t K, uint64_t N, long int num_threads, const block_mult_options& options)
+{
+    typedef typename block_traits<T>::acc_t acc_t;
+
+    uint64_t block_dim = block_traits<T>::tile_dim;
+    thread_pool* pool = options.pool_;
+
+    // panels are whole kc blocks, so the kernels see the same k-panels as in block_mult
+    uint64_t k_tiles     = (K + block_dim - 1) / block_dim;
+    uint64_t kc_tiles    = std::max<uint64_t>(1, options.kc_ / block_dim);
+    uint64_t panel_tiles = (k_tiles + ASYNC_K_PANELS - 1) / ASYNC_K_PANELS;
+    panel_tiles = std::max<uint64_t>(1, (panel_tiles + kc_tiles - 1) / kc_tiles) * kc_tiles;
+    uint64_t depth       = panel_tiles * block_dim;
+    uint64_t num_panels  = (K + depth - 1) / depth;
+
+    matrix_of_blocks<acc_t>* C_tiles = produce_block_matrix<acc_t>(N, M, nullptr, N, num_threads, pool);
+    if (C_tiles == nullptr)
+        return E_BADALLOC;
+
+    // nothing to overlap with the first panel, all threads pack it
+    k_panel<T> panels[2] = {};
+    int ret = pack_panel(A, lda, B, ldb, M, N, 0, std::min(depth, K), num_threads, pool, &panels[0]);
+
+    thread_pool& workers = (pool != nullptr) ? *pool : thread_pool::instance();
+    for (uint64_t panel = 0; panel < num_panels && ret == E_SUCCESS; panel++)
+    {
+        k_panel<T>* cur  = &panels[panel % 2];
+        k_panel<T>* next = &panels[(panel + 1) % 2];
+        int pack_ret = E_SUCCESS;
+
+        // the caller starts computing at once, the packing task goes to the first
+        // free worker (or to the caller after the compute if there is none)
+        workers.run((panel + 1 < num_panels) ? 2 : 1, 2, [&](uint64_t task)
+        {
+            if (task == 0)
+                ret = mult_prep_block_matr_multitread(cur->A_, cur->B_, C_tiles, num_threads, options, true,
+                                                      (const numa_plan<T>*)nullptr, panel != 0);
+            else
+                pack_ret = pack_panel(A, lda, B, ldb, M, N, (panel + 1) * depth, std::min(depth, K - (panel + 1) * depth),
+                                      1, pool, next);
+        });
+
+        drop_panel(cur);
+        if (ret == E_SUCCESS)
+            ret = pack_ret;
+    }
+    drop_panel(&panels[0]);
+    drop_panel(&panels[1]);
+
+    if (ret == E_SUCCESS)
+        fill_matrix_from_block_matrix(C, M, N, ldc, C_tiles, num_threads, pool);
+    block_distruct(C_tiles);
+
+    return ret;
+}
+
+template <typename T>
+std::future<basic_matrix<typename accumulator<T>::type>> block_mult_async(basic_matrix<T>& A, basic_matrix<T>& B,
+                                                                          long int num_threads, const block_mult_options& options)
+{
+    typedef typename accumulator<T>::type acc_t;
+
+    if (B.rows() != A.columns())
+        throw std::invalid_argument("[block_mult_async] incompatible matrix format\n");
+    if (num_threads < 0)
+        throw std::invalid_argument("[block_mult_async] negative number of threads\n");
+
+    uint64_t M = A.rows();
+    uint64_t K = A.columns();
+    uint64_t N = B.columns();
+
+    // the row-major copies of tiled operands are made here, not behind the caller's back
+    const T* A_data = static_cast<const basic_matrix<T>&>(A).data();
+    const T* B_data = static_cast<const basic_matrix<T>&>(B).data();
+
+    // the panels are packed as T and unpacked row-major
+    block_mult_options resolved = resolve_options(options, M, N, K, &num_threads);
+    resolved.mixed_precision_ = false;
+    resolved.tiled_result_    = false;
+    resolved.numa_            = false;
+    resolved.timings_         = nullptr;
+    resolved.numa_stats_      = nullptr;
+    resolved.stats_           = nullptr;
+    resolved.debug_dump_      = nullptr;
+
+    std::shared_ptr<std::promise<basic_matrix<acc_t>>> result = std::make_shared<std::promise<basic_matrix<acc_t>>>();
+    std::future<basic_matrix<acc_t>> future = result->get_future();
+
+    thread_pool& workers = (resolved.pool_ != nullptr) ? *resolved.pool_ : thread_pool::instance();
+    workers.reserve(num_threads);
+    workers.submit([=]()
+    {
+        try
+        {
+            basic_matrix<acc_t> C(N, M);
+            int ret = E_SUCCESS;
+            if (M != 0 && N != 0 && K != 0)
+                ret = pipelined_mult(A_data, K, B_data, N, C.data(), N, M, K, N, num_threads, resolved);
+            else
+                std::fill_n(C.data(), M * N, acc_t(0));
+
+            if (ret != E_SUCCESS)
+                throw std::runtime_error("[block_mult_async] multiplication returned error " + std::to_string(ret) + "\n");
+            result->set_value(std::move(C));
+        }
+        catch (...)
+        {
+            result->set_exception(std::current_exception());
+        }
+    });
+
+    return future;
+}
+
+template std::future<matrix>     block_mult_async(matrix&, matrix&, long int, const block_mult_options&);
+template std::future<matrix_f32> block_mult_async(matrix_f32&, matrix_f32&, long int, const block_mult_options&);
+template std::future<matrix_i32> block_mult_async(matrix_i32&, matrix_i32&, long int, const block_mult_options&);
+template std::future<matrix_i32> block_mult_async(matrix_i8&, matrix_i8&, long int, const block_mult_options&);
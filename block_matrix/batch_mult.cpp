@@ -0,0 +1,187 @@
+#include "block_matrix.hpp"
+#include "errors.hpp"
+#include "kernels.hpp"
+#include "thread_pool.hpp"
+#include "workspace.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <vector>
+
+static uint64_t tiles_of(uint64_t elements, uint64_t tile_dim)
+{
+    return (elements + tile_dim - 1) / tile_dim;
+}
+
+// Elements of T in the arena slice of one product: packed A and B and a C tile
+template <typename T>
+static uint64_t slice_elements(const gemm_batch_entry<T>& entry)
+{
+    typedef typename block_traits<T>::acc_t acc_t;
+    uint64_t dim = block_traits<T>::tile_dim;
+
+    uint64_t k_tiles = tiles_of(entry.K_, dim);
+    uint64_t packed  = (tiles_of(entry.M_, dim) + tiles_of(entry.N_, dim)) * k_tiles * block_traits<T>::tile_size;
+    uint64_t C_tile  = block_traits<T>::tile_size * sizeof(acc_t) / sizeof(T);
+
+    // the C tile starts on a cache line
+    uint64_t per_line = CACHE_LINE_SIZE / sizeof(T);
+    return (packed + per_line - 1) / per_line * per_line + C_tile;
+}
+
+// rows x cols matrix into a grid of tile_dim x tile_dim row-major tiles padded
+// with zeros: A - tile rows one after another, B (transposed) - tile columns
+template <typename T>
+static void pack_small(const T* source, uint64_t ld, uint64_t rows, uint64_t cols, T* tiles, bool transposed)
+{
+    uint64_t dim        = block_traits<T>::tile_dim;
+    uint64_t size       = block_traits<T>::tile_size;
+    uint64_t tile_rows  = tiles_of(rows, dim);
+    uint64_t tile_cols  = tiles_of(cols, dim);
+
+    if (rows % dim != 0 || cols % dim != 0)
+        memset(tiles, 0, tile_rows * tile_cols * size * sizeof(T));
+    for (uint64_t row = 0; row < rows; row++)
+        for (uint64_t tile_col = 0; tile_col < tile_cols; tile_col++)
+        {
+            uint64_t tile = transposed ? tile_col * tile_rows + row / dim : (row / dim) * tile_cols + tile_col;
+            uint64_t width = std::min(dim, cols - tile_col * dim);
+            memcpy(tiles + tile * size + (row % dim) * dim, source + row * ld + tile_col * dim, width * sizeof(T));
+        }
+}
+
+template <typename T>
+static void small_product(const gemm_batch_entry<T>& entry, T* slice)
+{
+    typedef typename block_traits<T>::acc_t acc_t;
+    uint64_t dim  = block_traits<T>::tile_dim;
+    uint64_t size = block_traits<T>::tile_size;
+
+    uint64_t M_tiles = tiles_of(entry.M_, dim);
+    uint64_t N_tiles = tiles_of(entry.N_, dim);
+    uint64_t k_tiles = tiles_of(entry.K_, dim);
+    if (k_tiles == 0)
+    {
+        for (uint64_t row = 0; row < entry.M_; row++)
+            memset(entry.C_ + row * entry.ldc_, 0, entry.N_ * sizeof(acc_t));
+        return;
+    }
+
+    // B is packed as k x col tiles: B rows are tile rows of the transposed grid
+    T* A_tiles = slice;
+    T* B_tiles = slice + M_tiles * k_tiles * size;
+    uint64_t per_line = CACHE_LINE_SIZE / sizeof(T);
+    acc_t* C_tile = (acc_t*)(slice + ((M_tiles + N_tiles) * k_tiles * size + per_line - 1) / per_line * per_line);
+
+    pack_small(entry.A_, entry.lda_, entry.M_, entry.K_, A_tiles, false);
+    pack_small(entry.B_, entry.ldb_, entry.K_, entry.N_, B_tiles, true);
+
+    micro_kernel_t<T> kernel = select_small_kernel<T>(k_tiles);
+    if (kernel == nullptr)
+        kernel = select_micro_kernel<T>();
+
+    for (uint64_t tile_row = 0; tile_row < M_tiles; tile_row++)
+    {
+        uint64_t height = std::min(dim, entry.M_ - tile_row * dim);
+        for (uint64_t tile_col = 0; tile_col < N_tiles; tile_col++)
+        {
+            kernel(k_tiles, A_tiles + tile_row * k_tiles * size, B_tiles + tile_col * k_tiles * size, size, C_tile, false);
+
+            uint64_t width = std::min(dim, entry.N_ - tile_col * dim);
+            acc_t* dest = entry.C_ + tile_row * dim * entry.ldc_ + tile_col * dim;
+            for (uint64_t row = 0; row < height; row++)
+                memcpy(dest + row * entry.ldc_, C_tile + row * dim, width * sizeof(acc_t));
+        }
+    }
+}
+
+template <typename T>
+void batch_block_mult(const gemm_batch_entry<T>* batch, uint64_t count, long int num_threads, thread_pool* pool)
+{
+    if (batch == nullptr && count != 0)
+        throw std::invalid_argument("[batch_block_mult] Bad pointer to batch\n");
+    if (num_threads < 0)
+        throw std::invalid_argument("[batch_block_mult] negative number of threads\n");
+    if (count == 0)
+        return;
+
+    if (num_threads == 0)
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    num_threads = std::min<uint64_t>(num_threads, count);
+
+    uint64_t slice = 0;
+    for (uint64_t i = 0; i < count; i++)
+        slice = std::max(slice, slice_elements(batch[i]));
+    // slices of neighbour threads don't share cache lines
+    uint64_t per_line = CACHE_LINE_SIZE / sizeof(T);
+    slice = (slice + per_line - 1) / per_line * per_line;
+
+    // steady batches of the same shapes get the same region back every call
+    workspace& buffers = workspace::instance();
+    T* arena = (T*)buffers.acquire(num_threads * slice * sizeof(T));
+    if (arena == nullptr)
+    {
+        throw std::runtime_error("[batch_block_mult] multiplication returned error " + std::to_string(E_BADALLOC) + "\n");
+    }
+
+    // a product per task, slot is the arena slice of the thread running it
+    std::atomic<uint64_t> next(0);
+    thread_pool& workers = (pool != nullptr) ? *pool : thread_pool::instance();
+    workers.reserve(num_threads);
+    try
+    {
+        workers.run(num_threads, num_threads, [&](uint64_t slot)
+        {
+            uint64_t index = 0;
+            while ((index = next.fetch_add(1, std::memory_order_relaxed)) < count)
+                small_product(batch[index], arena + slot * slice);
+        });
+    }
+    catch (...)
+    {
+        buffers.release(arena);
+        throw;
+    }
+
+    buffers.release(arena);
+}
+
+template <typename T>
+std::vector<basic_matrix<typename accumulator<T>::type>> batch_block_mult(const std::vector<const basic_matrix<T>*>& A,
+                                                                          const std::vector<const basic_matrix<T>*>& B,
+                                                                          long int num_threads)
+{
+    typedef typename accumulator<T>::type acc_t;
+
+    if (A.size() != B.size())
+        throw std::invalid_argument("[batch_block_mult] different number of A and B operands\n");
+
+    std::vector<basic_matrix<acc_t>> C;
+    C.reserve(A.size());
+    std::vector<gemm_batch_entry<T>> batch(A.size());
+    for (size_t i = 0; i < A.size(); i++)
+    {
+        if (A[i] == nullptr || B[i] == nullptr)
+            throw std::invalid_argument("[batch_block_mult] Bad pointer to operand\n");
+        if (B[i]->rows() != A[i]->columns())
+            throw std::invalid_argument("[batch_block_mult] incompatible matrix format\n");
+
+        C.emplace_back(B[i]->columns(), A[i]->rows());
+        batch[i] = {A[i]->data(), A[i]->columns(), B[i]->data(), B[i]->columns(), C[i].data(), C[i].columns(),
+                    A[i]->rows(), B[i]->columns(), A[i]->columns()};
+    }
+
+    batch_block_mult(batch.data(), batch.size(), num_threads);
+    return C;
+}
+
+template void batch_block_mult(const gemm_batch_entry<double>*, uint64_t, long int, thread_pool*);
+template void batch_block_mult(const gemm_batch_entry<float>*, uint64_t, long int, thread_pool*);
+template void batch_block_mult(const gemm_batch_entry<int32_t>*, uint64_t, long int, thread_pool*);
+template void batch_block_mult(const gemm_batch_entry<int8_t>*, uint64_t, long int, thread_pool*);
+
+template std::vector<matrix>     batch_block_mult(const std::vector<const matrix*>&, const std::vector<const matrix*>&, long int);
+template std::vector<matrix_f32> batch_block_mult(const std::vector<const matrix_f32*>&, const std::vector<const matrix_f32*>&, long int);
+template std::vector<matrix_i32> batch_block_mult(const std::vector<const matrix_i32*>&, const std::vector<const matrix_i32*>&, long int);
+template std::vector<matrix_i32> batch_block_mult(const std::vector<const matrix_i8*>&, const std::vector<const matrix_i8*>&, long int);
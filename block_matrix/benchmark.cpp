@@ -1,16 +1,805 @@
 #include "block_matrix.hpp"
+#include "sparse_matrix.hpp"
+#include "thread_pool.hpp"
+#include "workspace.hpp"
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <chrono>
+#include <cmath>
+#include <vector>
+#include <memory>
 #include <errno.h>
+#include <sys/resource.h>
+
+static const int TUNE_REPEATS = 3;
+
+static bool is_binary_name(const char* file_name)
+{
+    size_t length = strlen(file_name);
+    return length >= 5 && strcmp(file_name + length - 5, ".matb") == 0;
+}
+
+// .matb output is written row-major, .matr output - as text
+static void save_matrix(matrix& C, const char* file_name)
+{
+    if (is_binary_name(file_name))
+        C.save_binary(file_name);
+    else
+        C.save(file_name);
+}
+
+// Best time of TUNE_REPEATS calls of func(run) after a warmup call (run 0)
+template <typename F>
+static double best_time(F func)
+{
+    double best = 0.0;
+    for (int i = 0; i <= TUNE_REPEATS; i++)
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+        func(i);
+        std::chrono::duration<double> exec_time = std::chrono::high_resolution_clock::now() - start;
+        if (i == 1 || (i > 1 && exec_time.count() < best))
+            best = exec_time.count();
+    }
+
+    return best;
+}
+
+template <typename T, typename U>
+static double max_difference(const T* left, const U* right, uint64_t count)
+{
+    double max_error = 0.0;
+    for (uint64_t i = 0; i < count; i++)
+        max_error = std::max(max_error, std::fabs((double)left[i] - (double)right[i]));
+    return max_error;
+}
+
+static double time_block_mult(matrix& A, matrix& B, long int num_threads, const block_mult_options& options)
+{
+    return best_time([&](int)
+    {
+        matrix C = A.block_mult(B, num_threads, options);
+    });
+}
+
+static void print_config(const char* what, long int num_threads, const block_mult_options& options, double time)
+{
+    printf("%-10s threads = %3ld, mc = %5lu, kc = %5lu, nc = %6lu, traversal = %s: %lg s\n", what, num_threads,
+           options.mc_, options.kc_, options.nc_, options.traversal_ == TRAVERSE_ROWS ? "rows" : "columns", time);
+}
+
+// Coordinate descent: every parameter is swept with the others fixed at the best values so far
+static void autotune(uint64_t M, uint64_t N, uint64_t K, long int max_threads)
+{
+    matrix A(K, M, 1.0);
+    matrix B(N, K, 1.0);
+
+    block_mult_options best = detect_block_mult_options();
+    best.traversal_ = TRAVERSE_COLUMNS;
+    long int best_threads = max_threads;
+    double best_time = time_block_mult(A, B, best_threads, best);
+    print_config("start", best_threads, best, best_time);
+
+    std::vector<long int> threads;
+    for (long int num = 1; num < max_threads; num *= 2)
+        threads.push_back(num);
+    threads.push_back(max_threads);
+
+    for (long int num : threads)
+    {
+        double time = time_block_mult(A, B, num, best);
+        if (time < best_time)
+        {
+            best_time    = time;
+            best_threads = num;
+        }
+    }
+    print_config("threads", best_threads, best, best_time);
+
+    const uint64_t kc_values[] = {32, 64, 128, 192, 256, 384, 512};
+    const uint64_t mc_values[] = {32, 64, 128, 256, 512, best.mc_ / 2, best.mc_, best.mc_ * 2};
+    const uint64_t nc_values[] = {64, 256, 1024, 4096, best.nc_};
+    uint64_t block_mult_options::* fields[] = {&block_mult_options::kc_, &block_mult_options::mc_, &block_mult_options::nc_};
+    const uint64_t* values[] = {kc_values, mc_values, nc_values};
+    size_t num_values[] = {sizeof(kc_values) / sizeof(*kc_values), sizeof(mc_values) / sizeof(*mc_values),
+                           sizeof(nc_values) / sizeof(*nc_values)};
+    const char* names[] = {"kc", "mc", "nc"};
+
+    for (int field = 0; field < 3; field++)
+    {
+        block_mult_options candidate = best;
+        for (size_t i = 0; i < num_values[field]; i++)
+        {
+            if (values[field][i] == 0)
+                continue;
+
+            candidate.*fields[field] = values[field][i];
+            double time = time_block_mult(A, B, best_threads, candidate);
+            if (time < best_time)
+            {
+                best_time = time;
+                best      = candidate;
+            }
+        }
+        print_config(names[field], best_threads, best, best_time);
+    }
+
+    block_mult_options candidate = best;
+    candidate.traversal_ = (best.traversal_ == TRAVERSE_ROWS) ? TRAVERSE_COLUMNS : TRAVERSE_ROWS;
+    double time = time_block_mult(A, B, best_threads, candidate);
+    if (time < best_time)
+    {
+        best_time = time;
+        best      = candidate;
+    }
+    print_config("traversal", best_threads, best, best_time);
+
+    double gflops = 2.0 * M * N * K / best_time * 1e-9;
+    printf("Best: %lg s, %lg GFLOPS\n", best_time, gflops);
+
+    block_mult_profile_entry entry = {M, N, K, best_threads, best};
+    if (!save_block_mult_profile_entry(entry))
+        exit(EXIT_FAILURE);
+    printf("Saved to %s\n", block_mult_profile_path());
+}
+
+// Square sizes from 256 up to max_size doubling, classic and Strassen-Winograd on the same operands
+static void strassen_compare(uint64_t max_size, long int num_threads, uint64_t crossover)
+{
+    block_mult_options classic;
+    classic.algorithm_ = ALGO_CLASSIC;
+    block_mult_options strassen;
+    strassen.algorithm_          = ALGO_STRASSEN;
+    strassen.strassen_crossover_ = crossover;
+
+    uint64_t effective = (crossover != 0) ? crossover : STRASSEN_DEF_CROSSOVER;
+    srand(1);
+    for (uint64_t size = 256; size <= max_size; size *= 2)
+    {
+        matrix A(size, size);
+        matrix B(size, size);
+        for (uint64_t i = 0; i < size * size; i++)
+        {
+            A.data()[i] = (double)rand() / RAND_MAX - 0.5;
+            B.data()[i] = (double)rand() / RAND_MAX - 0.5;
+        }
+
+        double classic_time  = time_block_mult(A, B, num_threads, classic);
+        double strassen_time = time_block_mult(A, B, num_threads, strassen);
+
+        matrix C_classic  = A.block_mult(B, num_threads, classic);
+        matrix C_strassen = A.block_mult(B, num_threads, strassen);
+        double max_error  = max_difference(C_classic.data(), C_strassen.data(), size * size);
+
+        const char* verdict = (size <= effective) ? "below crossover, same path" :
+                              (strassen_time < classic_time) ? "strassen wins" : "classic wins";
+        printf("n = %5lu: classic %lg s, strassen %lg s (x%.2lf), max error %lg - %s\n", size, classic_time, strassen_time,
+               classic_time / strassen_time, max_error, verdict);
+    }
+}
+
+// count independent size x size products: one block_mult call each against one batch
+static void batch_compare(uint64_t size, uint64_t count, long int num_threads)
+{
+    std::vector<matrix> A;
+    std::vector<matrix> B;
+    std::vector<const matrix*> A_batch;
+    std::vector<const matrix*> B_batch;
+    A.reserve(count);
+    B.reserve(count);
+    for (uint64_t i = 0; i < count; i++)
+    {
+        A.emplace_back(size, size);
+        B.emplace_back(size, size);
+        for (uint64_t j = 0; j < size * size; j++)
+        {
+            A[i].data()[j] = (double)rand() / RAND_MAX - 0.5;
+            B[i].data()[j] = (double)rand() / RAND_MAX - 0.5;
+        }
+        A_batch.push_back(&A[i]);
+        B_batch.push_back(&B[i]);
+    }
+
+    // both keep all the products, so they pay for the same fresh result memory
+    double single_time = best_time([&](int)
+    {
+        std::vector<matrix> products;
+        products.reserve(count);
+        for (uint64_t j = 0; j < count; j++)
+            products.push_back(A[j].block_mult(B[j], num_threads));
+    });
+    double batch_time = best_time([&](int)
+    {
+        std::vector<matrix> C = batch_block_mult(A_batch, B_batch, num_threads);
+    });
+
+    double flops = 2.0 * size * size * size * count;
+    printf("%lu products %lu x %lu: block_mult %lg s (%lg GFLOPS), batch %lg s (%lg GFLOPS), x%.2lf\n", count, size, size,
+           single_time, flops / single_time * 1e-9, batch_time, flops / batch_time * 1e-9, single_time / batch_time);
+}
+
+// size x size A with density share of nonzeros (a tenth of the rows are ten times
+// denser, so rows are skewed) times dense B: block_mult of dense A against CSR A
+static void sparse_compare(uint64_t size, double density, long int num_threads)
+{
+    matrix A(size, size, 0.0);
+    matrix B(size, size);
+    for (uint64_t row = 0; row < size; row++)
+    {
+        double row_density = (row % 10 == 0) ? std::min(1.0, density * 10) : density;
+        for (uint64_t col = 0; col < size; col++)
+        {
+            if ((double)rand() / RAND_MAX < row_density)
+                A.data()[row * size + col] = (double)rand() / RAND_MAX - 0.5;
+            B.data()[row * size + col] = (double)rand() / RAND_MAX - 0.5;
+        }
+    }
+    csr_matrix A_sparse(A);
+
+    matrix C_dense   = A.block_mult(B, num_threads);
+    double max_error = 0.0;
+    double dense_time = time_block_mult(A, B, num_threads, block_mult_options());
+    double sparse_time = best_time([&](int run)
+    {
+        matrix C = A_sparse.block_mult(B, num_threads);
+        if (run == 0)
+            max_error = max_difference(C_dense.data(), C.data(), size * size);
+    });
+
+    printf("n = %lu, %lu nonzeros (%.2lf%%): block_mult %lg s, csr %lg s (x%.2lf), max difference %lg\n", size,
+           A_sparse.nonzeros(), 100.0 * A_sparse.nonzeros() / (size * size), dense_time, sparse_time,
+           dense_time / sparse_time, max_error);
+}
+
+// size x size A times count vectors: the tile pipeline (timings keep block_mult
+// from taking gemv) against gemv_batch, bandwidth counts reading A once
+static void gemv_compare(uint64_t size, uint64_t count, long int num_threads)
+{
+    matrix A(size, size);
+    matrix X(count, size);
+    matrix X_rows(size, count); // the same vectors as rows for gemv_batch
+    for (uint64_t i = 0; i < size * size; i++)
+        A.data()[i] = (double)rand() / RAND_MAX - 0.5;
+    for (uint64_t k = 0; k < size; k++)
+        for (uint64_t vec = 0; vec < count; vec++)
+            X_rows.data()[vec * size + k] = X.data()[k * count + vec] = (double)rand() / RAND_MAX - 0.5;
+
+    block_mult_timings timings;
+    block_mult_options piped;
+    piped.timings_ = &timings;
+    std::vector<double> Y(count * size);
+
+    double tiled_time = time_block_mult(A, X, num_threads, piped);
+    double gemv_time  = best_time([&](int)
+    {
+        gemv_batch(OP_N, 1.0, A, X_rows.data(), size, 0.0, Y.data(), size, count, num_threads);
+    });
+
+    matrix C = A.block_mult(X, num_threads, piped);
+    double max_error = 0.0;
+    for (uint64_t row = 0; row < size; row++)
+        for (uint64_t vec = 0; vec < count; vec++)
+            max_error = std::max(max_error, std::fabs(C.data()[row * count + vec] - Y[vec * size + row]));
+
+    double bytes = (double)size * size * sizeof(double);
+    printf("n = %lu, %lu vectors: tiles %lg s (%lg GB/s), gemv %lg s (%lg GB/s), x%.2lf, max difference %lg\n", size, count,
+           tiled_time, bytes / tiled_time * 1e-9, gemv_time, bytes / gemv_time * 1e-9, tiled_time / gemv_time, max_error);
+}
+
+// count independent size x size products one after another by block_mult and all
+// started at once by block_mult_async, then waited for
+static void async_compare(uint64_t size, uint64_t count, long int num_threads)
+{
+    std::vector<matrix> A;
+    std::vector<matrix> B;
+    for (uint64_t i = 0; i < count; i++)
+    {
+        A.emplace_back(size, size);
+        B.emplace_back(size, size);
+        for (uint64_t j = 0; j < size * size; j++)
+        {
+            A[i].data()[j] = (double)rand() / RAND_MAX - 0.5;
+            B[i].data()[j] = (double)rand() / RAND_MAX - 0.5;
+        }
+    }
+
+    std::vector<matrix> sync_C;
+    for (uint64_t j = 0; j < count; j++)
+        sync_C.push_back(A[j].block_mult(B[j], num_threads));
+
+    double sync_time = best_time([&](int)
+    {
+        std::vector<matrix> C;
+        for (uint64_t j = 0; j < count; j++)
+            C.push_back(A[j].block_mult(B[j], num_threads));
+    });
+
+    double max_error  = 0.0;
+    double async_time = best_time([&](int run)
+    {
+        std::vector<std::future<matrix>> futures;
+        std::vector<matrix> C;
+        for (uint64_t j = 0; j < count; j++)
+            futures.push_back(block_mult_async(A[j], B[j], num_threads));
+        for (uint64_t j = 0; j < count; j++)
+            C.push_back(futures[j].get());
+
+        if (run == 0)
+            for (uint64_t j = 0; j < count; j++)
+                max_error = std::max(max_error, max_difference(sync_C[j].data(), C[j].data(), size * size));
+    });
+
+    double flops = 2.0 * size * size * size * count;
+    printf("n = %lu, %lu products: block_mult %lg s (%lg GFLOPS), async %lg s (%lg GFLOPS), x%.2lf, max difference %lg\n",
+           size, count, sync_time, flops / sync_time * 1e-9, async_time, flops / async_time * 1e-9, sync_time / async_time,
+           max_error);
+}
+
+static void print_stats(const block_mult_stats& stats)
+{
+    const char* names[PHASE_COUNT] = {"pack A", "pack B", "zero C", "compute", "unpack C"};
+    for (int phase = 0; phase < PHASE_COUNT; phase++)
+        printf("Phase %-8s %lg .. %lg s\n", names[phase], stats.phase_begin_[phase], stats.phase_end_[phase]);
+
+    for (size_t i = 0; i < stats.threads_.size(); i++)
+    {
+        const block_mult_thread_stats& thread = stats.threads_[i];
+        printf("Thread %3zu cpu %3d: busy %lg s, idle %lg s, %lu tasks, %lu steals, %lu tiles", i, thread.cpu_,
+               thread.busy_, thread.idle_, thread.tasks_, thread.steals_, thread.tiles_);
+        if (thread.cycles_ >= 0)
+            printf(", %ld cycles", thread.cycles_);
+        if (thread.llc_misses_ >= 0)
+            printf(", %ld LLC misses", thread.llc_misses_);
+        if (thread.dtlb_misses_ >= 0)
+            printf(", %ld dTLB misses", thread.dtlb_misses_);
+        printf("\n");
+    }
+}
+
+// n x n product with the NUMA mode off and on, traffic of the kernels by node of the pages
+static void numa_compare(uint64_t size, long int num_threads)
+{
+    matrix A(size, size);
+    matrix B(size, size);
+    for (uint64_t i = 0; i < size * size; i++)
+    {
+        A.data()[i] = (double)rand() / RAND_MAX - 0.5;
+        B.data()[i] = (double)rand() / RAND_MAX - 0.5;
+    }
+
+    const char* names[2] = {"default", "numa"};
+    for (int numa = 0; numa < 2; numa++)
+    {
+        block_mult_numa_stats stats = {};
+        block_mult_options options;
+        options.numa_ = (numa != 0);
+        double time = time_block_mult(A, B, num_threads, options);
+
+        options.numa_stats_ = &stats;
+        matrix C = A.block_mult(B, num_threads, options);
+
+        double total = (double)(stats.local_bytes_ + stats.remote_bytes_);
+        printf("%-7s nodes = %ld, B %s: %lg s, %lg GFLOPS, local %.1lf MiB, remote %.1lf MiB (%.1lf%% local)\n",
+               names[numa], stats.num_nodes_, stats.B_replicated_ ? "per node" : "shared", time,
+               2.0 * size * size * size / time * 1e-9, stats.local_bytes_ / 1048576.0, stats.remote_bytes_ / 1048576.0,
+               (total > 0.0) ? 100.0 * stats.local_bytes_ / total : 100.0);
+    }
+}
+
+// n x n product of one element type, operands are small integers exact in every type
+template <typename T>
+static void time_element_type(const char* name, uint64_t size, long int num_threads)
+{
+    basic_matrix<T> A(size, size);
+    basic_matrix<T> B(size, size);
+    for (uint64_t i = 0; i < size * size; i++)
+    {
+        A.data()[i] = (T)(rand() % 7 - 3);
+        B.data()[i] = (T)(rand() % 7 - 3);
+    }
+
+    double best = best_time([&](int)
+    {
+        basic_matrix<typename accumulator<T>::type> C = A.block_mult(B, num_threads);
+    });
+
+    printf("%-6s tile %2u x %-2u kernel %-7s %lg s, %lg G(FL)OPS\n", name, block_traits<T>::tile_dim, block_traits<T>::tile_dim,
+           micro_kernel_name<T>(), best, 2.0 * size * size * size / best * 1e-9);
+}
+
+// n x n double product in full and mixed precision and a float one of the same
+// data, errors are against the full double result
+static void mixed_compare(uint64_t size, long int num_threads)
+{
+    matrix A(size, size);
+    matrix B(size, size);
+    matrix_f32 A_f32(size, size);
+    matrix_f32 B_f32(size, size);
+    for (uint64_t i = 0; i < size * size; i++)
+    {
+        A_f32.data()[i] = A.data()[i] = (double)rand() / RAND_MAX - 0.5;
+        B_f32.data()[i] = B.data()[i] = (double)rand() / RAND_MAX - 0.5;
+    }
+
+    block_mult_options full;
+    block_mult_options mixed;
+    mixed.mixed_precision_ = true;
+
+    double flops = 2.0 * size * size * size;
+    matrix exact = A.block_mult(B, num_threads, full);
+    double full_time = time_block_mult(A, B, num_threads, full);
+    printf("double %lg s, %lg GFLOPS\n", full_time, flops / full_time * 1e-9);
+
+    matrix product = A.block_mult(B, num_threads, mixed);
+    double mixed_time = time_block_mult(A, B, num_threads, mixed);
+    double max_error = max_difference(product.data(), exact.data(), size * size);
+    printf("mixed  %lg s, %lg GFLOPS (x%.2lf), max error %lg\n", mixed_time, flops / mixed_time * 1e-9,
+           full_time / mixed_time, max_error);
+
+    double f32_time = best_time([&](int run)
+    {
+        matrix_f32 C = A_f32.block_mult(B_f32, num_threads);
+        if (run == 0)
+            max_error = max_difference(C.data(), exact.data(), size * size);
+    });
+    printf("float  %lg s, %lg GFLOPS (x%.2lf), max error %lg\n", f32_time, flops / f32_time * 1e-9, full_time / f32_time,
+           max_error);
+}
+
+// Chain of dims[i] x dims[i + 1] matrices: left to right by block_mult (row-major
+// intermediates) against chain_mult (cheapest order, tiled intermediates)
+static void chain_compare(const std::vector<uint64_t>& dims, long int num_threads)
+{
+    std::vector<matrix> chain;
+    std::vector<matrix*> pointers;
+    for (uint64_t i = 0; i + 1 < dims.size(); i++)
+    {
+        chain.emplace_back(dims[i + 1], dims[i]);
+        for (uint64_t j = 0; j < dims[i] * dims[i + 1]; j++)
+            chain.back().data()[j] = (double)rand() / RAND_MAX - 0.5;
+    }
+    for (matrix& cur : chain)
+        pointers.push_back(&cur);
+
+    double in_order = 0.0;
+    for (uint64_t i = 1; i + 1 < dims.size(); i++)
+        in_order += (double)dims[0] * dims[i] * dims[i + 1];
+    std::vector<uint64_t> split;
+    double best_order = chain_order(dims, &split);
+
+    std::unique_ptr<matrix> left;
+    double left_time = best_time([&](int)
+    {
+        left.reset(new matrix(chain[0]));
+        for (uint64_t j = 1; j < chain.size(); j++)
+            left.reset(new matrix(left->block_mult(chain[j], num_threads)));
+    });
+
+    double max_error  = 0.0;
+    double chain_time = best_time([&](int run)
+    {
+        matrix best = chain_mult(pointers, num_threads);
+        if (run == 0)
+            max_error = max_difference(left->data(), best.data(), dims[0] * dims.back());
+    });
+
+    printf("%zu matrices: left to right %lg GFLOP %lg s, chain_mult %lg GFLOP %lg s (x%.2lf), max difference %lg\n",
+           chain.size(), 2.0 * in_order * 1e-9, left_time, 2.0 * best_order * 1e-9, chain_time, left_time / chain_time,
+           max_error);
+}
+
+// count n x n products with the workspace emptied before every one (each product
+// allocates and faults its buffers in) and with the buffers of the previous one reused
+static void workspace_compare(uint64_t size, uint64_t count, long int num_threads)
+{
+    matrix A(size, size);
+    matrix B(size, size);
+    for (uint64_t i = 0; i < size * size; i++)
+    {
+        A.data()[i] = (double)rand() / RAND_MAX - 0.5;
+        B.data()[i] = (double)rand() / RAND_MAX - 0.5;
+    }
+
+    workspace& arena = workspace::instance();
+    const char* names[2] = {"fresh", "reused"};
+    for (int reuse = 0; reuse < 2; reuse++)
+    {
+        arena.trim();
+        workspace_stats before = arena.stats();
+        struct rusage usage_before;
+        getrusage(RUSAGE_SELF, &usage_before);
+
+        auto start = std::chrono::high_resolution_clock::now();
+        for (uint64_t i = 0; i < count; i++)
+        {
+            if (!reuse)
+                arena.trim();
+            matrix C = A.block_mult(B, num_threads);
+        }
+        std::chrono::duration<double> exec_time = std::chrono::high_resolution_clock::now() - start;
+
+        struct rusage usage_after;
+        getrusage(RUSAGE_SELF, &usage_after);
+        workspace_stats after = arena.stats();
+        printf("%-6s %lg s per product, %ld page faults, %lu of %lu buffers reused, %lu allocated, peak %lg MiB\n",
+               names[reuse], exec_time.count() / count, usage_after.ru_minflt - usage_before.ru_minflt,
+               after.reuse_hits_ - before.reuse_hits_, after.acquires_ - before.acquires_,
+               after.allocations_ - before.allocations_, after.peak_bytes_ / 1048576.0);
+    }
+}
+
+// kB of the process backed by huge pages (transparent and hugetlbfs), -1 if unknown
+static int64_t huge_page_kb()
+{
+    FILE* smaps = fopen("/proc/self/smaps_rollup", "r");
+    if (smaps == NULL)
+        return -1;
+
+    int64_t total = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), smaps) != NULL)
+    {
+        long int kb = 0;
+        if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1 || sscanf(line, "Private_Hugetlb: %ld kB", &kb) == 1)
+            total += kb;
+    }
+
+    fclose(smaps);
+    return total;
+}
+
+// n x n product with the packed buffers on regular pages, transparent huge pages
+// and the hugetlb pool: time, dTLB misses of the kernels and huge page backing
+static void huge_pages_compare(uint64_t size, long int num_threads)
+{
+    matrix A(size, size);
+    matrix B(size, size);
+    for (uint64_t i = 0; i < size * size; i++)
+    {
+        A.data()[i] = (double)rand() / RAND_MAX - 0.5;
+        B.data()[i] = (double)rand() / RAND_MAX - 0.5;
+    }
+
+    workspace& arena = workspace::instance();
+    huge_page_policy saved = arena.huge_pages();
+
+    const huge_page_policy policies[3] = {HUGE_PAGES_OFF, HUGE_PAGES_ADVISE, HUGE_PAGES_HUGETLB};
+    const char* names[3] = {"off", "advise", "hugetlb"};
+    for (int i = 0; i < 3; i++)
+    {
+        arena.set_huge_pages(policies[i]);
+        workspace_stats before = arena.stats();
+
+        block_mult_options options;
+        double time = time_block_mult(A, B, num_threads, options);
+
+        // the buffers stay cached in the workspace, so their backing is still there to see
+        int64_t huge_kb = huge_page_kb();
+
+        block_mult_stats stats;
+        stats.hw_counters_ = true;
+        options.stats_     = &stats;
+        matrix C = A.block_mult(B, num_threads, options);
+
+        int64_t dtlb_misses = 0;
+        for (size_t thread = 0; thread < stats.threads_.size() && dtlb_misses >= 0; thread++)
+            dtlb_misses = (stats.threads_[thread].dtlb_misses_ >= 0) ? dtlb_misses + stats.threads_[thread].dtlb_misses_ : -1;
+
+        workspace_stats after = arena.stats();
+        printf("%-7s %lg s, %lg GFLOPS, ", names[i], time, 2.0 * size * size * size / time * 1e-9);
+        if (dtlb_misses >= 0)
+            printf("%ld dTLB misses, ", dtlb_misses);
+        else
+            printf("dTLB misses n/a, ");
+        printf("%lg MiB on huge pages, %lu huge regions, %lu hugetlb fallbacks\n", (huge_kb >= 0) ? huge_kb / 1024.0 : -1.0,
+               after.huge_regions_ - before.huge_regions_, after.hugetlb_fallbacks_ - before.hugetlb_fallbacks_);
+    }
+
+    arena.set_huge_pages(saved);
+}
+
+static uint64_t size_arg(int argc, char* argv[], int i, uint64_t fallback = 0)
+{
+    return (i < argc) ? strtoull(argv[i], NULL, 10) : fallback;
+}
+
+// 0 (the default) is the tuned profile
+static long int threads_arg(int argc, char* argv[], int i)
+{
+    return (i < argc) ? strtol(argv[i], NULL, 10) : 0;
+}
+
+// Mode runners get the arguments after the mode name and return false on bad ones
+
+static bool run_convert(int argc, char* argv[])
+{
+    if (argc == 3 && strcmp(argv[2], "tiled") != 0)
+        return false;
+
+    matrix A(argv[0]);
+    if (argc == 3)
+        A.save_binary(argv[1], LAYOUT_TILED);
+    else
+        save_matrix(A, argv[1]);
+    return true;
+}
+
+static bool run_tune(int argc, char* argv[])
+{
+    uint64_t M = size_arg(argc, argv, 0);
+    uint64_t N = size_arg(argc, argv, 1);
+    uint64_t K = size_arg(argc, argv, 2);
+    long int max_threads = (argc == 4) ? strtol(argv[3], NULL, 10) : (long int)std::thread::hardware_concurrency();
+    if (M == 0 || N == 0 || K == 0 || max_threads <= 0)
+        return false;
+
+    autotune(M, N, K, max_threads);
+    return true;
+}
+
+static bool run_stream(int argc, char* argv[])
+{
+    stream_mult_options options;
+    if (argc == 5)
+        options.memory_budget_ = size_arg(argc, argv, 4) << 20;
+
+    auto start = std::chrono::high_resolution_clock::now();
+    stream_block_mult(argv[0], argv[1], argv[2], strtol(argv[3], NULL, 10), options);
+    std::chrono::duration<double> exec_time = std::chrono::high_resolution_clock::now() - start;
+    std::cout << "Execution time (with I/O): " << exec_time.count() << "\n";
+    return true;
+}
+
+static bool run_strassen(int argc, char* argv[])
+{
+    strassen_compare(size_arg(argc, argv, 0), threads_arg(argc, argv, 1), size_arg(argc, argv, 2));
+    return true;
+}
+
+static bool run_types(int argc, char* argv[])
+{
+    uint64_t size    = size_arg(argc, argv, 0);
+    long int threads = threads_arg(argc, argv, 1);
+    time_element_type<double>("double", size, threads);
+    time_element_type<float>("float", size, threads);
+    time_element_type<int32_t>("int32", size, threads);
+    time_element_type<int8_t>("int8", size, threads);
+    return true;
+}
+
+static bool run_mixed(int argc, char* argv[])
+{
+    mixed_compare(size_arg(argc, argv, 0), threads_arg(argc, argv, 1));
+    return true;
+}
+
+static bool run_chain(int argc, char* argv[])
+{
+    std::vector<uint64_t> dims;
+    for (int i = 1; i < argc; i++)
+        dims.push_back(size_arg(argc, argv, i));
+    chain_compare(dims, threads_arg(argc, argv, 0));
+    return true;
+}
+
+static bool run_workspace(int argc, char* argv[])
+{
+    workspace_compare(size_arg(argc, argv, 0), size_arg(argc, argv, 1), threads_arg(argc, argv, 2));
+    return true;
+}
+
+static bool run_huge_pages(int argc, char* argv[])
+{
+    huge_pages_compare(size_arg(argc, argv, 0), threads_arg(argc, argv, 1));
+    return true;
+}
+
+static bool run_numa(int argc, char* argv[])
+{
+    numa_compare(size_arg(argc, argv, 0), threads_arg(argc, argv, 1));
+    return true;
+}
+
+static bool run_batch(int argc, char* argv[])
+{
+    batch_compare(size_arg(argc, argv, 0), size_arg(argc, argv, 1), threads_arg(argc, argv, 2));
+    return true;
+}
+
+static bool run_sparse(int argc, char* argv[])
+{
+    sparse_compare(size_arg(argc, argv, 0), strtod(argv[1], NULL), threads_arg(argc, argv, 2));
+    return true;
+}
+
+static bool run_gemv(int argc, char* argv[])
+{
+    gemv_compare(size_arg(argc, argv, 0), size_arg(argc, argv, 1), threads_arg(argc, argv, 2));
+    return true;
+}
+
+static bool run_async(int argc, char* argv[])
+{
+    async_compare(size_arg(argc, argv, 0), size_arg(argc, argv, 1), threads_arg(argc, argv, 2));
+    return true;
+}
+
+// ./mul --name args...
+struct bench_mode
+{
+    const char* name_;
+    const char* usage_;    // the arguments
+    int         min_args_;
+    int         max_args_; // -1: no limit
+    bool      (*run_)(int argc, char* argv[]);
+};
+
+static const bench_mode BENCH_MODES[] =
+{
+    {"tune",      "M N K [max_threads]",                                  3,  4, run_tune},
+    {"convert",   "in.matr|in.matb out.matb|out.matr [tiled]",            2,  3, run_convert},
+    {"stream",    "A.matb B.matb C.matb num_threads [memory_budget_MiB]", 4,  5, run_stream},
+    {"strassen",  "max_size [num_threads] [crossover]",                   1,  3, run_strassen},
+    {"types",     "size [num_threads]",                                   1,  2, run_types},
+    {"mixed",     "size [num_threads]",                                   1,  2, run_mixed},
+    {"chain",     "num_threads d0 d1 ... dn",                             3, -1, run_chain},
+    {"workspace", "size count [num_threads]",                             2,  3, run_workspace},
+    {"hugepages", "size [num_threads]",                                   1,  2, run_huge_pages},
+    {"numa",      "size [num_threads]",                                   1,  2, run_numa},
+    {"batch",     "size count [num_threads]",                             2,  3, run_batch},
+    {"sparse",    "size density [num_threads]",                           2,  3, run_sparse},
+    {"gemv",      "size count [num_threads]",                             2,  3, run_gemv},
+    {"async",     "size count [num_threads]",                             2,  3, run_async},
+};
+
+static const bench_mode* find_mode(const char* arg)
+{
+    if (strncmp(arg, "--", 2) != 0)
+        return nullptr;
+
+    for (const bench_mode& mode : BENCH_MODES)
+        if (strcmp(arg + 2, mode.name_) == 0)
+            return &mode;
+    return nullptr;
+}
 
 int main(int argc, char* argv[])
 {
-    if (argc != 5)
+    const bench_mode* mode = (argc >= 2) ? find_mode(argv[1]) : nullptr;
+    if (mode != nullptr)
+    {
+        int num_args = argc - 2;
+        bool good = num_args >= mode->min_args_ && (mode->max_args_ < 0 || num_args <= mode->max_args_);
+
+        try
+        {
+            good = good && mode->run_(num_args, argv + 2);
+        }
+        catch (std::exception &error)
+        {
+            std::cout << error.what();
+            exit(EXIT_FAILURE);
+        }
+
+        if (!good)
+        {
+            printf("Try ./mul --%s %s\n", mode->name_, mode->usage_);
+            exit(EXIT_FAILURE);
+        }
+        return 0;
+    }
+
+    if (argc != 5 && argc != 8)
     {
         printf("Bad number of input arguments\n");
-        printf("Try ./mul A.matr B.matr out.matr num_threads\n");
+        printf("Try ./mul A.matr B.matr out.matr num_threads [mc kc nc]\n");
+        for (const bench_mode& cur : BENCH_MODES)
+            printf("or  ./mul --%s %s\n", cur.name_, cur.usage_);
+        printf("Inputs may be text .matr or binary .matb, out.matb is written as binary\n");
+        printf("num_threads = 0 and no block sizes use the tuned profile\n");
+        printf("BLOCK_MATRIX_STATS=1|hw prints phases and threads, BLOCK_MATRIX_DUMP=prefix dumps packed operands\n");
         exit(EXIT_FAILURE);
     }
 
@@ -22,19 +811,62 @@ int main(int argc, char* argv[])
         exit(EXIT_FAILURE);
     }
 
+    block_mult_timings timings = {};
+    block_mult_options options;
+    options.timings_ = &timings;
+
+    // BLOCK_MATRIX_STATS=1 prints phases and threads, =hw adds hardware counters
+    block_mult_stats stats;
+    const char* stats_mode = getenv("BLOCK_MATRIX_STATS");
+    if (stats_mode != nullptr && strcmp(stats_mode, "0") != 0)
+    {
+        stats.hw_counters_ = (strcmp(stats_mode, "hw") == 0);
+        options.stats_ = &stats;
+    }
+    options.debug_dump_ = getenv("BLOCK_MATRIX_DUMP");
+    if (argc == 8)
+    {
+        options.mc_ = strtoull(argv[5], NULL, 10);
+        options.kc_ = strtoull(argv[6], NULL, 10);
+        options.nc_ = strtoull(argv[7], NULL, 10);
+        printf("Block sizes: mc = %lu, kc = %lu, nc = %lu\n", options.mc_, options.kc_, options.nc_);
+    }
+
     try
     {
+        auto read_start = std::chrono::high_resolution_clock::now();
         matrix A(argv[1]);
         matrix B(argv[2]);
+        std::chrono::duration<double> read_time = std::chrono::high_resolution_clock::now() - read_start;
+        std::cout << "Read time: " << read_time.count() << "\n";
 
         auto start = std::chrono::high_resolution_clock::now();
-        matrix C = A.block_mult(B, num_threads);
+        matrix C = A.block_mult(B, num_threads, options);
         auto end   = std::chrono::high_resolution_clock::now();
 
         std::chrono::duration<double> exec_time = end - start;
         std::cout << "Execution time: " << exec_time.count() << "\n";
+        printf("Stages: pack A %lg s, pack B %lg s, zero C %lg s, compute %lg s, unpack C %lg s\n", timings.pack_A_,
+               timings.pack_B_, timings.pack_C_, timings.compute_, timings.unpack_);
+
+        if (options.stats_ != nullptr)
+            print_stats(stats);
+
+        thread_pool_stats pool_stats = thread_pool::instance().stats();
+        double idle = 0.0;
+        double busy = 0.0;
+        for (size_t i = 0; i < pool_stats.idle_seconds_.size(); i++)
+        {
+            idle += pool_stats.idle_seconds_[i];
+            busy += pool_stats.busy_seconds_[i];
+        }
+        printf("Pool: %zu workers, %lu jobs, max queue depth %lu, idle %lg s, busy %lg s\n", pool_stats.idle_seconds_.size(),
+               pool_stats.jobs_, pool_stats.max_queue_depth_, idle, busy);
 
-        C.save(argv[3]);
+        auto write_start = std::chrono::high_resolution_clock::now();
+        save_matrix(C, argv[3]);
+        std::chrono::duration<double> write_time = std::chrono::high_resolution_clock::now() - write_start;
+        std::cout << "Write time: " << write_time.count() << "\n";
     }
     catch (std::exception &error)
     {
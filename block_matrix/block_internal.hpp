@@ -0,0 +1,91 @@
+#pragma once
+
+// Packed (tiled) representation shared by the block_mult pipeline parts
+
+#include "block_matrix.hpp"
+#include "kernels.hpp"
+#include "workspace.hpp"
+#include <cstdint>
+#include <vector>
+
+// Tiles are block_traits<T>::tile_dim square
+template <typename T>
+struct block
+{
+    int cols_;
+    int rows_;
+    T* data_;
+} __attribute__((aligned(64)));
+
+// The grid, its tile descriptors and the tiles are one region of workspace::instance()
+// (of aligned_alloc if workspace_ is nullptr)
+template <typename T>
+struct matrix_of_blocks
+{
+    uint64_t cols_;
+    uint64_t rows_;
+    block<T>* matrix_;
+    T*        data_;
+    workspace* workspace_;
+} __attribute__((aligned(64)));
+
+// Packs num_rows x num_cols matrix with row_stride elements between rows
+// (nullptr matrix - zero filled) into row-major grid of row-major tiles.
+// Rows of tiles are split between num_threads threads of pool (nullptr - thread_pool::instance()).
+// node_tile_rows (NUMA mode): threads of node n pack grid rows [node_tile_rows[n], node_tile_rows[n + 1]).
+// source_transposed: matrix is stored transposed (num_cols x num_rows, row_stride between its rows).
+// Tiles hold P elements converted from T (mixed_f32 tiles of a double matrix)
+template <typename T, typename P = T>
+matrix_of_blocks<P>* produce_block_matrix(uint64_t num_cols, uint64_t num_rows, const T* matrix, uint64_t row_stride,
+                                          long int num_threads = 1, thread_pool* pool = nullptr,
+                                          const std::vector<uint64_t>* node_tile_rows = nullptr,
+                                          bool source_transposed = false);
+// Packs B operand: grid of tiles is transposed, so a column of tiles is contiguous
+template <typename T, typename P = T>
+matrix_of_blocks<P>* produce_trans_block(uint64_t num_cols, uint64_t num_rows, const T* matrix, uint64_t row_stride,
+                                         long int num_threads = 1, thread_pool* pool = nullptr,
+                                         const std::vector<uint64_t>* node_tile_rows = nullptr,
+                                         bool source_transposed = false);
+template <typename T>
+void block_distruct(matrix_of_blocks<T>* matr);
+
+// Unpacks blocks into rows x cols matrix with row_stride elements between rows:
+// data = alpha * blocks + beta * data (data isn't read if beta == 0)
+template <typename T>
+void fill_matrix_from_block_matrix(T* data, uint64_t rows, uint64_t cols, uint64_t row_stride, matrix_of_blocks<T>* blocks,
+                                   long int num_threads = 1, thread_pool* pool = nullptr, T alpha = 1, T beta = 0);
+
+// Fields left zero are taken from the tuned profile, then from cache sizes
+block_mult_options resolve_options(const block_mult_options& options, uint64_t M, uint64_t N, uint64_t K, long int* num_threads);
+
+// NUMA mode placement of one product: node n owns tile rows [node_tile_rows_[n],
+// node_tile_rows_[n + 1]) of A and C, B_replicas_[n] is its copy of packed B
+// (empty - all nodes read the same B)
+template <typename T>
+struct numa_plan
+{
+    std::vector<uint64_t>             node_tile_rows_;
+    std::vector<matrix_of_blocks<T>*> B_replicas_;
+};
+
+// C_return = A_normal * B_transp on num_threads threads of options.pool_.
+// B_transposed == false: B is a row-major grid of tiles (tiled matrix storage).
+// numa: threads compute C blocks of their own node first (rows are traversed).
+// accumulate: C_return += A_normal * B_transp (a k-panel of a longer product)
+template <typename T>
+int mult_prep_block_matr_multitread(matrix_of_blocks<T>* A_normal, matrix_of_blocks<T>* B_transp,
+                                    matrix_of_blocks<typename block_traits<T>::acc_t>* C_return,
+                                    long int num_threads, const block_mult_options& options, bool B_transposed = true,
+                                    const numa_plan<T>* numa = nullptr, bool accumulate = false);
+
+// C (M x N) = op(A) (M x K) * op(B) (K x N) through the packed pipeline, ld* are
+// row strides of the matrices as stored (a transposed A is K x M in memory)
+template <typename T>
+int block_mult_view(const T* A, uint64_t lda, const T* B, uint64_t ldb, typename block_traits<T>::acc_t* C, uint64_t ldc,
+                    uint64_t M, uint64_t K, uint64_t N, long int num_threads, const block_mult_options& options,
+                    mult_op op_A = OP_N, mult_op op_B = OP_N);
+
+// The same product by Strassen-Winograd recursion over block_mult_view (float and double)
+template <typename T>
+int strassen_mult(const T* A, uint64_t lda, const T* B, uint64_t ldb, T* C, uint64_t ldc,
+                  uint64_t M, uint64_t K, uint64_t N, long int num_threads, const block_mult_options& options);
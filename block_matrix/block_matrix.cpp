@@ -1,393 +1,538 @@
 #include "block_matrix.hpp"
+#include "block_internal.hpp"
+#include "errors.hpp"
+#include "kernels.hpp"
+#include "matrix_io.hpp"
+#include "numa.hpp"
+#include "perf_counters.hpp"
+#include "thread_pool.hpp"
 #include <assert.h>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include <sched.h>
+#include <sys/mman.h>
+
+template <typename T>
+static matrix_of_blocks<T>* alloc_block_matrix(uint64_t all_block_cols, uint64_t all_block_rows, bool fresh_pages = false);
+template <typename T>
+static void describe_tiles(matrix_of_blocks<T>* result, uint64_t num_cols, uint64_t num_rows);
+
+static long int default_threads()
+{
+    return std::max(1u, std::thread::hardware_concurrency());
+}
 
-enum errors{
-    E_SUCCESS  = 0,
-    E_ERROR    = -1,
-    E_BADALLOC = -2,
-    E_OPEN     = -3,
-};
-
-struct block
+// Files keep double values
+template <typename T>
+static T from_double(double value)
 {
-    int cols_;
-    int rows_;
-    double* data_;
-} __attribute__((aligned(64)));
+    if (std::is_integral<T>::value)
+        return (T)std::llround(value);
+    return (T)value;
+}
 
-struct matrix_of_blocks
+template <typename T>
+basic_matrix<T>::basic_matrix(uint64_t col, uint64_t row, T def):
+    columns_(col),
+    rows_(row),
+    mapping_(nullptr),
+    mapping_size_(0),
+    tiled_(nullptr)
 {
-    uint64_t cols_;
-    uint64_t rows_;
-    block* matrix_;
-    double*  data_;
-} __attribute__((aligned(64)));
+    data_ = new T[rows_ * columns_];
+    std::fill_n(data_, rows_ * columns_, def);
+}
 
-static int read_matr_from_file(const char* file_name, double** buff, uint64_t* buff_rows, uint64_t* buff_cols)
+template <typename T>
+basic_matrix<T>::basic_matrix(uint64_t col, uint64_t row):
+    columns_(col),
+    rows_(row),
+    mapping_(nullptr),
+    mapping_size_(0),
+    tiled_(nullptr)
 {
-    errno = 0;
+    data_ = new T[rows_ * columns_];
+}
 
-    FILE* input = fopen(file_name, "r");
-    if (input == nullptr)
-    {
-        perror("[read_matr_from_file] open file errror\n");
-        return E_OPEN;
-    }
+template <typename T>
+basic_matrix<T>::basic_matrix(const char* file_name):
+    mapping_(nullptr),
+    mapping_size_(0),
+    tiled_(nullptr)
+{
+    if (file_name == nullptr)
+        throw std::invalid_argument("[matrix::matrix] Bad pointer to file_name\n");
 
-    uint64_t num_rows = 0;
-    uint64_t num_cols = 0;
-    int ret = fscanf(input, "%ld\n%ld\n", &num_rows, &num_cols);
-    if (ret != 2)
+    if (is_matb_file(file_name))
     {
-        fprintf(stderr, "[read_matr_from_file] fscanf can't read number of rows/columns\n");
-        return E_ERROR;
-    }
+        matb_header header;
+        double* file_data = nullptr;
+        int err = map_matb_file(file_name, &header, &mapping_, &mapping_size_, &file_data);
+        if (err != E_SUCCESS)
+            throw std::runtime_error("[matrix::matrix] map_matb_file return " + std::to_string(err));
 
-    double* data = nullptr;
-    try
-    {
-        data = new double[num_rows * num_cols];
-    }
-    catch (std::exception& error)
-    {
-        fprintf(stderr, "[read_matr_from_file] Bad alloc array for data\n");
-        std::cerr << error.what();
-        return E_BADALLOC;
-    }
+        rows_    = header.rows_;
+        columns_ = header.cols_;
 
-    for (uint64_t row = 0; row < num_rows; row++)
-    {
-        for (uint64_t col = 0; col < num_cols; col++)
+        if constexpr (std::is_same<T, double>::value)
         {
-            int ret = fscanf(input, "%lg", &data[row * num_cols + col]);
-            if (ret != 1)
+            if (header.layout_ == LAYOUT_ROW_MAJOR)
             {
-                fprintf(stderr, "Bad input matrix format\n");
-                delete[] data;
-                return E_ERROR;
+                data_ = file_data;
+                return;
             }
-        }
-    }
-
-    fclose(input);
 
-    *buff      = data;
-    *buff_rows = num_rows;
-    *buff_cols = num_cols;
+            // the file holds the same zero-padded tile grid as tiled_
+            if (header.tile_dim_ == block_traits<T>::tile_dim)
+            {
+                uint64_t tile_dim = header.tile_dim_;
+                tiled_ = alloc_block_matrix<T>((columns_ + tile_dim - 1) / tile_dim, (rows_ + tile_dim - 1) / tile_dim);
+                if (tiled_ != nullptr)
+                {
+                    describe_tiles(tiled_, columns_, rows_);
+                    memcpy(tiled_->data_, file_data, tiled_->rows_ * tiled_->cols_ * block_traits<T>::tile_size * sizeof(T));
+                }
 
-    return E_SUCCESS;
-}
+                munmap(mapping_, mapping_size_);
+                mapping_      = nullptr;
+                mapping_size_ = 0;
+                data_         = nullptr;
+                if (tiled_ == nullptr)
+                    throw std::runtime_error("[matrix::matrix] tiles allocation failed\n");
+                return;
+            }
+        }
 
-matrix::matrix(uint64_t col, uint64_t row, double def):
-    columns_(col),
-    rows_(row)
-{
-    data_ = new double[rows_ * columns_];
-    std::fill_n(data_, rows_ * columns_, def);
-}
+        data_ = new T[rows_ * columns_];
 
-matrix::matrix(uint64_t col, uint64_t row):
-    columns_(col),
-    rows_(row)
-{
-    data_ = new double[rows_ * columns_];
-}
+        if (header.layout_ == LAYOUT_ROW_MAJOR)
+        {
+            for (uint64_t i = 0; i < rows_ * columns_; i++)
+                data_[i] = from_double<T>(file_data[i]);
+        }
+        else
+        {
+            uint64_t tile_dim  = header.tile_dim_;
+            uint64_t tile_cols = (columns_ + tile_dim - 1) / tile_dim;
+            for (uint64_t row = 0; row < rows_; row++)
+                for (uint64_t col = 0; col < columns_; col++)
+                    data_[row * columns_ + col] = from_double<T>(file_data[((row / tile_dim) * tile_cols + col / tile_dim) * tile_dim * tile_dim +
+                                                                           (row % tile_dim) * tile_dim + col % tile_dim]);
+        }
 
-matrix::matrix(const char* file_name)
-{
-    if (file_name == nullptr)
-        throw std::invalid_argument("[matrix::matrix] Bad pointer to file_name\n");
+        munmap(mapping_, mapping_size_);
+        mapping_      = nullptr;
+        mapping_size_ = 0;
+        return;
+    }
 
     double* buffer = nullptr;
     uint64_t buffer_rows = 0;
     uint64_t buffer_cols = 0;
-    int err = read_matr_from_file(file_name, &buffer, &buffer_rows, &buffer_cols);
+    int err = read_matr_text(file_name, &buffer, &buffer_rows, &buffer_cols);
     if (err != E_SUCCESS)
         throw std::runtime_error("[matrix::matrix] Read_file return " + std::to_string(err));
 
-    data_    = buffer;
     rows_    = buffer_rows;
     columns_ = buffer_cols;
+
+    if constexpr (std::is_same<T, double>::value)
+        data_ = buffer;
+    else
+    {
+        data_ = new T[rows_ * columns_];
+        for (uint64_t i = 0; i < rows_ * columns_; i++)
+            data_[i] = from_double<T>(buffer[i]);
+        delete[] buffer;
+    }
 }
 
-matrix::matrix(const matrix& original)
+template <typename T>
+basic_matrix<T>::basic_matrix(uint64_t col, uint64_t row, matrix_of_blocks<T>* tiled, from_tiles_t):
+    columns_(col),
+    rows_(row),
+    data_(nullptr),
+    mapping_(nullptr),
+    mapping_size_(0),
+    tiled_(tiled)
 {
-    std::cout << "Copy constructor called\n";
-    printf("copy\n");
+}
 
+template <typename T>
+basic_matrix<T>::basic_matrix(const basic_matrix& original):
+    data_(nullptr),
+    mapping_(nullptr),
+    mapping_size_(0),
+    tiled_(nullptr)
+{
     columns_ = original.columns_;
     rows_    = original.rows_;
 
+    if (original.tiled_ != nullptr)
+    {
+        const matrix_of_blocks<T>* tiles = original.tiled_;
+        tiled_ = alloc_block_matrix<T>(tiles->cols_, tiles->rows_);
+        if (tiled_ == nullptr)
+            throw std::runtime_error("[matrix::matrix] tiles allocation failed\n");
+
+        describe_tiles(tiled_, columns_, rows_);
+        memcpy(tiled_->data_, tiles->data_, tiles->rows_ * tiles->cols_ * block_traits<T>::tile_size * sizeof(T));
+        return;
+    }
+
     uint64_t size = rows_ * columns_;
-    data_ = new double[size];
+    data_ = new T[size];
 
     for (uint64_t i = 0; i < size; i++)
         data_[i] = original.data_[i];
 }
 
-matrix::matrix(matrix&& original)
+template <typename T>
+basic_matrix<T>::basic_matrix(basic_matrix&& original)
 {
-    std::cout << "Move constructor called\n";
-    printf("move\n");
-
     rows_    = original.rows_;
     columns_ = original.columns_;
 
     data_ = original.data_;
+    mapping_      = original.mapping_;
+    mapping_size_ = original.mapping_size_;
+    tiled_        = original.tiled_;
+
+    original.data_         = nullptr;
+    original.mapping_      = nullptr;
+    original.mapping_size_ = 0;
+    original.tiled_        = nullptr;
+}
 
-    original.data_ = nullptr;
+template <typename T>
+basic_matrix<T>::~basic_matrix()
+{
+    drop_tiles();
+    drop_row_major();
 }
 
-matrix::~matrix()
+template <typename T>
+void basic_matrix<T>::drop_row_major()
 {
-    std::cout << "destructor called\n";
-    delete[] data_;
+    if (mapping_ != nullptr)
+        munmap(mapping_, mapping_size_);
+    else
+        delete[] data_;
+
+    data_         = nullptr;
+    mapping_      = nullptr;
+    mapping_size_ = 0;
 }
 
-void matrix::save(const char* file_name)
+template <typename T>
+void basic_matrix<T>::drop_tiles()
 {
-    if (file_name == nullptr)
-        throw std::invalid_argument("[matrix::save] File pointer to save is nullptr\n");
+    if (tiled_ != nullptr)
+        block_distruct(tiled_);
+    tiled_ = nullptr;
+}
 
-    errno = 0;
-    FILE* output = fopen(file_name, "w");
-    if (output == nullptr)
-    {
-        perror("[matrix::save] fopen file error\n");
-        throw std::runtime_error("[matrix::save] save file can't open file\n");
-    }
+template <typename T>
+void basic_matrix<T>::unpack_tiles() const
+{
+    if (data_ != nullptr)
+        return;
 
-    fprintf(output, "%ld\n%ld\n", rows_, columns_);
+    data_ = new T[rows_ * columns_];
+    fill_matrix_from_block_matrix(data_, rows_, columns_, columns_, tiled_, default_threads(), nullptr);
+}
 
-    for (uint64_t row = 0; row < rows_; row++)
+template <typename T>
+void basic_matrix<T>::set_layout(matrix_layout layout)
+{
+    if (layout == LAYOUT_ROW_MAJOR)
     {
-        for (uint64_t col = 0; col < columns_; col++)
-            if (col != columns_ - 1)
-                fprintf(output, "%lg ", data_[row * columns_ + col]);
-            else
-                fprintf(output, "%lg\n", data_[row * columns_ + col]);
+        data();
+        return;
     }
 
-    fclose(output);
-
-    return;
+    if (tiled_ == nullptr)
+    {
+        tiled_ = produce_block_matrix(columns_, rows_, data_, columns_, default_threads(), nullptr);
+        if (tiled_ == nullptr)
+            throw std::runtime_error("[matrix::set_layout] produce_block_matrix return error\n");
+    }
+    drop_row_major();
 }
 
-static matrix_of_blocks* produce_block_matrix(uint64_t num_cols, uint64_t num_rows, double* matrix)
+template <typename T>
+void basic_matrix<T>::save(const char* file_name)
 {
-    //assert(matrix != nullptr);
+    if (file_name == nullptr)
+        throw std::invalid_argument("[matrix::save] File pointer to save is nullptr\n");
 
-    uint64_t block_dim =  CACHE_LINE_SIZE / sizeof(double);
-    uint64_t num_block_norm_cols = num_cols / block_dim; // cache line / sizeof(double)
-    uint64_t num_block_norm_rows = num_rows / block_dim;
-    uint64_t dim_block_rem_cols  = num_cols % block_dim;
-    uint64_t dim_block_rem_rows  = num_rows % block_dim;
+    unpack_tiles();
 
+    int err = E_SUCCESS;
+    if constexpr (std::is_same<T, double>::value)
+        err = write_matr_text(file_name, data_, rows_, columns_);
+    else
+    {
+        std::vector<double> values(data_, data_ + rows_ * columns_);
+        err = write_matr_text(file_name, values.data(), rows_, columns_);
+    }
+    if (err != E_SUCCESS)
+        throw std::runtime_error("[matrix::save] write_matr_text return " + std::to_string(err));
+}
 
-    uint64_t all_block_cols = num_block_norm_cols;
-    if (dim_block_rem_cols != 0)
-        all_block_cols++;
+template <typename T>
+void basic_matrix<T>::save_binary(const char* file_name, matrix_layout layout)
+{
+    if (file_name == nullptr)
+        throw std::invalid_argument("[matrix::save_binary] File pointer to save is nullptr\n");
 
-    uint64_t all_block_rows = num_block_norm_rows;
-    if (dim_block_rem_rows != 0)
-        all_block_rows++;
+    unpack_tiles();
 
-    errno = 0;
-    // norm + 1 -> norm + small remaining
-    block* block_matrix = (block*)aligned_alloc(CACHE_LINE_SIZE, all_block_cols * all_block_rows * sizeof(*block_matrix));
-    if (block_matrix == nullptr)
+    int err = E_SUCCESS;
+    if constexpr (std::is_same<T, double>::value)
+        err = write_matb_file(file_name, data_, rows_, columns_, layout);
+    else
     {
-        perror("[produce_block_matrix] aligned_alloc return error\n");
-        return nullptr;
+        std::vector<double> values(data_, data_ + rows_ * columns_);
+        err = write_matb_file(file_name, values.data(), rows_, columns_, layout);
     }
+    if (err != E_SUCCESS)
+        throw std::runtime_error("[matrix::save_binary] write_matb_file return " + std::to_string(err));
+}
 
-    uint64_t block_size = block_dim * block_dim * sizeof(double);
-    double* all_data = (double*)aligned_alloc(CACHE_LINE_SIZE, block_size * all_block_cols * all_block_rows);
-    if (all_data == nullptr)
-    {
-        perror("[produce_block_matrix] aligned_alloc arr for all data\n");
-        free(block_matrix);
-        return nullptr;
-    }
+// Packing and unpacking of matrices smaller than this stay on the calling thread
+static const uint64_t PACK_PAR_ELEMS = 1 << 16;
 
-    matrix_of_blocks* result_matrix = (matrix_of_blocks*)aligned_alloc(CACHE_LINE_SIZE, sizeof(*result_matrix));
-    if (result_matrix == nullptr)
+static thread_pool& pool_of(thread_pool* pool)
+{
+    return (pool != nullptr) ? *pool : thread_pool::instance();
+}
+
+// Runs func(tile_row) for every row of the tile grid, on the pool for large matrices
+template <typename Func>
+static void for_tile_rows(uint64_t num_tile_rows, uint64_t num_elements, long int num_threads, thread_pool* pool, const Func& func)
+{
+    if (num_threads <= 1 || num_tile_rows <= 1 || num_elements < PACK_PAR_ELEMS)
     {
-        perror("[produce_block_matrix] aligned_alloc arr for all data\n");
-        free(block_matrix);
-        free(all_data);
-        return nullptr;
+        for (uint64_t tile_row = 0; tile_row < num_tile_rows; tile_row++)
+            func(tile_row);
+        return;
     }
 
-    result_matrix->rows_   = all_block_rows;
-    result_matrix->cols_   = all_block_cols;
-    result_matrix->data_   = all_data;
-    result_matrix->matrix_ = block_matrix;
+    pool_of(pool).run(num_tile_rows, num_threads, func);
+}
+
+// NUMA mode: every thread runs func for the tile rows of its own node first (so
+// their pages are first touched there) and helps the other nodes after
+template <typename Func>
+static void for_node_tile_rows(const std::vector<uint64_t>& node_tile_rows, long int num_threads, thread_pool* pool,
+                               const Func& func)
+{
+    uint64_t num_nodes = node_tile_rows.size() - 1;
+    std::vector<std::atomic<uint64_t>> next(num_nodes);
+    for (uint64_t node = 0; node < num_nodes; node++)
+        next[node].store(node_tile_rows[node], std::memory_order_relaxed);
 
-    for (uint64_t row = 0; row < all_block_rows; row++)
+    pool_of(pool).run(num_threads, num_threads, [&](uint64_t)
     {
-        for (uint64_t col = 0; col < all_block_cols; col++)
+        uint64_t own = current_numa_node() % num_nodes;
+        for (uint64_t i = 0; i < num_nodes; i++)
         {
-            uint64_t offset       = row * block_dim * num_cols + col * block_dim;
-            uint64_t block_offset = (row * all_block_cols + col) * block_dim * block_dim;
+            uint64_t node = (own + i) % num_nodes;
+            uint64_t tile_row = 0;
+            while ((tile_row = next[node].fetch_add(1, std::memory_order_relaxed)) < node_tile_rows[node + 1])
+                func(tile_row);
+        }
+    });
+}
 
-            //printf("offset = %ld, block_offset = %ld\n", offset, block_offset);
+// Tiles of consecutive grids on huge pages start this many cache lines apart
+// (mod TILE_COLOURS): there the page offset fixes the L2 set, grids of the same
+// shape would otherwise put the A and B panels a kernel streams in the same sets
+static const uint64_t TILE_COLOURS      = 8;
+static const uint64_t TILE_COLOUR_LINES = 17;
 
-            if (col == all_block_cols - 1 && dim_block_rem_cols != 0)
-                block_matrix[row * all_block_cols + col].cols_ = dim_block_rem_cols;
-            else
-                block_matrix[row * all_block_cols + col].cols_ = block_dim;
+// fresh_pages: NUMA placement, the pages must be first touched by the packing
+// threads, so the region doesn't come from the workspace
+template <typename T>
+static matrix_of_blocks<T>* alloc_block_matrix(uint64_t all_block_cols, uint64_t all_block_rows, bool fresh_pages)
+{
+    uint64_t block_size = block_traits<T>::tile_size * sizeof(T);
+    uint64_t num_blocks = all_block_cols * all_block_rows;
+    // header, descriptors and tiles, every part starts at a cache line
+    uint64_t header_size = sizeof(matrix_of_blocks<T>) + num_blocks * sizeof(block<T>);
+    uint64_t bytes       = header_size + num_blocks * block_size;
+
+    workspace* arena = fresh_pages ? nullptr : &workspace::instance();
+    if (arena != nullptr && bytes >= HUGE_PAGE_SIZE && arena->huge_pages() != HUGE_PAGES_OFF)
+    {
+        // the stagger fits in the rounding to whole huge pages, so the region
+        // size (and its reuse) doesn't depend on it
+        static std::atomic<uint64_t> colours(0);
+        uint64_t slack  = (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE - bytes;
+        uint64_t colour = std::min((colours++ % TILE_COLOURS) * TILE_COLOUR_LINES, slack / CACHE_LINE_SIZE) * CACHE_LINE_SIZE;
+        header_size += colour;
+        bytes       += colour;
+    }
 
-            if (row == all_block_cols - 1 && dim_block_rem_rows != 0)
-                block_matrix[row * all_block_cols + col].rows_ = dim_block_rem_rows;
-            else
-                block_matrix[row * all_block_cols + col].rows_ = block_dim;
+    errno = 0;
+    void* region = (arena != nullptr) ? arena->acquire(bytes)
+                                      : aligned_alloc(CACHE_LINE_SIZE, (bytes + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE);
+    if (region == nullptr)
+    {
+        perror("[alloc_block_matrix] allocation of the tile grid returned error\n");
+        return nullptr;
+    }
 
-            block_matrix[row * all_block_cols + col].data_     = all_data + block_offset;
+    matrix_of_blocks<T>* result_matrix = (matrix_of_blocks<T>*)region;
+    result_matrix->rows_      = all_block_rows;
+    result_matrix->cols_      = all_block_cols;
+    result_matrix->matrix_    = (block<T>*)((char*)region + sizeof(matrix_of_blocks<T>));
+    result_matrix->data_      = (T*)((char*)region + header_size);
+    result_matrix->workspace_ = arena;
 
-            //if matrix == NULL produce zero-filled matrix
-            if (matrix == nullptr)
-            {
-                for (uint64_t orig_row = 0; orig_row < block_dim; orig_row++)
-                    for (uint64_t orig_col = 0; orig_col < block_dim; orig_col++)
-                        all_data[block_offset + orig_row * block_dim + orig_col] = 0.0;
-            }
-            else
-            {
-                for (uint64_t orig_row = 0; orig_row < block_matrix[row * all_block_cols + col].rows_; orig_row++)
-                    for (uint64_t orig_col = 0; orig_col < block_matrix[row * all_block_cols + col].cols_; orig_col++)
-                        block_matrix[row * all_block_cols + col].data_[orig_row * block_dim + orig_col] = matrix[offset + orig_row * num_cols + orig_col]; // need paint
+    return result_matrix;
+}
 
-                if (block_matrix[row * all_block_cols + col].rows_ != block_dim)
-                {
-                    //printf("Row - Block : row %ld, col %ld\nrow_dim = %d, col_dim = %d\n", row, col, block_matrix[row * all_block_cols + col].rows_, block_matrix[row * all_block_cols + col].cols_);
-                    for (uint64_t orig_row = block_matrix[row * all_block_cols + col].rows_; orig_row < block_dim; orig_row++)
-                        for (uint64_t orig_col = 0; orig_col < block_dim; orig_col++)
-                            block_matrix[row * all_block_cols + col].data_[orig_row * block_dim + block_dim - 1] = 0.0; // need paint
-                }
-                if (block_matrix[row * all_block_cols + col].cols_ != block_dim)
-                {
-                    //printf("Col - Block : row %ld, col %ld\nrow_dim = %d, col_dim = %d\n", row, col, block_matrix[row * all_block_cols + col].rows_, block_matrix[row * all_block_cols + col].cols_);
-                    for (uint64_t orig_col = block_matrix[row * all_block_cols + col].cols_; orig_col < block_dim; orig_col++)
-                        for (uint64_t orig_row = 0; orig_row < block_dim; orig_row++)
-                            block_matrix[row * all_block_cols + col].data_[orig_row * block_dim + orig_col] = 0.0; // need paint
-                }
-            }
-        }
-    }
+// Descriptors of the tiles of num_rows x num_cols matrix in a row-major grid
+template <typename T>
+static void describe_tiles(matrix_of_blocks<T>* result, uint64_t num_cols, uint64_t num_rows)
+{
+    uint64_t block_dim = block_traits<T>::tile_dim;
 
-    return result_matrix;
+    for (uint64_t row = 0; row < result->rows_; row++)
+        for (uint64_t col = 0; col < result->cols_; col++)
+        {
+            block<T>* cur = &result->matrix_[row * result->cols_ + col];
+            cur->cols_ = std::min(block_dim, num_cols - col * block_dim);
+            cur->rows_ = std::min(block_dim, num_rows - row * block_dim);
+            cur->data_ = result->data_ + (row * result->cols_ + col) * block_dim * block_dim;
+        }
 }
 
-static matrix_of_blocks* produce_trans_block(uint64_t num_cols, uint64_t num_rows, double* matrix)
+// Fills descriptors and data of the tiles in one row of the grid, a tile row
+// (or a k row of a transposed B tile) at a time. rem_cols and rem_rows are
+// dimensions of partial tiles at the right and bottom edges of the grid.
+// source_transposed: matrix holds the transpose of the packed operand, a tile
+// is gathered from columns of the source (contiguous reads, strided writes in the tile).
+// S elements of the source are converted to T (double to mixed_f32)
+template <typename T, typename S>
+static void pack_grid_row(matrix_of_blocks<T>* result, uint64_t tile_row, const S* matrix, uint64_t row_stride,
+                          uint64_t rem_cols, uint64_t rem_rows, bool transposed, bool source_transposed)
 {
-    //assert(matrix != nullptr);
+    uint64_t block_dim      = block_traits<T>::tile_dim;
+    uint64_t all_block_cols = result->cols_;
+    uint64_t all_block_rows = result->rows_;
 
-    uint64_t block_dim =  CACHE_LINE_SIZE / sizeof(double);
-    uint64_t num_block_norm_cols = num_rows / block_dim; // transpose size
-    uint64_t num_block_norm_rows = num_cols / block_dim;
-    uint64_t dim_block_rem_cols  = num_rows % block_dim;
-    uint64_t dim_block_rem_rows  = num_cols % block_dim;
+    for (uint64_t col = 0; col < all_block_cols; col++)
+    {
+        block<T>* cur = &result->matrix_[tile_row * all_block_cols + col];
+        cur->cols_ = (col == all_block_cols - 1 && rem_cols != 0) ? rem_cols : block_dim;
+        cur->rows_ = (tile_row == all_block_rows - 1 && rem_rows != 0) ? rem_rows : block_dim;
+        cur->data_ = result->data_ + (tile_row * all_block_cols + col) * block_dim * block_dim;
 
-    uint64_t all_block_cols = num_block_norm_cols;
-    if (dim_block_rem_cols != 0)
-        all_block_cols++;
+        //if matrix == NULL produce zero-filled matrix
+        if (matrix == nullptr)
+        {
+            memset(cur->data_, 0, block_dim * block_dim * sizeof(T));
+            continue;
+        }
 
-    uint64_t all_block_rows = num_block_norm_rows;
-    if (dim_block_rem_rows != 0)
-        all_block_rows++;
+        // partial tiles are padded with zeros, kernels always work on full tiles
+        if ((uint64_t)cur->rows_ != block_dim || (uint64_t)cur->cols_ != block_dim)
+            memset(cur->data_, 0, block_dim * block_dim * sizeof(T));
 
-    //printf("%ld, %ld\n", all_block_rows, all_block_cols);
+        // data_[line * block_dim + elem]: tiles are placed transposed for B (a column
+        // of B tiles is contiguous), but data inside of tile stays row-major: the
+        // micro-kernel loads B rows as vectors
+        uint64_t first_line = (!transposed) ? tile_row * block_dim : col * block_dim;
+        uint64_t first_elem = (!transposed) ? col * block_dim : tile_row * block_dim;
+        int      num_lines  = (!transposed) ? cur->rows_ : cur->cols_;
+        int      num_elems  = (!transposed) ? cur->cols_ : cur->rows_;
 
-    errno = 0;
-    // norm + 1 -> norm + small remaining
-    block* block_matrix = (block*)aligned_alloc(CACHE_LINE_SIZE, all_block_cols * all_block_rows * sizeof(*block_matrix));
-    if (block_matrix == nullptr)
-    {
-        perror("[produce_trans_block] aligned_alloc return error\n");
-        return nullptr;
+        if (!source_transposed && std::is_same<T, S>::value)
+        {
+            const S* source = matrix + first_line * row_stride + first_elem;
+            for (int line = 0; line < num_lines; line++)
+                memcpy(cur->data_ + line * block_dim, source + line * row_stride, num_elems * sizeof(T));
+        }
+        else if (!source_transposed)
+        {
+            const S* source = matrix + first_line * row_stride + first_elem;
+            for (int line = 0; line < num_lines; line++)
+                for (int elem = 0; elem < num_elems; elem++)
+                    cur->data_[line * block_dim + elem] = T(source[line * row_stride + elem]);
+        }
+        else
+        {
+            const S* source = matrix + first_elem * row_stride + first_line;
+            for (int elem = 0; elem < num_elems; elem++)
+                for (int line = 0; line < num_lines; line++)
+                    cur->data_[line * block_dim + elem] = T(source[elem * row_stride + line]);
+        }
     }
+}
 
-    uint64_t block_size = block_dim * block_dim * sizeof(double);
-    double* all_data = (double*)aligned_alloc(CACHE_LINE_SIZE, block_size * all_block_cols * all_block_rows);
-    if (all_data == nullptr)
-    {
-        perror("[produce_trans_block] aligned_alloc arr for all data\n");
-        free(block_matrix);
-        return nullptr;
-    }
+template <typename T, typename P>
+matrix_of_blocks<P>* produce_block_matrix(uint64_t num_cols, uint64_t num_rows, const T* matrix, uint64_t row_stride,
+                                          long int num_threads, thread_pool* pool, const std::vector<uint64_t>* node_tile_rows,
+                                          bool source_transposed)
+{
+    uint64_t block_dim = block_traits<P>::tile_dim;
+    uint64_t all_block_cols = (num_cols + block_dim - 1) / block_dim;
+    uint64_t all_block_rows = (num_rows + block_dim - 1) / block_dim;
 
-    matrix_of_blocks* result_matrix = (matrix_of_blocks*)aligned_alloc(CACHE_LINE_SIZE, sizeof(*result_matrix));
+    matrix_of_blocks<P>* result_matrix = alloc_block_matrix<P>(all_block_cols, all_block_rows, node_tile_rows != nullptr);
     if (result_matrix == nullptr)
-    {
-        perror("[produce_trans_block] aligned_alloc arr for all data\n");
-        free(block_matrix);
-        free(all_data);
         return nullptr;
-    }
 
-    result_matrix->rows_   = all_block_rows;
-    result_matrix->cols_   = all_block_cols;
-    result_matrix->data_   = all_data;
-    result_matrix->matrix_ = block_matrix;
-
-    for (uint64_t row = 0; row < all_block_rows; row++)
+    auto pack = [&](uint64_t tile_row)
     {
-        for (uint64_t col = 0; col < all_block_cols; col++)
-        {
-            uint64_t offset       = col * num_cols * block_dim + row * block_dim;
-            uint64_t block_offset = (row * all_block_cols + col) * block_dim * block_dim;
+        pack_grid_row(result_matrix, tile_row, matrix, row_stride, num_cols % block_dim, num_rows % block_dim, false, source_transposed);
+    };
+    if (node_tile_rows != nullptr)
+        for_node_tile_rows(*node_tile_rows, num_threads, pool, pack);
+    else
+        for_tile_rows(all_block_rows, num_cols * num_rows, num_threads, pool, pack);
 
-            if (col == all_block_cols - 1 && dim_block_rem_cols != 0)
-                block_matrix[row * all_block_cols + col].cols_ = dim_block_rem_cols;
-            else
-                block_matrix[row * all_block_cols + col].cols_ = block_dim;
-
-            if (row == all_block_rows - 1 && dim_block_rem_rows != 0)
-                block_matrix[row * all_block_cols + col].rows_ = dim_block_rem_rows;
-            else
-                block_matrix[row * all_block_cols + col].rows_ = block_dim;
-
-            block_matrix[row * all_block_cols + col].data_     = all_data + block_offset;
+    return result_matrix;
+}
 
-            //printf("Block : row %ld, col %ld\nrow_dim = %d, col_dim = %d\n", row, col, block_matrix[row * all_block_cols + col].rows_, block_matrix[row * all_block_cols + col].cols_);
-            //printf("offset = %ld, block_offset = %ld\n", offset, block_offset);
+template <typename T, typename P>
+matrix_of_blocks<P>* produce_trans_block(uint64_t num_cols, uint64_t num_rows, const T* matrix, uint64_t row_stride,
+                                         long int num_threads, thread_pool* pool, const std::vector<uint64_t>* node_tile_rows,
+                                         bool source_transposed)
+{
+    // transpose size
+    uint64_t block_dim = block_traits<P>::tile_dim;
+    uint64_t all_block_cols = (num_rows + block_dim - 1) / block_dim;
+    uint64_t all_block_rows = (num_cols + block_dim - 1) / block_dim;
 
-            //if matrix == NULL produce zero-filled matrix
-            if (matrix == nullptr)
-            {
-                for (uint64_t orig_row = 0; orig_row < block_dim; orig_row++)
-                    for (uint64_t orig_col = 0; orig_col < block_dim; orig_col++)
-                        all_data[block_offset + orig_row * block_dim + orig_col] = 0.0;
-            }
-            else
-            {
-                for (uint64_t orig_row = 0; orig_row < block_matrix[row * all_block_cols + col].rows_; orig_row++)
-                    for (uint64_t orig_col = 0; orig_col < block_matrix[row * all_block_cols + col].cols_; orig_col++)
-                        block_matrix[row * all_block_cols + col].data_[orig_row * block_dim + orig_col] = matrix[offset + orig_col * num_cols + orig_row]; // need paint
+    matrix_of_blocks<P>* result_matrix = alloc_block_matrix<P>(all_block_cols, all_block_rows, node_tile_rows != nullptr);
+    if (result_matrix == nullptr)
+        return nullptr;
 
-                if (block_matrix[row * all_block_cols + col].rows_ != block_dim)
-                {
-                    //printf("Row - Block : row %ld, col %ld\nrow_dim = %d, col_dim = %d\n", row, col, block_matrix[row * all_block_cols + col].rows_, block_matrix[row * all_block_cols + col].cols_);
-                    for (uint64_t orig_row = block_matrix[row * all_block_cols + col].rows_; orig_row < block_dim; orig_row++)
-                        for (uint64_t orig_col = 0; orig_col < block_dim; orig_col++)
-                            block_matrix[row * all_block_cols + col].data_[orig_row * block_dim + block_dim - 1] = 0.0; // need paint
-                }
-                if (block_matrix[row * all_block_cols + col].cols_ != block_dim)
-                {
-                    //printf("Col - Block : row %ld, col %ld\nrow_dim = %d, col_dim = %d\n", row, col, block_matrix[row * all_block_cols + col].rows_, block_matrix[row * all_block_cols + col].cols_);
-                    for (uint64_t orig_col = block_matrix[row * all_block_cols + col].cols_; orig_col < block_dim; orig_col++)
-                        for (uint64_t orig_row = 0; orig_row < block_dim; orig_row++)
-                            block_matrix[row * all_block_cols + col].data_[orig_row * block_dim + orig_col] = 0.0; // need paint
-                }
-            }
-        }
-    }
+    auto pack = [&](uint64_t tile_row)
+    {
+        pack_grid_row(result_matrix, tile_row, matrix, row_stride, num_rows % block_dim, num_cols % block_dim, true, source_transposed);
+    };
+    if (node_tile_rows != nullptr)
+        for_node_tile_rows(*node_tile_rows, num_threads, pool, pack);
+    else
+        for_tile_rows(all_block_rows, num_cols * num_rows, num_threads, pool, pack);
 
     return result_matrix;
 }
 
-static void debug_print_block_matrix(matrix_of_blocks* matr, const char* debug_file)
+template <typename T>
+static void debug_print_block_matrix(matrix_of_blocks<T>* matr, const char* debug_file)
 {
     assert(matr != nullptr);
     assert(debug_file != nullptr);
@@ -402,7 +547,7 @@ static void debug_print_block_matrix(matrix_of_blocks* matr, const char* debug_f
 
     uint64_t num_cols = matr->cols_;
     uint64_t num_rows = matr->rows_;
-    int block_dim = matr->matrix_[0].cols_;
+    int block_dim = block_traits<T>::tile_dim;
 
     fprintf(out_file, "num_rows = %ld\nnum_cols = %ld\n", num_rows, num_cols);
 
@@ -412,184 +557,1169 @@ static void debug_print_block_matrix(matrix_of_blocks* matr, const char* debug_f
         for (int row = 0; row < block_dim; row++)
         {
             for (int col = 0; col < block_dim; col++)
-                fprintf(out_file, "%lg ", matr->matrix_[num_block].data_[row * block_dim + col]);
+                fprintf(out_file, "%lg ", (double)matr->matrix_[num_block].data_[row * block_dim + col]);
             fprintf(out_file, "\n");
         }
     }
     fclose(out_file);
 }
 
-static void block_distruct(matrix_of_blocks* matr)
+template <typename T>
+void block_distruct(matrix_of_blocks<T>* matr)
 {
     assert(matr != nullptr);
 
     matr->cols_ = -1;
     matr->rows_ = -1;
 
-    free(matr->data_);
-    free(matr->matrix_);
+    if (matr->workspace_ != nullptr)
+        matr->workspace_->release(matr);
+    else
+        free(matr);
 }
 
-struct thread_info
+// Cache size in bytes of data (or unified) cache of the given level, 0 if unknown
+static uint64_t read_cache_size(int level)
+{
+    for (int index = 0; index < 16; index++)
+    {
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/", index);
+
+        char file[160];
+        snprintf(file, sizeof(file), "%slevel", path);
+        FILE* input = fopen(file, "r");
+        if (input == nullptr)
+            break;
+
+        int cache_level = 0;
+        int ret = fscanf(input, "%d", &cache_level);
+        fclose(input);
+        if (ret != 1 || cache_level != level)
+            continue;
+
+        char type[32] = {};
+        snprintf(file, sizeof(file), "%stype", path);
+        input = fopen(file, "r");
+        if (input == nullptr)
+            continue;
+        ret = fscanf(input, "%31s", type);
+        fclose(input);
+        if (ret != 1 || strcmp(type, "Instruction") == 0)
+            continue;
+
+        uint64_t size   = 0;
+        char     suffix = 0;
+        snprintf(file, sizeof(file), "%ssize", path);
+        input = fopen(file, "r");
+        if (input == nullptr)
+            continue;
+        ret = fscanf(input, "%lu%c", &size, &suffix);
+        fclose(input);
+        if (ret < 1)
+            continue;
+
+        if (suffix == 'K')
+            size <<= 10;
+        else if (suffix == 'M')
+            size <<= 20;
+        else if (suffix == 'G')
+            size <<= 30;
+
+        return size;
+    }
+
+    return 0;
+}
+
+static uint64_t round_to_tiles(uint64_t elements, uint64_t block_dim)
+{
+    uint64_t tiles = elements / block_dim;
+    return (tiles == 0) ? 1 : tiles;
+}
+
+static block_mult_options block_sizes_from_caches()
+{
+    uint64_t L1 = read_cache_size(1);
+    uint64_t L2 = read_cache_size(2);
+    uint64_t L3 = read_cache_size(3);
+
+    // fallbacks are sizes of a common server core
+    if (L1 == 0)
+        L1 = 32 << 10;
+    if (L2 == 0)
+        L2 = 1 << 20;
+    if (L3 == 0)
+        L3 = 8 * L2;
+
+    uint64_t block_dim = KERNEL_DIM;
+    uint64_t tile_row  = block_dim * sizeof(double);
+
+    // half of each level is left for C tiles and the other operand
+    uint64_t kc = (L1 / 2) / (2 * tile_row);
+    uint64_t mc = (L2 / 2) / (kc * sizeof(double));
+    uint64_t nc = (L3 / 2) / (kc * sizeof(double));
+
+    block_mult_options detected;
+    detected.kc_ = round_to_tiles(kc, block_dim) * block_dim;
+    detected.mc_ = round_to_tiles(mc, block_dim) * block_dim;
+    detected.nc_ = round_to_tiles(nc, block_dim) * block_dim;
+
+    return detected;
+}
+
+block_mult_options detect_block_mult_options()
 {
-    uint64_t first_;
-    uint64_t last_;
+    static const block_mult_options detected = block_sizes_from_caches();
+    return detected;
+}
+
+block_mult_options resolve_options(const block_mult_options& options, uint64_t M, uint64_t N, uint64_t K, long int* num_threads)
+{
+    block_mult_options resolved = options;
+
+    block_mult_profile_entry tuned = {};
+    if (find_block_mult_profile_entry(M, N, K, &tuned))
+    {
+        if (resolved.mc_ == 0)
+            resolved.mc_ = tuned.options_.mc_;
+        if (resolved.kc_ == 0)
+            resolved.kc_ = tuned.options_.kc_;
+        if (resolved.nc_ == 0)
+            resolved.nc_ = tuned.options_.nc_;
+        if (resolved.traversal_ == TRAVERSE_DEFAULT)
+            resolved.traversal_ = tuned.options_.traversal_;
+        if (*num_threads == 0)
+            *num_threads = tuned.num_threads_;
+    }
+
+    block_mult_options detected = detect_block_mult_options();
+    if (resolved.mc_ == 0)
+        resolved.mc_ = detected.mc_;
+    if (resolved.kc_ == 0)
+        resolved.kc_ = detected.kc_;
+    if (resolved.nc_ == 0)
+        resolved.nc_ = detected.nc_;
+    if (resolved.traversal_ == TRAVERSE_DEFAULT)
+        resolved.traversal_ = TRAVERSE_COLUMNS;
+    if (*num_threads == 0)
+        *num_threads = std::max(1u, std::thread::hardware_concurrency());
+    if (resolved.algorithm_ == ALGO_DEFAULT)
+        resolved.algorithm_ = ALGO_CLASSIC;
+    if (resolved.strassen_crossover_ == 0)
+        resolved.strassen_crossover_ = STRASSEN_DEF_CROSSOVER;
+
+    return resolved;
+}
+
+// Range of C blocks owned by one thread: first in high half, last in low half,
+// so the owner and thieves change it with one CAS
+struct task_range
+{
+    std::atomic<uint64_t> bounds_;
+} __attribute__((aligned(64)));
+
+static const uint64_t MIN_TASKS_PER_THREAD = 4;
+
+static uint64_t pack_range(uint64_t first, uint64_t last)
+{
+    return (first << 32) | last;
+}
+
+// The owner takes tasks one by one from the beginning of its range
+static bool take_task(task_range* range, uint64_t* task)
+{
+    uint64_t bounds = range->bounds_.load(std::memory_order_acquire);
+    while (true)
+    {
+        uint64_t first = bounds >> 32;
+        uint64_t last  = bounds & 0xffffffff;
+        if (first >= last)
+            return false;
+
+        if (range->bounds_.compare_exchange_weak(bounds, pack_range(first + 1, last), std::memory_order_acq_rel))
+        {
+            *task = first;
+            return true;
+        }
+    }
+}
+
+// A thief takes the upper half of the longest range and makes it its own one
+static bool steal_tasks(task_range* ranges, uint64_t num_ranges, uint64_t thief)
+{
+    while (true)
+    {
+        uint64_t victim  = num_ranges;
+        uint64_t longest = 0;
+        uint64_t bounds  = 0;
+        for (uint64_t i = 0; i < num_ranges; i++)
+        {
+            uint64_t cur    = ranges[i].bounds_.load(std::memory_order_acquire);
+            uint64_t length = (cur & 0xffffffff) - std::min(cur >> 32, cur & 0xffffffff);
+            if (i != thief && length > longest)
+            {
+                longest = length;
+                victim  = i;
+                bounds  = cur;
+            }
+        }
+        if (victim == num_ranges)
+            return false;
+
+        uint64_t first = bounds >> 32;
+        uint64_t last  = bounds & 0xffffffff;
+        uint64_t mid   = first + (last - first) / 2;
+
+        if (ranges[victim].bounds_.compare_exchange_strong(bounds, pack_range(first, mid), std::memory_order_acq_rel))
+        {
+            ranges[thief].bounds_.store(pack_range(mid, last), std::memory_order_release);
+            return true;
+        }
+    }
+}
 
-    matrix_of_blocks* normal_;
-    matrix_of_blocks* transp_;
-    matrix_of_blocks* return_;
+template <typename T>
+struct thread_info
+{
+    // block sizes in tiles
+    uint64_t mc_;
+    uint64_t kc_;
+    uint64_t nc_;
+    block_traversal traversal_;
+
+    matrix_of_blocks<T>* normal_;
+    matrix_of_blocks<T>* transp_;
+    matrix_of_blocks<typename block_traits<T>::acc_t>* return_;
+
+    // distance in tiles of B between neighbour columns and neighbour k
+    uint64_t B_col_step_;
+    uint64_t B_k_step_;
+
+    uint64_t    num_ranges_;
+    task_range* ranges_;
+
+    // NUMA mode: threads of node n take ranges [node_ranges_[n], node_ranges_[n + 1]) first
+    const numa_plan<T>*                 numa_;
+    std::vector<uint64_t>               node_ranges_;
+    std::vector<std::atomic<uint64_t>>* next_range_;
+
+    // traffic accounting: node of every tile of A, of each copy of B and of C
+    bool                          count_traffic_;
+    std::vector<int>              A_nodes_;
+    std::vector<std::vector<int>> B_nodes_;
+    std::vector<int>              C_nodes_;
+    std::atomic<uint64_t>         local_bytes_;
+    std::atomic<uint64_t>         remote_bytes_;
+
+    block_mult_stats* stats_; // nullptr - instrumentation is off
+
+    bool accumulate_; // C tiles already hold a partial product
 } __attribute__((aligned(64)));
 
-void thread_routine(thread_info* info)
+// Every task is mc x nc block of C. With TRAVERSE_COLUMNS tasks go column of
+// blocks after column of blocks, so threads working at the same time share
+// the B panel in L3, TRAVERSE_ROWS makes them share the A block instead
+template <typename T>
+static void task_bounds(const thread_info<T>* info, uint64_t task, uint64_t* row_first, uint64_t* row_last,
+                        uint64_t* col_first, uint64_t* col_last)
 {
-    printf("thread_routine was started with diap: first = %ld, last = %ld\n", info->first_, info->last_);
+    uint64_t C_rows      = info->return_->rows_;
+    uint64_t C_cols      = info->return_->cols_;
+    uint64_t row_blocks  = (C_rows + info->mc_ - 1) / info->mc_;
+    uint64_t col_blocks  = (C_cols + info->nc_ - 1) / info->nc_;
 
-    int block_dim = info->normal_->matrix_[0].cols_;
+    if (info->traversal_ == TRAVERSE_ROWS)
+    {
+        *row_first = (task / col_blocks) * info->mc_;
+        *col_first = (task % col_blocks) * info->nc_;
+    }
+    else
+    {
+        *row_first = (task % row_blocks) * info->mc_;
+        *col_first = (task / row_blocks) * info->nc_;
+    }
+    *row_last = std::min(*row_first + info->mc_, C_rows);
+    *col_last = std::min(*col_first + info->nc_, C_cols);
+}
 
-    uint64_t normal_rows = info->normal_->rows_;
-    uint64_t normal_cols = info->normal_->cols_;
-    block* A             = info->normal_->matrix_;
+// Returns the number of micro-kernel calls
+template <typename T>
+static uint64_t compute_c_block(thread_info<T>* info, micro_kernel_t<T> kernel, const matrix_of_blocks<T>* B_tiles, uint64_t task)
+{
+    typedef typename block_traits<T>::acc_t acc_t;
+
+    uint64_t k_tiles     = info->normal_->cols_;
+    block<T>* A          = info->normal_->matrix_;
+    block<T>* B          = B_tiles->matrix_;
+    block<acc_t>* C      = info->return_->matrix_;
+    uint64_t C_cols      = info->return_->cols_;
+
+    uint64_t row_first = 0;
+    uint64_t row_last  = 0;
+    uint64_t col_first = 0;
+    uint64_t col_last  = 0;
+    task_bounds(info, task, &row_first, &row_last, &col_first, &col_last);
+    uint64_t B_stride  = info->B_k_step_ * block_traits<T>::tile_size;
+
+    // k-panels of A (tile row) and B (tile column) are contiguous
+    for (uint64_t k_first = 0; k_first < k_tiles; k_first += info->kc_)
+    {
+        uint64_t num_k = std::min(info->kc_, k_tiles - k_first);
 
-    uint64_t transp_rows = info->transp_->rows_;
-    uint64_t transp_cols = info->transp_->cols_;
-    block* B             = info->transp_->matrix_;
+        for (uint64_t col = col_first; col < col_last; col++)
+        {
+            const T* B_panel = B[col * info->B_col_step_ + k_first * info->B_k_step_].data_;
 
-    //printf("A: row = %ld, col = %ld\n", normal_rows, normal_cols);
-    //printf("B: row = %ld, col = %ld\n", transp_rows, transp_cols);
+            for (uint64_t row = row_first; row < row_last; row++)
+                kernel(num_k, A[row * k_tiles + k_first].data_, B_panel, B_stride, C[row * C_cols + col].data_,
+                       k_first != 0 || info->accumulate_);
+        }
+    }
 
-    block* C             = info->return_->matrix_;
+    return (row_last - row_first) * (col_last - col_first) * ((k_tiles + info->kc_ - 1) / info->kc_);
+}
 
-    //printf("C: row = %ld, col = %ld\n", info->return_->rows_, info->return_->cols_);
+// Bytes of the tiles the kernels of one C block read (and write for C) split
+// by the node of their pages, unplaced pages count as local
+template <typename T>
+static void count_c_block_traffic(const thread_info<T>* info, const std::vector<int>& B_nodes, int node, uint64_t task,
+                                  uint64_t* local, uint64_t* remote)
+{
+    uint64_t k_tiles   = info->normal_->cols_;
+    uint64_t C_cols    = info->return_->cols_;
+    uint64_t tile_size = block_traits<T>::tile_size;
+    uint64_t panels    = (k_tiles + info->kc_ - 1) / info->kc_;
+
+    uint64_t row_first = 0;
+    uint64_t row_last  = 0;
+    uint64_t col_first = 0;
+    uint64_t col_last  = 0;
+    task_bounds(info, task, &row_first, &row_last, &col_first, &col_last);
+
+    auto add = [node, local, remote](int tile_node, uint64_t bytes)
+    {
+        if (tile_node < 0 || tile_node == node)
+            *local += bytes;
+        else
+            *remote += bytes;
+    };
+
+    for (uint64_t col = col_first; col < col_last; col++)
+        for (uint64_t row = row_first; row < row_last; row++)
+        {
+            for (uint64_t k = 0; k < k_tiles; k++)
+            {
+                add(info->A_nodes_[row * k_tiles + k], tile_size * sizeof(T));
+                add(B_nodes[col * info->B_col_step_ + k * info->B_k_step_], tile_size * sizeof(T));
+            }
+            // C tile is loaded and stored once per k-panel
+            add(info->C_nodes_[row * C_cols + col], 2 * panels * tile_size * sizeof(typename block_traits<T>::acc_t));
+        }
+}
 
-    for (uint64_t cur_block = info->first_; cur_block < info->last_; cur_block++)
+// NUMA mode: a range of the thread's own node, of another one if they are all taken
+template <typename T>
+static uint64_t claim_range(thread_info<T>* info, uint64_t node)
+{
+    uint64_t num_nodes = info->node_ranges_.size() - 1;
+    for (uint64_t i = 0; i < num_nodes; i++)
     {
-        uint64_t block_row = cur_block / transp_rows;
-        uint64_t block_col = cur_block % transp_rows;
-        //printf("block_row = %ld, block_col = %ld\n", block_row, block_col);
+        uint64_t cur   = (node + i) % num_nodes;
+        uint64_t range = (*info->next_range_)[cur].fetch_add(1, std::memory_order_relaxed);
+        if (range < info->node_ranges_[cur + 1])
+            return range;
+    }
+
+    // pool runs exactly num_ranges_ tasks, so every one gets a range
+    assert(false);
+    return 0;
+}
+
+// Every thread starts on its own contiguous range of C blocks (neighbour
+// blocks share panels) and steals from the others when it runs dry
+template <typename T>
+void thread_routine(thread_info<T>* info, uint64_t index)
+{
+    micro_kernel_t<T> kernel = select_micro_kernel<T>();
 
-        double* data_block = C[cur_block].data_;
+    // workers of the NUMA pool are pinned, so the node doesn't change under them
+    int node = 0;
+    if (info->numa_ != nullptr || info->count_traffic_)
+        node = current_numa_node();
 
-        for (uint64_t i = 0; i < normal_cols; i++)
+    const matrix_of_blocks<T>* B = info->transp_;
+    uint64_t B_copy = 0;
+    if (info->numa_ != nullptr)
+    {
+        uint64_t plan_node = node % (info->node_ranges_.size() - 1);
+        index = claim_range(info, plan_node);
+        if (!info->numa_->B_replicas_.empty())
         {
-            double* A_block = A[normal_cols * block_row + i].data_;
-            double* B_block = B[normal_cols * block_col + i].data_;
+            B      = info->numa_->B_replicas_[plan_node];
+            B_copy = plan_node;
+        }
+    }
 
-            for (int row = 0; row < block_dim; row++)
-                for (int col = 0; col < block_dim; col++)
-                    for (int k = 0; k < block_dim; k++)
-                        data_block[row * block_dim + col] += A_block[row * block_dim + k] * B_block[row * block_dim + k];
+    typedef std::chrono::steady_clock clock;
+    block_mult_thread_stats stats = {};
+    perf_counters counters = {-1, -1, -1};
+    if (info->stats_ != nullptr)
+    {
+        stats.cpu_ = sched_getcpu();
+        if (info->stats_->hw_counters_)
+            perf_counters_open(&counters);
+    }
+
+    uint64_t local  = 0;
+    uint64_t remote = 0;
+    uint64_t task = 0;
+    while (true)
+    {
+        while (take_task(&info->ranges_[index], &task))
+        {
+            if (info->stats_ != nullptr)
+            {
+                clock::time_point begin = clock::now();
+                stats.tiles_ += compute_c_block(info, kernel, B, task);
+                stats.busy_  += std::chrono::duration<double>(clock::now() - begin).count();
+                stats.tasks_++;
+            }
+            else
+                compute_c_block(info, kernel, B, task);
+
+            if (info->count_traffic_)
+                count_c_block_traffic(info, info->B_nodes_[B_copy], node, task, &local, &remote);
         }
+
+        if (!steal_tasks(info->ranges_, info->num_ranges_, index))
+            break;
+        stats.steals_++;
+    }
+
+    if (info->count_traffic_)
+    {
+        info->local_bytes_.fetch_add(local, std::memory_order_relaxed);
+        info->remote_bytes_.fetch_add(remote, std::memory_order_relaxed);
+    }
+
+    if (info->stats_ != nullptr)
+    {
+        perf_counters_read(&counters, &stats.cycles_, &stats.llc_misses_, &stats.dtlb_misses_);
+        perf_counters_close(&counters);
+        // idle time is known once every thread is done
+        info->stats_->threads_[index] = stats;
     }
 }
 
-static int mult_prep_block_matr_multitread(matrix_of_blocks* A_normal, matrix_of_blocks* B_transp, matrix_of_blocks* C_return, long int num_threads)
+// Node of the page holding every tile
+template <typename T>
+static std::vector<int> tile_nodes(const matrix_of_blocks<T>* tiles)
+{
+    uint64_t count = tiles->rows_ * tiles->cols_;
+    std::vector<const void*> addresses(count);
+    for (uint64_t i = 0; i < count; i++)
+        addresses[i] = tiles->matrix_[i].data_;
+
+    std::vector<int> nodes(count);
+    query_page_nodes(addresses.data(), count, nodes.data());
+    return nodes;
+}
+
+template <typename T>
+int mult_prep_block_matr_multitread(matrix_of_blocks<T>* A_normal, matrix_of_blocks<T>* B_transp,
+                                    matrix_of_blocks<typename block_traits<T>::acc_t>* C_return,
+                                    long int num_threads, const block_mult_options& options, bool B_transposed,
+                                    const numa_plan<T>* numa, bool accumulate)
 {
     assert(A_normal != nullptr);
     assert(B_transp != nullptr);
     assert(C_return != nullptr);
 
-    errno = 0;
-    thread_info* arr_thread_info = (thread_info*)aligned_alloc(CACHE_LINE_SIZE, num_threads * sizeof(*arr_thread_info));
-    if (arr_thread_info == nullptr)
+    if (num_threads <= 0)
     {
-        perror("[mult_prep_block_matr_multitread] aligned allocation of thread_info array returned error\n");
-        return E_BADALLOC;
+        fprintf(stderr, "[mult_prep_block_matr_multitread] bad number of threads %ld\n", num_threads);
+        return E_ERROR;
     }
 
-    uint64_t step = C_return->cols_ * C_return->rows_ / num_threads;
-    for (long int i = 0; i < num_threads; i++)
+    // empty product (M or N is 0), no C blocks to compute
+    uint64_t C_rows = C_return->rows_;
+    uint64_t C_cols = C_return->cols_;
+    if (C_rows == 0 || C_cols == 0)
+        return E_SUCCESS;
+
+    uint64_t block_dim = block_traits<T>::tile_dim;
+    uint64_t mc = round_to_tiles(options.mc_, block_dim);
+    uint64_t kc = round_to_tiles(options.kc_, block_dim);
+    uint64_t nc = round_to_tiles(options.nc_, block_dim);
+
+    // blocks are shrunk until there is enough of them to balance the load
+    mc = std::min(mc, C_rows);
+    nc = std::min(nc, C_cols);
+    while (((C_rows + mc - 1) / mc) * ((C_cols + nc - 1) / nc) < MIN_TASKS_PER_THREAD * num_threads && (mc > 1 || nc > 1))
+    {
+        if (nc >= mc && nc > 1)
+            nc = (nc + 1) / 2;
+        else
+            mc = (mc + 1) / 2;
+    }
+    uint64_t col_blocks = (C_cols + nc - 1) / nc;
+    uint64_t num_tasks  = ((C_rows + mc - 1) / mc) * col_blocks;
+    if (num_tasks > 0xffffffff)
     {
-        arr_thread_info[i].first_ = i * step;
-        arr_thread_info[i].last_ = arr_thread_info[i].first_ + step;
+        fprintf(stderr, "[mult_prep_block_matr_multitread] too many C blocks %lu\n", num_tasks);
+        return E_ERROR;
+    }
 
-        arr_thread_info[i].normal_ = A_normal;
-        arr_thread_info[i].transp_ = B_transp;
-        arr_thread_info[i].return_ = C_return;
+    errno = 0;
+    task_range* ranges = (task_range*)aligned_alloc(CACHE_LINE_SIZE, num_threads * sizeof(*ranges));
+    if (ranges == nullptr)
+    {
+        perror("[mult_prep_block_matr_multitread] aligned allocation of task ranges returned error\n");
+        return E_BADALLOC;
     }
 
-    try
+    thread_info<T> info;
+    info.numa_       = numa;
+    info.next_range_ = nullptr;
+
+    if (numa == nullptr)
     {
-        std::thread* arr_thread = new std::thread[num_threads];
+        // every C block is in exactly one range
         for (long int i = 0; i < num_threads; i++)
-            arr_thread[i] = std::thread(thread_routine, &arr_thread_info[i]);
+            new (&ranges[i].bounds_) std::atomic<uint64_t>(pack_range(i * num_tasks / num_threads, (i + 1) * num_tasks / num_threads));
+    }
+    else
+    {
+        // C blocks go row after row, so the row blocks of a node are one run of
+        // tasks. A row block belongs to the node of its first tile row, the node
+        // gets its share of threads and ranges split its tasks between them
+        uint64_t num_nodes = numa->node_tile_rows_.size() - 1;
+        for (uint64_t node = 0; node <= num_nodes; node++)
+            info.node_ranges_.push_back(node * num_threads / num_nodes);
+
+        for (uint64_t node = 0; node < num_nodes; node++)
+        {
+            uint64_t task_first = (numa->node_tile_rows_[node] + mc - 1) / mc * col_blocks;
+            uint64_t task_last  = (numa->node_tile_rows_[node + 1] + mc - 1) / mc * col_blocks;
+            uint64_t range_first = info.node_ranges_[node];
+            uint64_t node_ranges = info.node_ranges_[node + 1] - range_first;
+
+            for (uint64_t i = 0; i < node_ranges; i++)
+                new (&ranges[range_first + i].bounds_) std::atomic<uint64_t>(
+                    pack_range(task_first + i * (task_last - task_first) / node_ranges,
+                               task_first + (i + 1) * (task_last - task_first) / node_ranges));
+        }
+    }
+    std::vector<std::atomic<uint64_t>> next_range(info.node_ranges_.size());
+    for (uint64_t node = 0; node < next_range.size(); node++)
+        next_range[node].store(info.node_ranges_[node], std::memory_order_relaxed);
+    info.next_range_ = &next_range;
+
+    info.mc_ = mc;
+    info.kc_ = kc;
+    info.nc_ = nc;
+    info.traversal_ = (numa != nullptr) ? TRAVERSE_ROWS : options.traversal_;
+
+    info.normal_ = A_normal;
+    info.transp_ = B_transp;
+    info.return_ = C_return;
+
+    info.B_col_step_ = B_transposed ? A_normal->cols_ : 1;
+    info.B_k_step_   = B_transposed ? 1 : B_transp->cols_;
+
+    info.num_ranges_ = num_threads;
+    info.ranges_     = ranges;
+
+    info.count_traffic_ = (options.numa_stats_ != nullptr);
+    info.local_bytes_.store(0, std::memory_order_relaxed);
+    info.remote_bytes_.store(0, std::memory_order_relaxed);
+    if (info.count_traffic_)
+    {
+        info.A_nodes_ = tile_nodes(A_normal);
+        info.C_nodes_ = tile_nodes(C_return);
+        if (numa != nullptr && !numa->B_replicas_.empty())
+            for (matrix_of_blocks<T>* replica : numa->B_replicas_)
+                info.B_nodes_.push_back(tile_nodes(replica));
+        else
+            info.B_nodes_.push_back(tile_nodes(B_transp));
+    }
 
-        for (long int i = 0; i < num_threads; i++)
-            arr_thread[i].join();
+    info.accumulate_ = accumulate;
+
+    info.stats_ = options.stats_;
+    if (info.stats_ != nullptr)
+        info.stats_->threads_.assign(num_threads, block_mult_thread_stats());
+
+    thread_pool& pool = (options.pool_ != nullptr) ? *options.pool_ : thread_pool::instance();
+    pool.reserve(num_threads);
 
-        free(arr_thread_info);
-        delete[] arr_thread;
+    int ret = E_SUCCESS;
+    auto start = std::chrono::steady_clock::now();
+    try
+    {
+        pool.run(num_threads, num_threads, [&info](uint64_t index) { thread_routine(&info, index); });
     }
     catch (std::exception& error)
     {
         std::cout << error.what();
-        free(arr_thread_info);
+        ret = E_ERROR;
     }
 
-    return E_SUCCESS;
+    if (info.stats_ != nullptr)
+    {
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        for (block_mult_thread_stats& thread : info.stats_->threads_)
+            thread.idle_ = std::max(0.0, elapsed - thread.busy_);
+    }
+
+    if (info.count_traffic_)
+    {
+        options.numa_stats_->local_bytes_  += info.local_bytes_.load();
+        options.numa_stats_->remote_bytes_ += info.remote_bytes_.load();
+    }
+
+    free(ranges);
+    return ret;
 }
 
-static void fill_matrix_from_block_matrix(double* data, uint64_t rows, uint64_t cols, matrix_of_blocks* blocks)
+template <typename T>
+void fill_matrix_from_block_matrix(T* data, uint64_t rows, uint64_t cols, uint64_t row_stride, matrix_of_blocks<T>* blocks,
+                                   long int num_threads, thread_pool* pool, T alpha, T beta)
 {
     assert(data != nullptr);
     assert(blocks != nullptr);
 
-    int block_dim = blocks->matrix_[0].cols_;
-    uint64_t block_matr_cols = blocks->cols_;
-    block* matr_blocks = blocks->matrix_;
+    uint64_t block_dim = block_traits<T>::tile_dim;
+    uint64_t num_tile_rows = (rows + block_dim - 1) / block_dim;
+    uint64_t num_tile_cols = (cols + block_dim - 1) / block_dim;
 
-    for (uint64_t row = 0; row < rows; row++)
-        for (uint64_t col = 0; col < cols; col++)
+    for_tile_rows(num_tile_rows, rows * cols, num_threads, pool, [&](uint64_t tile_row)
+    {
+        uint64_t height = std::min(block_dim, rows - tile_row * block_dim);
+        for (uint64_t tile_col = 0; tile_col < num_tile_cols; tile_col++)
         {
-            uint64_t block_row = row / block_dim;
-            uint64_t block_col = col / block_dim;
-            int row_in_block   = row % block_dim;
-            int col_in_block   = col % block_dim;
-            data[row * cols + col] = matr_blocks[block_row * block_matr_cols + block_col].data_[row_in_block * block_dim + col_in_block];
+            const T* tile  = blocks->matrix_[tile_row * blocks->cols_ + tile_col].data_;
+            uint64_t width = std::min(block_dim, cols - tile_col * block_dim);
+            T* dest = data + tile_row * block_dim * row_stride + tile_col * block_dim;
+
+            for (uint64_t row = 0; row < height; row++)
+            {
+                T*       dest_row = dest + row * row_stride;
+                const T* tile_row = tile + row * block_dim;
+                if (alpha == 1 && beta == 0)
+                    memcpy(dest_row, tile_row, width * sizeof(T));
+                else if (beta == 0)
+                    for (uint64_t col = 0; col < width; col++)
+                        dest_row[col] = alpha * tile_row[col];
+                else
+                    for (uint64_t col = 0; col < width; col++)
+                        dest_row[col] = alpha * tile_row[col] + beta * dest_row[col];
+            }
         }
+    });
 }
 
-matrix matrix::block_mult(matrix& B, long int num_threads)
+// Tile rows owned by each node in NUMA mode: at most one node per thread, as
+// even as tile rows allow
+static std::vector<uint64_t> split_tile_rows(uint64_t num_tile_rows, long int num_threads)
 {
-    if (B.rows_ != columns_)
-        throw std::invalid_argument("[matrix::block_mult] incompatible matrix format\n");
+    uint64_t num_nodes = get_numa_topology().node_cpus_.size();
+    num_nodes = std::max<uint64_t>(1, std::min<uint64_t>({num_nodes, (uint64_t)num_threads, num_tile_rows}));
 
-    matrix_of_blocks* A_block_matrix = produce_block_matrix(columns_, rows_, data_);
+    std::vector<uint64_t> node_tile_rows;
+    for (uint64_t node = 0; node <= num_nodes; node++)
+        node_tile_rows.push_back(node * num_tile_rows / num_nodes);
+    return node_tile_rows;
+}
+
+// B packed once per node, each copy first-touched by its own node
+template <typename T, typename P>
+static bool pack_B_replicas(const T* B, uint64_t ldb, uint64_t K, uint64_t N, bool B_transposed, long int num_threads,
+                            thread_pool* pool, numa_plan<P>* plan)
+{
+    uint64_t num_nodes = plan->node_tile_rows_.size() - 1;
+    uint64_t B_grid_rows = (N + block_traits<P>::tile_dim - 1) / block_traits<P>::tile_dim;
+
+    for (uint64_t node = 0; node < num_nodes; node++)
+    {
+        std::vector<uint64_t> owned(num_nodes + 1, 0);
+        for (uint64_t other = node + 1; other <= num_nodes; other++)
+            owned[other] = B_grid_rows;
+
+        matrix_of_blocks<P>* replica = produce_trans_block<T, P>(N, K, B, ldb, num_threads, pool, &owned, B_transposed);
+        if (replica == nullptr)
+        {
+            for (matrix_of_blocks<P>* packed : plan->B_replicas_)
+                block_distruct(packed);
+            plan->B_replicas_.clear();
+            return false;
+        }
+        plan->B_replicas_.push_back(replica);
+    }
+
+    return true;
+}
+
+// C_tiles = op(A) * op(B), operands without given tiles are packed from row-major data
+// (given tiles are always of op(X) itself). Packed tiles hold P elements converted from T
+template <typename T, typename P = T>
+static int mult_to_tiles(const T* A, uint64_t lda, matrix_of_blocks<P>* A_tiles, const T* B, uint64_t ldb,
+                         matrix_of_blocks<P>* B_tiles, uint64_t M, uint64_t K, uint64_t N, long int num_threads,
+                         const block_mult_options& options, matrix_of_blocks<typename block_traits<P>::acc_t>** C_tiles,
+                         mult_op op_A = OP_N, mult_op op_B = OP_N)
+{
+    typedef typename block_traits<P>::acc_t acc_t;
+    typedef std::chrono::steady_clock clock;
+
+    uint64_t block_dim = block_traits<P>::tile_dim;
+
+    block_mult_options placed = options;
+    numa_plan<P> plan;
+    const std::vector<uint64_t>* node_tile_rows = nullptr;
+    if (options.numa_)
+    {
+        if (placed.pool_ == nullptr)
+            placed.pool_ = &numa_thread_pool();
+        plan.node_tile_rows_ = split_tile_rows((M + block_dim - 1) / block_dim, num_threads);
+        node_tile_rows = &plan.node_tile_rows_;
+    }
+
+    // a remote B is read by every row block of the node, a copy pays off when there are several
+    uint64_t num_nodes = plan.node_tile_rows_.empty() ? 1 : plan.node_tile_rows_.size() - 1;
+    bool replicate_B = options.numa_ && num_nodes > 1 && B_tiles == nullptr &&
+                       (M + block_dim - 1) / block_dim / num_nodes >= 2 * round_to_tiles(options.mc_, block_dim);
+
+    thread_pool* pool = placed.pool_;
+    pool_of(pool).reserve(num_threads);
+
+    clock::time_point start = clock::now();
+    matrix_of_blocks<P>* A_block_matrix = A_tiles;
     if (A_block_matrix == nullptr)
-        throw std::runtime_error("[matrix::block_mult] produce A block matrix return error\n");
+        A_block_matrix = produce_block_matrix<T, P>(K, M, A, lda, num_threads, pool, node_tile_rows, op_A == OP_T);
+    if (A_block_matrix == nullptr)
+        return E_BADALLOC;
 
-    matrix_of_blocks* B_trans_block_matrix = produce_trans_block(B.columns_, B.rows_, B.data_);
+    clock::time_point A_packed = clock::now();
+    matrix_of_blocks<P>* B_trans_block_matrix = B_tiles;
+    if (replicate_B)
+        B_trans_block_matrix = pack_B_replicas(B, ldb, K, N, op_B == OP_T, num_threads, pool, &plan) ? plan.B_replicas_[0] : nullptr;
+    else if (B_trans_block_matrix == nullptr)
+        B_trans_block_matrix = produce_trans_block<T, P>(N, K, B, ldb, num_threads, pool, nullptr, op_B == OP_T);
     if (B_trans_block_matrix == nullptr)
     {
-        block_distruct(A_block_matrix);
-        throw std::runtime_error("[matrix::block_mult] produce B block matrix return error\n");
+        if (A_tiles == nullptr)
+            block_distruct(A_block_matrix);
+        return E_BADALLOC;
     }
 
-    matrix_of_blocks* C_block_matrix = produce_block_matrix(B.columns_, rows_, nullptr);
-    if (C_block_matrix == nullptr)
+    clock::time_point B_packed = clock::now();
+    matrix_of_blocks<acc_t>* C_block_matrix = produce_block_matrix<acc_t>(N, M, nullptr, N, num_threads, pool, node_tile_rows);
+    int ret = E_BADALLOC;
+
+    if (options.numa_stats_ != nullptr)
     {
-        block_distruct(A_block_matrix);
-        block_distruct(B_trans_block_matrix);
-        throw std::runtime_error("[matrix::block_mult] produce C block matrix return error\n");
+        options.numa_stats_->num_nodes_    = get_numa_topology().node_cpus_.size();
+        options.numa_stats_->B_replicated_ = replicate_B;
+        options.numa_stats_->local_bytes_  = 0;
+        options.numa_stats_->remote_bytes_ = 0;
     }
 
-    int ret = mult_prep_block_matr_multitread(A_block_matrix, B_trans_block_matrix, C_block_matrix, num_threads);
-    if (ret != E_SUCCESS)
+    clock::time_point C_packed = clock::now();
+    if (C_block_matrix != nullptr)
+        ret = mult_prep_block_matr_multitread(A_block_matrix, B_trans_block_matrix, C_block_matrix, num_threads, placed,
+                                              B_tiles == nullptr, options.numa_ ? &plan : nullptr);
+    clock::time_point computed = clock::now();
+
+    if (options.debug_dump_ != nullptr && ret == E_SUCCESS)
     {
+        std::string prefix = options.debug_dump_;
+        debug_print_block_matrix(A_block_matrix, (prefix + "A_block_matrix.matr").c_str());
+        debug_print_block_matrix(B_trans_block_matrix, (prefix + "B_block_matrix.matr").c_str());
+        debug_print_block_matrix(C_block_matrix, (prefix + "C_block_matrix.matr").c_str());
+    }
+
+    if (A_tiles == nullptr)
         block_distruct(A_block_matrix);
+    if (replicate_B)
+    {
+        for (matrix_of_blocks<P>* replica : plan.B_replicas_)
+            block_distruct(replica);
+    }
+    else if (B_tiles == nullptr)
         block_distruct(B_trans_block_matrix);
+
+    if (options.timings_ != nullptr)
+    {
+        options.timings_->pack_A_  = std::chrono::duration<double>(A_packed - start).count();
+        options.timings_->pack_B_  = std::chrono::duration<double>(B_packed - A_packed).count();
+        options.timings_->pack_C_  = std::chrono::duration<double>(C_packed - B_packed).count();
+        options.timings_->compute_ = std::chrono::duration<double>(computed - C_packed).count();
+        options.timings_->unpack_  = 0.0;
+    }
+
+    if (options.stats_ != nullptr)
+    {
+        clock::time_point bounds[PHASE_UNPACK + 1] = {start, A_packed, B_packed, C_packed, computed};
+        options.stats_->start_ = start;
+        for (int phase = 0; phase < PHASE_UNPACK; phase++)
+        {
+            options.stats_->phase_begin_[phase] = std::chrono::duration<double>(bounds[phase] - start).count();
+            options.stats_->phase_end_[phase]   = std::chrono::duration<double>(bounds[phase + 1] - start).count();
+        }
+        options.stats_->phase_begin_[PHASE_UNPACK] = 0.0;
+        options.stats_->phase_end_[PHASE_UNPACK]   = 0.0;
+    }
+
+    if (ret != E_SUCCESS && C_block_matrix != nullptr)
+    {
         block_distruct(C_block_matrix);
-        throw std::runtime_error("[matrix::block_mult] multithread mult of prepared matrix returned error\n");
+        C_block_matrix = nullptr;
+    }
+    *C_tiles = C_block_matrix;
+    return ret;
+}
+
+// Double products asking for mixed precision pack the operands as mixed_f32, so
+// their double tiles can't be used: callers pass the row-major data instead
+template <typename T>
+static bool mixed_precision(const block_mult_options& options)
+{
+    return std::is_same<T, double>::value && options.mixed_precision_;
+}
+
+// mult_to_tiles with the packed element type the options ask for
+template <typename T>
+static int packed_mult_to_tiles(const T* A, uint64_t lda, matrix_of_blocks<T>* A_tiles, const T* B, uint64_t ldb,
+                                matrix_of_blocks<T>* B_tiles, uint64_t M, uint64_t K, uint64_t N, long int num_threads,
+                                const block_mult_options& options, matrix_of_blocks<typename block_traits<T>::acc_t>** C_tiles,
+                                mult_op op_A = OP_N, mult_op op_B = OP_N)
+{
+    if constexpr (std::is_same<T, double>::value)
+    {
+        if (options.mixed_precision_)
+        {
+            assert(A != nullptr && B != nullptr);
+            return mult_to_tiles<T, mixed_f32>(A, lda, nullptr, B, ldb, nullptr, M, K, N, num_threads, options, C_tiles,
+                                               op_A, op_B);
+        }
+    }
+    return mult_to_tiles<T>(A, lda, A_tiles, B, ldb, B_tiles, M, K, N, num_threads, options, C_tiles, op_A, op_B);
+}
+
+template <typename T>
+int block_mult_view(const T* A, uint64_t lda, const T* B, uint64_t ldb, typename block_traits<T>::acc_t* C, uint64_t ldc,
+                    uint64_t M, uint64_t K, uint64_t N, long int num_threads, const block_mult_options& options,
+                    mult_op op_A, mult_op op_B)
+{
+    typedef typename block_traits<T>::acc_t acc_t;
+
+    matrix_of_blocks<acc_t>* C_block_matrix = nullptr;
+    int ret = packed_mult_to_tiles<T>(A, lda, nullptr, B, ldb, nullptr, M, K, N, num_threads, options, &C_block_matrix,
+                                      op_A, op_B);
+    if (ret != E_SUCCESS)
+        return ret;
+
+    auto start = std::chrono::steady_clock::now();
+    thread_pool* pool = (options.numa_ && options.pool_ == nullptr) ? &numa_thread_pool() : options.pool_;
+    fill_matrix_from_block_matrix(C, M, N, ldc, C_block_matrix, num_threads, pool);
+    block_distruct(C_block_matrix);
+
+    auto end = std::chrono::steady_clock::now();
+    if (options.timings_ != nullptr)
+        options.timings_->unpack_ = std::chrono::duration<double>(end - start).count();
+    if (options.stats_ != nullptr)
+    {
+        options.stats_->phase_begin_[PHASE_UNPACK] = std::chrono::duration<double>(start - options.stats_->start_).count();
+        options.stats_->phase_end_[PHASE_UNPACK]   = std::chrono::duration<double>(end - options.stats_->start_).count();
+    }
+
+    return E_SUCCESS;
+}
+
+template <typename T>
+basic_matrix<typename accumulator<T>::type> basic_matrix<T>::block_mult(basic_matrix& B, long int num_threads)
+{
+    return block_mult(B, num_threads, block_mult_options());
+}
+
+template <typename T>
+basic_matrix<typename accumulator<T>::type> basic_matrix<T>::block_mult(basic_matrix& B, long int num_threads,
+                                                                        const block_mult_options& options)
+{
+    return ::block_mult(OP_N, *this, OP_N, B, num_threads, options);
+}
+
+// A vector operand (M == 1 or N == 1) of row-major matrices goes to gemv, which
+// reads the matrix once instead of padding the vector to a tile. Products asking
+// for the placement or instrumentation of the tile pipeline keep it
+static bool vector_product(uint64_t M, uint64_t N, bool tiled, const block_mult_options& options)
+{
+    return (M == 1 || N == 1) && !tiled && !options.numa_ && options.timings_ == nullptr && options.stats_ == nullptr &&
+           options.numa_stats_ == nullptr && options.debug_dump_ == nullptr;
+}
+
+template <typename T>
+basic_matrix<typename accumulator<T>::type> block_mult(mult_op op_A, basic_matrix<T>& A, mult_op op_B, basic_matrix<T>& B,
+                                                       long int num_threads, const block_mult_options& options)
+{
+    typedef typename accumulator<T>::type acc_t;
+
+    uint64_t M = (op_A == OP_N) ? A.rows_ : A.columns_;
+    uint64_t K = (op_A == OP_N) ? A.columns_ : A.rows_;
+    uint64_t N = (op_B == OP_N) ? B.columns_ : B.rows_;
+    if (((op_B == OP_N) ? B.rows_ : B.columns_) != K)
+        throw std::invalid_argument("[matrix::block_mult] incompatible matrix format\n");
+    if (num_threads < 0)
+        throw std::invalid_argument("[matrix::block_mult] negative number of threads\n");
+
+    block_mult_options resolved = resolve_options(options, M, N, K, &num_threads);
+
+    // either vector is contiguous whatever its op, y^T = x^T * op(B) is op(B)^T * x
+    if (vector_product(M, N, A.tiled_ != nullptr || B.tiled_ != nullptr, resolved))
+    {
+        basic_matrix<acc_t> C(N, M);
+        if (N == 1)
+            gemv(op_A, acc_t(1), A, B.data_, acc_t(0), C.data_, num_threads, resolved.pool_);
+        else
+            gemv((op_B == OP_N) ? OP_T : OP_N, acc_t(1), B, A.data_, acc_t(0), C.data_, num_threads, resolved.pool_);
+        return C;
     }
-    debug_print_block_matrix(C_block_matrix, "C_block_matrix.matr");
-    //debug_print_block_matrix(A_block_matrix, "A_block_matrix.matr");
-    //debug_print_block_matrix(B_trans_block_matrix, "B_block_matrix.matr");
 
-    block_distruct(A_block_matrix);
-    block_distruct(B_trans_block_matrix);
+    bool strassen = std::is_floating_point<T>::value && resolved.algorithm_ == ALGO_STRASSEN && op_A == OP_N && op_B == OP_N;
+    if (!strassen && (A.tiled_ != nullptr || B.tiled_ != nullptr || resolved.tiled_result_))
+    {
+        // the tiled operands are used in place (unless transposed or repacked as
+        // mixed_f32) and the product stays tiled
+        bool mixed = mixed_precision<T>(resolved);
+        matrix_of_blocks<T>* A_tiles = (op_A == OP_N && !mixed) ? A.tiled_ : nullptr;
+        matrix_of_blocks<T>* B_tiles = (op_B == OP_N && !mixed) ? B.tiled_ : nullptr;
+        const T* A_data = (A_tiles != nullptr) ? nullptr : static_cast<const basic_matrix<T>&>(A).data();
+        const T* B_data = (B_tiles != nullptr) ? nullptr : static_cast<const basic_matrix<T>&>(B).data();
+
+        matrix_of_blocks<acc_t>* C_tiles = nullptr;
+        int ret = packed_mult_to_tiles<T>(A_data, A.columns_, A_tiles, B_data, B.columns_, B_tiles, M, K, N,
+                                          num_threads, resolved, &C_tiles, op_A, op_B);
+        if (ret != E_SUCCESS)
+            throw std::runtime_error("[matrix::block_mult] multiplication returned error " + std::to_string(ret) + "\n");
+
+        return basic_matrix<acc_t>(N, M, C_tiles, typename basic_matrix<acc_t>::from_tiles_t());
+    }
 
-    matrix C(B.columns_, rows_);
+    const T* A_data = static_cast<const basic_matrix<T>&>(A).data();
+    const T* B_data = static_cast<const basic_matrix<T>&>(B).data();
+    basic_matrix<acc_t> C(N, M);
 
-    fill_matrix_from_block_matrix(C.data_, C.rows_, C.columns_, C_block_matrix);
+    int ret = E_SUCCESS;
+    if constexpr (std::is_floating_point<T>::value)
+    {
+        if (strassen)
+            ret = strassen_mult(A_data, A.columns_, B_data, B.columns_, C.data_, N, M, K, N, num_threads, resolved);
+        else
+            ret = block_mult_view(A_data, A.columns_, B_data, B.columns_, C.data_, N, M, K, N, num_threads, resolved, op_A, op_B);
+    }
+    else
+        ret = block_mult_view(A_data, A.columns_, B_data, B.columns_, C.data_, N, M, K, N, num_threads, resolved, op_A, op_B);
+
+    if (ret != E_SUCCESS)
+        throw std::runtime_error("[matrix::block_mult] multiplication returned error " + std::to_string(ret) + "\n");
 
     return C;
 }
+
+// data = beta * data for count elements, zeros if beta == 0 (data may hold NaNs)
+template <typename T>
+static void scale_elements(T* data, uint64_t count, T beta)
+{
+    if (beta == 0)
+        std::fill(data, data + count, T(0));
+    else if (beta != 1)
+        for (uint64_t i = 0; i < count; i++)
+            data[i] *= beta;
+}
+
+// dest = alpha * product + beta * dest for grids of the same shape (padding stays zero)
+template <typename T>
+static void combine_tiles(matrix_of_blocks<T>* dest, const matrix_of_blocks<T>* product, T alpha, T beta,
+                          long int num_threads, thread_pool* pool)
+{
+    uint64_t row_size = dest->cols_ * block_traits<T>::tile_size;
+
+    for_tile_rows(dest->rows_, dest->rows_ * row_size, num_threads, pool, [&](uint64_t tile_row)
+    {
+        T*       out = dest->data_ + tile_row * row_size;
+        const T* in  = product->data_ + tile_row * row_size;
+        if (beta == 0)
+            for (uint64_t i = 0; i < row_size; i++)
+                out[i] = alpha * in[i];
+        else
+            for (uint64_t i = 0; i < row_size; i++)
+                out[i] = alpha * in[i] + beta * out[i];
+    });
+}
+
+template <typename T>
+void gemm(typename accumulator<T>::type alpha, basic_matrix<T>& A, basic_matrix<T>& B, typename accumulator<T>::type beta,
+          basic_matrix<typename accumulator<T>::type>& C, long int num_threads, const block_mult_options& options)
+{
+    gemm(OP_N, OP_N, alpha, A, B, beta, C, num_threads, options);
+}
+
+template <typename T>
+void gemm(mult_op op_A, mult_op op_B, typename accumulator<T>::type alpha, basic_matrix<T>& A, basic_matrix<T>& B,
+          typename accumulator<T>::type beta, basic_matrix<typename accumulator<T>::type>& C, long int num_threads,
+          const block_mult_options& options)
+{
+    typedef typename accumulator<T>::type acc_t;
+
+    uint64_t M = (op_A == OP_N) ? A.rows_ : A.columns_;
+    uint64_t K = (op_A == OP_N) ? A.columns_ : A.rows_;
+    uint64_t N = (op_B == OP_N) ? B.columns_ : B.rows_;
+    if (((op_B == OP_N) ? B.rows_ : B.columns_) != K || C.rows_ != M || C.columns_ != N)
+        throw std::invalid_argument("[gemm] incompatible matrix format\n");
+    if (num_threads < 0)
+        throw std::invalid_argument("[gemm] negative number of threads\n");
+
+    block_mult_options resolved = resolve_options(options, M, N, K, &num_threads);
+    thread_pool* pool = (resolved.numa_ && resolved.pool_ == nullptr) ? &numa_thread_pool() : resolved.pool_;
+
+    // the row-major copy a tiled C may keep is stale after the update
+    if (C.tiled_ != nullptr)
+        C.drop_row_major();
+
+    if (alpha == 0)
+    {
+        if (C.tiled_ != nullptr)
+            scale_elements(C.tiled_->data_, C.tiled_->rows_ * C.tiled_->cols_ * block_traits<acc_t>::tile_size, beta);
+        else
+            scale_elements(C.data_, M * N, beta);
+        return;
+    }
+
+    if (C.tiled_ == nullptr && vector_product(M, N, A.tiled_ != nullptr || B.tiled_ != nullptr, resolved))
+    {
+        if (N == 1)
+            gemv(op_A, alpha, A, B.data_, beta, C.data_, num_threads, resolved.pool_);
+        else
+            gemv((op_B == OP_N) ? OP_T : OP_N, alpha, B, A.data_, beta, C.data_, num_threads, resolved.pool_);
+        return;
+    }
+
+    int ret = E_SUCCESS;
+    if constexpr (std::is_floating_point<T>::value)
+    {
+        // the recursion works on row-major views (a tiled C takes the classic path to stay tiled)
+        if (resolved.algorithm_ == ALGO_STRASSEN && C.tiled_ == nullptr && op_A == OP_N && op_B == OP_N)
+        {
+            const T* A_data = static_cast<const basic_matrix<T>&>(A).data();
+            const T* B_data = static_cast<const basic_matrix<T>&>(B).data();
+            T*       dest   = C.data();
+
+            // with beta == 0 the product goes straight into C (unless C is an operand),
+            // otherwise through a workspace temporary
+            bool direct  = (beta == 0 && dest != A_data && dest != B_data);
+            T*   product = direct ? dest : (T*)workspace::instance().acquire(M * N * sizeof(T));
+            ret = (product == nullptr) ? E_BADALLOC : strassen_mult(A_data, K, B_data, N, product, N, M, K, N, num_threads, resolved);
+
+            if (ret == E_SUCCESS && direct && alpha != 1)
+                for (uint64_t i = 0; i < M * N; i++)
+                    dest[i] *= alpha;
+            else if (ret == E_SUCCESS && !direct)
+                for (uint64_t i = 0; i < M * N; i++)
+                    dest[i] = alpha * product[i] + ((beta == 0) ? T(0) : beta * dest[i]);
+
+            if (!direct)
+                workspace::instance().release(product);
+            if (ret != E_SUCCESS)
+                throw std::runtime_error("[gemm] multiplication returned error " + std::to_string(ret) + "\n");
+            return;
+        }
+    }
+
+    // tiles of a transposed (or mixed precision) operand can't be used, it is packed from the row-major copy
+    bool mixed = mixed_precision<T>(resolved);
+    matrix_of_blocks<T>* A_tiles = (op_A == OP_N && !mixed) ? A.tiled_ : nullptr;
+    matrix_of_blocks<T>* B_tiles = (op_B == OP_N && !mixed) ? B.tiled_ : nullptr;
+    const T* A_data = (A_tiles != nullptr) ? nullptr : static_cast<const basic_matrix<T>&>(A).data();
+    const T* B_data = (B_tiles != nullptr) ? nullptr : static_cast<const basic_matrix<T>&>(B).data();
+
+    matrix_of_blocks<acc_t>* product = nullptr;
+    ret = packed_mult_to_tiles<T>(A_data, A.columns_, A_tiles, B_data, B.columns_, B_tiles, M, K, N, num_threads, resolved,
+                                  &product, op_A, op_B);
+    if (ret != E_SUCCESS)
+        throw std::runtime_error("[gemm] multiplication returned error " + std::to_string(ret) + "\n");
+
+    auto start = std::chrono::steady_clock::now();
+    if (C.tiled_ != nullptr)
+        combine_tiles(C.tiled_, product, alpha, beta, num_threads, pool);
+    else
+        fill_matrix_from_block_matrix(C.data_, M, N, N, product, num_threads, pool, alpha, beta);
+    block_distruct(product);
+
+    auto end = std::chrono::steady_clock::now();
+    if (resolved.timings_ != nullptr)
+        resolved.timings_->unpack_ = std::chrono::duration<double>(end - start).count();
+    if (resolved.stats_ != nullptr)
+    {
+        resolved.stats_->phase_begin_[PHASE_UNPACK] = std::chrono::duration<double>(start - resolved.stats_->start_).count();
+        resolved.stats_->phase_end_[PHASE_UNPACK]   = std::chrono::duration<double>(end - resolved.stats_->start_).count();
+    }
+}
+
+template class basic_matrix<double>;
+template class basic_matrix<float>;
+template class basic_matrix<int32_t>;
+template class basic_matrix<int8_t>;
+
+template void gemm(double, matrix&, matrix&, double, matrix&, long int, const block_mult_options&);
+template void gemm(float, matrix_f32&, matrix_f32&, float, matrix_f32&, long int, const block_mult_options&);
+template void gemm(int32_t, matrix_i32&, matrix_i32&, int32_t, matrix_i32&, long int, const block_mult_options&);
+template void gemm(int32_t, matrix_i8&, matrix_i8&, int32_t, matrix_i32&, long int, const block_mult_options&);
+template void gemm(mult_op, mult_op, double, matrix&, matrix&, double, matrix&, long int, const block_mult_options&);
+template void gemm(mult_op, mult_op, float, matrix_f32&, matrix_f32&, float, matrix_f32&, long int, const block_mult_options&);
+template void gemm(mult_op, mult_op, int32_t, matrix_i32&, matrix_i32&, int32_t, matrix_i32&, long int, const block_mult_options&);
+template void gemm(mult_op, mult_op, int32_t, matrix_i8&, matrix_i8&, int32_t, matrix_i32&, long int, const block_mult_options&);
+
+template matrix     block_mult(mult_op, matrix&, mult_op, matrix&, long int, const block_mult_options&);
+template matrix_f32 block_mult(mult_op, matrix_f32&, mult_op, matrix_f32&, long int, const block_mult_options&);
+template matrix_i32 block_mult(mult_op, matrix_i32&, mult_op, matrix_i32&, long int, const block_mult_options&);
+template matrix_i32 block_mult(mult_op, matrix_i8&, mult_op, matrix_i8&, long int, const block_mult_options&);
+
+template matrix_of_blocks<double>* produce_block_matrix(uint64_t, uint64_t, const double*, uint64_t, long int, thread_pool*,
+                                                       const std::vector<uint64_t>*, bool);
+template matrix_of_blocks<float>*   produce_block_matrix(uint64_t, uint64_t, const float*, uint64_t, long int, thread_pool*,
+                                                         const std::vector<uint64_t>*, bool);
+template matrix_of_blocks<int32_t>* produce_block_matrix(uint64_t, uint64_t, const int32_t*, uint64_t, long int, thread_pool*,
+                                                         const std::vector<uint64_t>*, bool);
+template matrix_of_blocks<int8_t>*  produce_block_matrix(uint64_t, uint64_t, const int8_t*, uint64_t, long int, thread_pool*,
+                                                         const std::vector<uint64_t>*, bool);
+template matrix_of_blocks<double>* produce_trans_block(uint64_t, uint64_t, const double*, uint64_t, long int, thread_pool*,
+                                                      const std::vector<uint64_t>*, bool);
+template matrix_of_blocks<float>*   produce_trans_block(uint64_t, uint64_t, const float*, uint64_t, long int, thread_pool*,
+                                                        const std::vector<uint64_t>*, bool);
+template matrix_of_blocks<int32_t>* produce_trans_block(uint64_t, uint64_t, const int32_t*, uint64_t, long int, thread_pool*,
+                                                        const std::vector<uint64_t>*, bool);
+template matrix_of_blocks<int8_t>*  produce_trans_block(uint64_t, uint64_t, const int8_t*, uint64_t, long int, thread_pool*,
+                                                        const std::vector<uint64_t>*, bool);
+template void block_distruct(matrix_of_blocks<double>*);
+template void block_distruct(matrix_of_blocks<float>*);
+template void block_distruct(matrix_of_blocks<int32_t>*);
+template void block_distruct(matrix_of_blocks<int8_t>*);
+template void fill_matrix_from_block_matrix(double*, uint64_t, uint64_t, uint64_t, matrix_of_blocks<double>*, long int, thread_pool*,
+                                            double, double);
+template void fill_matrix_from_block_matrix(float*, uint64_t, uint64_t, uint64_t, matrix_of_blocks<float>*, long int, thread_pool*,
+                                            float, float);
+template void fill_matrix_from_block_matrix(int32_t*, uint64_t, uint64_t, uint64_t, matrix_of_blocks<int32_t>*, long int,
+                                            thread_pool*, int32_t, int32_t);
+template int  mult_prep_block_matr_multitread(matrix_of_blocks<double>*, matrix_of_blocks<double>*, matrix_of_blocks<double>*,
+                                              long int, const block_mult_options&, bool, const numa_plan<double>*, bool);
+template int  mult_prep_block_matr_multitread(matrix_of_blocks<float>*, matrix_of_blocks<float>*, matrix_of_blocks<float>*,
+                                              long int, const block_mult_options&, bool, const numa_plan<float>*, bool);
+template int  mult_prep_block_matr_multitread(matrix_of_blocks<int32_t>*, matrix_of_blocks<int32_t>*, matrix_of_blocks<int32_t>*,
+                                              long int, const block_mult_options&, bool, const numa_plan<int32_t>*, bool);
+template int  mult_prep_block_matr_multitread(matrix_of_blocks<int8_t>*, matrix_of_blocks<int8_t>*, matrix_of_blocks<int32_t>*,
+                                              long int, const block_mult_options&, bool, const numa_plan<int8_t>*, bool);
+template int  block_mult_view(const double*, uint64_t, const double*, uint64_t, double*, uint64_t,
+                              uint64_t, uint64_t, uint64_t, long int, const block_mult_options&, mult_op, mult_op);
+template int  block_mult_view(const float*, uint64_t, const float*, uint64_t, float*, uint64_t,
+                              uint64_t, uint64_t, uint64_t, long int, const block_mult_options&, mult_op, mult_op);
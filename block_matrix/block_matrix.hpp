@@ -1,3 +1,6 @@
+#pragma once
+
+#include "kernels.hpp"
 #include <cstdint>
 #include <stdexcept>
 #include <unistd.h>
@@ -5,23 +8,355 @@
 #include <iostream>
 #include <algorithm>
 #include <thread>
+#include <chrono>
+#include <vector>
+#include <future>
 
 const uint32_t CACHE_LINE_SIZE = 64;
 
-class matrix
+class thread_pool;
+
+enum block_traversal
+{
+    TRAVERSE_DEFAULT = 0,
+    TRAVERSE_COLUMNS = 1, // C blocks column after column: threads share B panel
+    TRAVERSE_ROWS    = 2, // C blocks row after row: threads share A block
+};
+
+// ALGO_STRASSEN recurses Strassen-Winograd (7 products instead of 8 per level,
+// slightly worse rounding) until a dimension drops to strassen_crossover_,
+// then the blocks are multiplied by the classic blocked kernel. Integer
+// matrices always take the classic path (the additions would overflow int8)
+enum block_algorithm
+{
+    ALGO_DEFAULT  = 0,
+    ALGO_CLASSIC  = 1,
+    ALGO_STRASSEN = 2,
+};
+
+// Wall time of block_mult stages in seconds
+struct block_mult_timings
+{
+    double pack_A_;
+    double pack_B_;
+    double pack_C_;  // zero-filled C tiles
+    double compute_;
+    double unpack_;
+};
+
+// Placement of the product on a NUMA machine (filled by the classic path if
+// block_mult_options::numa_stats_ is set, in both modes). Traffic is counted
+// per tile the micro-kernels read and write, by the node of the page holding
+// the tile against the node of the thread running the kernel
+struct block_mult_numa_stats
+{
+    long int num_nodes_;    // nodes with usable cpus
+    bool     B_replicated_; // every node multiplied its own copy of packed B
+    uint64_t local_bytes_;
+    uint64_t remote_bytes_;
+};
+
+// Instrumentation of the classic path, on while block_mult_options::stats_ is set.
+// Phases are timestamps in seconds from the start of the call (unpack stays zero
+// when the product is kept tiled). A thread entry belongs to one range of C blocks,
+// so it is one worker of the pool unless a worker ran two ranges in turn
+enum block_mult_phase
+{
+    PHASE_PACK_A  = 0,
+    PHASE_PACK_B  = 1,
+    PHASE_PACK_C  = 2,
+    PHASE_COMPUTE = 3,
+    PHASE_UNPACK  = 4,
+    PHASE_COUNT   = 5,
+};
+
+struct block_mult_thread_stats
+{
+    int      cpu_;        // where the thread started
+    double   busy_;       // seconds spent in C blocks
+    double   idle_;       // the rest of the compute phase: late start, stealing, waiting for others
+    uint64_t tasks_;      // C blocks computed
+    uint64_t steals_;
+    uint64_t tiles_;      // micro-kernel calls (C tile by k-panel)
+    int64_t  cycles_;     // -1 if hardware counters are off or not available
+    int64_t  llc_misses_;
+    int64_t  dtlb_misses_; // data TLB load misses of the tile walks
+};
+
+struct block_mult_stats
+{
+    bool hw_counters_ = false; // in: count cycles, LLC and dTLB misses with perf_event_open
+
+    std::chrono::steady_clock::time_point start_;
+    double phase_begin_[PHASE_COUNT];
+    double phase_end_[PHASE_COUNT];
+    std::vector<block_mult_thread_stats> threads_;
+};
+
+struct block_mult_options
+{
+    // GotoBLAS cache blocking in elements, rounded to tiles (0 - from the sysfs cache sizes):
+    // kc x tile panels of A and B stay in L1, mc x kc block of A - in L2, kc x nc panel of B - in L3
+    uint64_t        mc_        = 0;
+    uint64_t        kc_        = 0;
+    uint64_t        nc_        = 0;
+    block_traversal traversal_ = TRAVERSE_DEFAULT;
+    thread_pool*    pool_      = nullptr; // nullptr - process-wide thread_pool::instance()
+
+    block_algorithm algorithm_          = ALGO_DEFAULT;
+    uint64_t        strassen_crossover_ = 0; // 0 - STRASSEN_DEF_CROSSOVER
+
+    block_mult_timings* timings_ = nullptr; // filled by the classic path if set
+
+    // runs on numa_thread_pool() (workers pinned node by node) unless pool_ is given;
+    // each node packs and computes its own rows of C tiles, B is packed per node
+    bool                   numa_       = false;
+    block_mult_numa_stats* numa_stats_ = nullptr;
+
+    block_mult_stats* stats_      = nullptr;
+    const char*       debug_dump_ = nullptr; // path prefix: packed A, B and C of the classic path are dumped as text
+
+    // double products: operands are rounded to float as they are packed (half the
+    // traffic of packed tiles), products are accumulated in double (see mixed_f32).
+    // Products routed to gemv stay in double
+    bool mixed_precision_ = false;
+
+    // block_mult returns the product tiled even for row-major operands (it stays
+    // tiled for the next product of a chain). Products routed to gemv or Strassen are row-major
+    bool tiled_result_ = false;
+};
+
+const uint64_t STRASSEN_DEF_CROSSOVER = 512;
+
+// Block sizes derived from the cache hierarchy of the running machine
+block_mult_options detect_block_mult_options();
+
+// Tuned configuration of block_mult for (M x K) * (K x N) product.
+// The profile is a text file (BLOCK_MATRIX_PROFILE or ./block_mult.profile),
+// block_mult loads it once and uses the entry of the nearest shape for the
+// fields left zero in options and for num_threads == 0
+struct block_mult_profile_entry
 {
+    uint64_t           M_;
+    uint64_t           N_;
+    uint64_t           K_;
+    long int           num_threads_;
+    block_mult_options options_;
+};
+
+const char* block_mult_profile_path();
+bool find_block_mult_profile_entry(uint64_t M, uint64_t N, uint64_t K, block_mult_profile_entry* entry);
+// Replaces entry of the same shape in the profile file (doesn't affect already loaded profile)
+bool save_block_mult_profile_entry(const block_mult_profile_entry& entry);
+
+// Out-of-core C = A * B for row-major .matb files larger than memory: panels of
+// A and B are packed on the fly (the next A panel is read while the current one
+// is multiplied) and finished C panels go straight to C_file
+struct stream_mult_options
+{
+    uint64_t           memory_budget_ = 0; // bytes for panels and buffers, 0 - half of physical memory
+    block_mult_options block_;             // blocking of every in-memory panel product
+};
+
+void stream_block_mult(const char* A_file, const char* B_file, const char* C_file, long int num_threads,
+                       const stream_mult_options& options = stream_mult_options());
+
+enum matrix_layout
+{
+    LAYOUT_ROW_MAJOR = 0,
+    LAYOUT_TILED     = 1,
+};
+
+template <typename T> struct matrix_of_blocks;
+template <typename T> class basic_matrix;
+template <typename T> class basic_csr_matrix;
+
+// op(X) of block_mult and gemm: X as it is stored or its transpose. A transposed
+// operand is packed straight from its storage, the transpose is never built.
+// Tiles of a transposed tiled operand aren't used in place (its row-major copy
+// is packed instead), and products with a transposed operand take the classic
+// path even if ALGO_STRASSEN is asked for
+enum mult_op
+{
+    OP_N = 0,
+    OP_T = 1,
+};
+
+// C = alpha * A * B + beta * C into the existing M x N matrix C, which keeps its
+// layout: a tiled C is updated tile by tile, a row-major one as the product is
+// unpacked, so no result matrix is allocated. beta == 0 doesn't read C (as in BLAS),
+// alpha == 0 only scales C. num_threads == 0 takes the tuned number
+template <typename T>
+void gemm(typename accumulator<T>::type alpha, basic_matrix<T>& A, basic_matrix<T>& B, typename accumulator<T>::type beta,
+          basic_matrix<typename accumulator<T>::type>& C, long int num_threads = 0,
+          const block_mult_options& options = block_mult_options());
+// C = alpha * op(A) * op(B) + beta * C
+template <typename T>
+void gemm(mult_op op_A, mult_op op_B, typename accumulator<T>::type alpha, basic_matrix<T>& A, basic_matrix<T>& B,
+          typename accumulator<T>::type beta, basic_matrix<typename accumulator<T>::type>& C, long int num_threads = 0,
+          const block_mult_options& options = block_mult_options());
+
+// y = alpha * op(A) * x + beta * y without the tile pipeline: OP_N takes SIMD dot
+// products of A rows with x, rows split between threads, OP_T adds x[i] * row i
+// of A into y, columns split between threads. x has op(A).columns elements, y -
+// op(A).rows; beta == 0 doesn't read y. A tiled A is read through its row-major copy.
+// num_threads == 0 takes hardware concurrency (fewer threads for small A),
+// pool == nullptr - thread_pool::instance()
+template <typename T>
+void gemv(mult_op op_A, typename accumulator<T>::type alpha, const basic_matrix<T>& A, const T* x,
+          typename accumulator<T>::type beta, typename accumulator<T>::type* y, long int num_threads = 0,
+          thread_pool* pool = nullptr);
+// The same for count vectors: vector v is x + v * ldx, its result y + v * ldy.
+// A row (a piece of it for OP_T) is multiplied by all the vectors while it is in cache
+template <typename T>
+void gemv_batch(mult_op op_A, typename accumulator<T>::type alpha, const basic_matrix<T>& A, const T* x, uint64_t ldx,
+                typename accumulator<T>::type beta, typename accumulator<T>::type* y, uint64_t ldy, uint64_t count,
+                long int num_threads = 0, thread_pool* pool = nullptr);
+
+// op(A) * op(B), the same as A.block_mult(B) for OP_N operands. A product with a
+// vector operand (one row of op(A) or one column of op(B)) of row-major matrices
+// goes to gemv, unless options ask for NUMA placement or pipeline instrumentation
+template <typename T>
+basic_matrix<typename accumulator<T>::type> block_mult(mult_op op_A, basic_matrix<T>& A, mult_op op_B, basic_matrix<T>& B,
+                                                       long int num_threads = 0,
+                                                       const block_mult_options& options = block_mult_options());
+
+// Product of a chain of matrices in the cheapest order: dynamic programming over
+// their dimensions picks the parenthesisation with the fewest multiply-adds. The
+// intermediate products stay tiled and the next step reads them in place, so only
+// the matrices of the chain are packed and only the result is unpacked (it stays
+// tiled if a matrix of the chain is tiled or options ask for a tiled result).
+// Element types whose products keep the type: double, float and int32
+template <typename T>
+basic_matrix<T> chain_mult(const std::vector<basic_matrix<T>*>& chain, long int num_threads = 0,
+                           const block_mult_options& options = block_mult_options());
+// Multiply-adds of the cheapest order of a chain of dims[i] x dims[i + 1] matrices
+// (n = dims.size() - 1 of them). (*split)[i * n + j] is the last split of matrices
+// i..j: their product is (i..split) * (split + 1..j)
+double chain_order(const std::vector<uint64_t>& dims, std::vector<uint64_t>* split);
+
+// A * B started on a worker of options.pool_ (nullptr - thread_pool::instance()),
+// the caller gets a future at once. K is split in a few panels: one thread packs
+// the next panel while the others compute the current one, so packing hides behind
+// compute. Products started together share the pool's workers. A and B must stay
+// alive and unchanged until the future is ready; tiled operands are read through
+// their row-major copies made by this call. NUMA, mixed precision, tiled result and
+// instrumentation options are reset (the product is full precision and row-major)
+template <typename T>
+std::future<basic_matrix<typename accumulator<T>::type>> block_mult_async(basic_matrix<T>& A, basic_matrix<T>& B,
+                                                                          long int num_threads = 0,
+                                                                          const block_mult_options& options = block_mult_options());
+
+// Row-major matrix of float, double, int32 or int8 elements. Products of int8
+// matrices are accumulated and returned in int32 (block_traits<T>::acc_t).
+// Files keep double values: other types are converted on load and save.
+//
+// set_layout(LAYOUT_TILED) keeps the elements in the packed tile grid used by
+// block_mult instead: products take such operands as they are, and a product
+// with a tiled operand is tiled too, so chains of products skip repacking.
+// Row-major elements are rebuilt on the first data() call
+template <typename T>
+class basic_matrix
+{
+    template <typename U> friend class basic_matrix;
+    template <typename U> friend class basic_csr_matrix;
+    template <typename U>
+    friend void gemm(mult_op op_A, mult_op op_B, typename accumulator<U>::type alpha, basic_matrix<U>& A, basic_matrix<U>& B,
+                     typename accumulator<U>::type beta, basic_matrix<typename accumulator<U>::type>& C, long int num_threads,
+                     const block_mult_options& options);
+    template <typename U>
+    friend basic_matrix<typename accumulator<U>::type> block_mult(mult_op op_A, basic_matrix<U>& A, mult_op op_B, basic_matrix<U>& B,
+                                                                  long int num_threads, const block_mult_options& options);
+
+    typedef typename accumulator<T>::type acc_t;
+
     uint64_t columns_;
     uint64_t rows_;
-    double* data_; // place for optimization data_[]
+    mutable T* data_; // place for optimization data_[], nullptr while only tiled_ holds elements
+
+    // data_ points into a private file mapping instead of new[] memory
+    void*    mapping_;
+    uint64_t mapping_size_;
+
+    matrix_of_blocks<T>* tiled_; // nullptr - row-major layout
+
+    // the tag keeps a literal 0 value from picking this over (col, row, T def)
+    struct from_tiles_t {};
+    basic_matrix(uint64_t col, uint64_t row, matrix_of_blocks<T>* tiled, from_tiles_t);
+    void unpack_tiles() const;
+    void drop_tiles();
+    void drop_row_major();
 public:
-     matrix(uint64_t col, uint64_t row, double def);
-     matrix(uint64_t col, uint64_t row);
-     explicit matrix(const char* file_name);
-     matrix(const matrix& original);
-     matrix(matrix&& original);
-     matrix() = delete;
-
-     ~matrix();
+     basic_matrix(uint64_t col, uint64_t row, T def);
+     basic_matrix(uint64_t col, uint64_t row);
+     // Text .matr or binary .matb (row-major .matb of double is mapped without copying,
+     // tiled .matb of double stays tiled)
+     explicit basic_matrix(const char* file_name);
+     basic_matrix(const basic_matrix& original);
+     basic_matrix(basic_matrix&& original);
+     basic_matrix() = delete;
+
+     ~basic_matrix();
      void save(const char* file_name);
-     matrix block_mult(matrix &B, long int num_threads);
+     void save_binary(const char* file_name, matrix_layout layout = LAYOUT_ROW_MAJOR);
+     uint64_t rows() const { return rows_; }
+     uint64_t columns() const { return columns_; }
+
+     void          set_layout(matrix_layout layout);
+     matrix_layout layout() const { return (tiled_ != nullptr) ? LAYOUT_TILED : LAYOUT_ROW_MAJOR; }
+
+     // row-major elements, a tiled matrix is converted back to row-major layout
+     T* data()
+     {
+         if (tiled_ != nullptr)
+         {
+             unpack_tiles();
+             drop_tiles();
+         }
+         return data_;
+     }
+     // row-major elements, a tiled matrix stays tiled and keeps a row-major copy too
+     const T* data() const
+     {
+         if (data_ == nullptr)
+             unpack_tiles();
+         return data_;
+     }
+
+     // num_threads == 0 takes the tuned number (or hardware concurrency)
+     basic_matrix<acc_t> block_mult(basic_matrix& B, long int num_threads);
+     basic_matrix<acc_t> block_mult(basic_matrix& B, long int num_threads, const block_mult_options& options);
+};
+
+typedef basic_matrix<double>  matrix;
+typedef basic_matrix<float>   matrix_f32;
+typedef basic_matrix<int32_t> matrix_i32;
+typedef basic_matrix<int8_t>  matrix_i8;
+
+// Batch of independent products C = A * B of small matrices (16 to 128 elements
+// per side is the target). Every product is a single task computed whole by one
+// thread: operands are packed into that thread's slice of one arena allocated
+// for the batch, and the k loop of the kernels is fixed at compile time while
+// K fits SMALL_K_TILES tiles. Matrices are row-major with ld* elements between rows
+template <typename T>
+struct gemm_batch_entry
+{
+    const T*                       A_;
+    uint64_t                       lda_;
+    const T*                       B_;
+    uint64_t                       ldb_;
+    typename accumulator<T>::type* C_;
+    uint64_t                       ldc_;
+    uint64_t                       M_;
+    uint64_t                       N_;
+    uint64_t                       K_;
 };
+
+// num_threads == 0 takes hardware concurrency, pool == nullptr - thread_pool::instance()
+template <typename T>
+void batch_block_mult(const gemm_batch_entry<T>* batch, uint64_t count, long int num_threads, thread_pool* pool = nullptr);
+
+template <typename T>
+std::vector<basic_matrix<typename accumulator<T>::type>> batch_block_mult(const std::vector<const basic_matrix<T>*>& A,
+                                                                          const std::vector<const basic_matrix<T>*>& B,
+                                                                          long int num_threads);
@@ -0,0 +1,112 @@
+#include "block_matrix.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+
+static const char DEFAULT_PROFILE_PATH[] = "block_mult.profile";
+static const char PROFILE_HEADER[]       = "# block_mult profile: M N K num_threads mc kc nc traversal\n";
+
+const char* block_mult_profile_path()
+{
+    const char* path = getenv("BLOCK_MATRIX_PROFILE");
+    if (path == nullptr || *path == '\0')
+        return DEFAULT_PROFILE_PATH;
+
+    return path;
+}
+
+static std::vector<block_mult_profile_entry> read_profile(const char* path)
+{
+    std::vector<block_mult_profile_entry> entries;
+
+    FILE* input = fopen(path, "r");
+    if (input == nullptr)
+        return entries;
+
+    char line[256];
+    while (fgets(line, sizeof(line), input) != nullptr)
+    {
+        if (line[0] == '#')
+            continue;
+
+        block_mult_profile_entry entry = {};
+        int traversal = 0;
+        int ret = sscanf(line, "%lu %lu %lu %ld %lu %lu %lu %d", &entry.M_, &entry.N_, &entry.K_, &entry.num_threads_,
+                         &entry.options_.mc_, &entry.options_.kc_, &entry.options_.nc_, &traversal);
+        if (ret != 8 || entry.M_ == 0 || entry.N_ == 0 || entry.K_ == 0)
+        {
+            fprintf(stderr, "[read_profile] skip bad line in %s: %s", path, line);
+            continue;
+        }
+        entry.options_.traversal_ = (block_traversal)traversal;
+
+        entries.push_back(entry);
+    }
+
+    fclose(input);
+    return entries;
+}
+
+static const std::vector<block_mult_profile_entry>& loaded_profile()
+{
+    static const std::vector<block_mult_profile_entry> profile = read_profile(block_mult_profile_path());
+    return profile;
+}
+
+bool find_block_mult_profile_entry(uint64_t M, uint64_t N, uint64_t K, block_mult_profile_entry* entry)
+{
+    const std::vector<block_mult_profile_entry>& profile = loaded_profile();
+    if (profile.empty() || entry == nullptr)
+        return false;
+
+    // the nearest shape in log scale: tuning is about ratios of dims to cache sizes
+    double best_dist = 0.0;
+    size_t best      = profile.size();
+    for (size_t i = 0; i < profile.size(); i++)
+    {
+        double dist = std::fabs(std::log((double)M / profile[i].M_)) +
+                      std::fabs(std::log((double)N / profile[i].N_)) +
+                      std::fabs(std::log((double)K / profile[i].K_));
+        if (best == profile.size() || dist < best_dist)
+        {
+            best_dist = dist;
+            best      = i;
+        }
+    }
+
+    *entry = profile[best];
+    return true;
+}
+
+bool save_block_mult_profile_entry(const block_mult_profile_entry& entry)
+{
+    const char* path = block_mult_profile_path();
+    std::vector<block_mult_profile_entry> entries = read_profile(path);
+
+    bool replaced = false;
+    for (size_t i = 0; i < entries.size(); i++)
+        if (entries[i].M_ == entry.M_ && entries[i].N_ == entry.N_ && entries[i].K_ == entry.K_)
+        {
+            entries[i] = entry;
+            replaced   = true;
+        }
+    if (!replaced)
+        entries.push_back(entry);
+
+    errno = 0;
+    FILE* output = fopen(path, "w");
+    if (output == nullptr)
+    {
+        perror("[save_block_mult_profile_entry] can't open profile file\n");
+        return false;
+    }
+
+    fputs(PROFILE_HEADER, output);
+    for (size_t i = 0; i < entries.size(); i++)
+        fprintf(output, "%lu %lu %lu %ld %lu %lu %lu %d\n", entries[i].M_, entries[i].N_, entries[i].K_, entries[i].num_threads_,
+                entries[i].options_.mc_, entries[i].options_.kc_, entries[i].options_.nc_, (int)entries[i].options_.traversal_);
+
+    fclose(output);
+    return true;
+}
@@ -0,0 +1,100 @@
+#include "block_matrix.hpp"
+#include <memory>
+#include <type_traits>
+
+double chain_order(const std::vector<uint64_t>& dims, std::vector<uint64_t>* split)
+{
+    if (dims.size() < 2)
+        throw std::invalid_argument("[chain_order] a chain needs at least one matrix\n");
+
+    uint64_t n = dims.size() - 1;
+    // cost[i * n + j]: multiply-adds of the cheapest product of matrices i..j
+    std::vector<double> cost(n * n, 0.0);
+    split->assign(n * n, 0);
+
+    for (uint64_t length = 2; length <= n; length++)
+        for (uint64_t first = 0; first + length <= n; first++)
+        {
+            uint64_t last = first + length - 1;
+            double   best = -1.0;
+            for (uint64_t middle = first; middle < last; middle++)
+            {
+                double cur = cost[first * n + middle] + cost[(middle + 1) * n + last] +
+                             (double)dims[first] * dims[middle + 1] * dims[last + 1];
+                if (best < 0.0 || cur < best)
+                {
+                    best = cur;
+                    (*split)[first * n + last] = middle;
+                }
+            }
+            cost[first * n + last] = best;
+        }
+
+    return cost[n - 1];
+}
+
+// Product of matrices first..last (at least two) in the order of split
+template <typename T>
+static basic_matrix<T> chain_product(const std::vector<basic_matrix<T>*>& chain, const std::vector<uint64_t>& split,
+                                     uint64_t first, uint64_t last, long int num_threads, const block_mult_options& options)
+{
+    uint64_t n      = chain.size();
+    uint64_t middle = split[first * n + last];
+
+    // products of the subchains, a single matrix is used as it is
+    std::unique_ptr<basic_matrix<T>> left;
+    std::unique_ptr<basic_matrix<T>> right;
+    if (middle > first)
+        left.reset(new basic_matrix<T>(chain_product(chain, split, first, middle, num_threads, options)));
+    if (middle + 1 < last)
+        right.reset(new basic_matrix<T>(chain_product(chain, split, middle + 1, last, num_threads, options)));
+
+    basic_matrix<T>& A = left  ? *left  : *chain[first];
+    basic_matrix<T>& B = right ? *right : *chain[last];
+    return block_mult(OP_N, A, OP_N, B, num_threads, options);
+}
+
+template <typename T>
+basic_matrix<T> chain_mult(const std::vector<basic_matrix<T>*>& chain, long int num_threads, const block_mult_options& options)
+{
+    static_assert(std::is_same<T, typename accumulator<T>::type>::value, "chain_mult: products must keep the element type");
+
+    if (chain.empty())
+        throw std::invalid_argument("[chain_mult] empty chain\n");
+    if (num_threads < 0)
+        throw std::invalid_argument("[chain_mult] negative number of threads\n");
+
+    std::vector<uint64_t> dims(1, chain[0]->rows());
+    bool tiled = false;
+    for (uint64_t i = 0; i < chain.size(); i++)
+    {
+        if (chain[i]->rows() != dims.back())
+            throw std::invalid_argument("[chain_mult] incompatible matrix format\n");
+        dims.push_back(chain[i]->columns());
+        tiled = tiled || chain[i]->layout() == LAYOUT_TILED;
+    }
+
+    // the steps routed to gemv come back row-major, so is a single matrix copied
+    matrix_layout layout = (tiled || options.tiled_result_) ? LAYOUT_TILED : LAYOUT_ROW_MAJOR;
+    if (chain.size() == 1)
+    {
+        basic_matrix<T> result(*chain[0]);
+        result.set_layout(layout);
+        return result;
+    }
+
+    std::vector<uint64_t> split;
+    chain_order(dims, &split);
+
+    // mixed precision repacks tiled operands from row-major copies, its intermediates stay row-major
+    block_mult_options steps = options;
+    steps.tiled_result_ = !options.mixed_precision_;
+
+    basic_matrix<T> result = chain_product(chain, split, 0, chain.size() - 1, num_threads, steps);
+    result.set_layout(layout);
+    return result;
+}
+
+template matrix     chain_mult(const std::vector<matrix*>&, long int, const block_mult_options&);
+template matrix_f32 chain_mult(const std::vector<matrix_f32*>&, long int, const block_mult_options&);
+template matrix_i32 chain_mult(const std::vector<matrix_i32*>&, long int, const block_mult_options&);
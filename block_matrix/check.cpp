@@ -0,0 +1,494 @@
+// Regression checks of the products against naive references: make check
+// builds and runs them, the exit status is 1 if one fails
+#include "block_matrix.hpp"
+#include "sparse_matrix.hpp"
+#include "workspace.hpp"
+#include <cmath>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+static int failures = 0;
+
+static void report(bool good, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+static void report(bool good, const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    printf(": %s\n", good ? "ok" : "FAILED");
+
+    if (!good)
+        failures++;
+}
+
+// M x K x N shapes of the products: tile multiples and not (tiles are 8 or 16
+// wide), single rows and columns (gemv routes), K == 0 and a kc-crossing K
+static const uint64_t SHAPES[][3] = {{1, 1, 1}, {7, 13, 5}, {16, 16, 16}, {17, 33, 9}, {64, 40, 72}, {1, 37, 41},
+                                     {41, 37, 1}, {5, 0, 7}, {100, 3, 130}, {70, 300, 50}};
+
+// Small integers: products and sums are exact in every element type
+template <typename T>
+static void fill_small(basic_matrix<T>& X)
+{
+    T* data = X.data();
+    for (uint64_t i = 0; i < X.rows() * X.columns(); i++)
+        data[i] = (T)(rand() % 7 - 3);
+}
+
+// Element (row, col) of op(X)
+template <typename T>
+static T op_element(mult_op op, const T* X, uint64_t columns, uint64_t row, uint64_t col)
+{
+    return (op == OP_N) ? X[row * columns + col] : X[col * columns + row];
+}
+
+// op(A) * op(B) by definition, row-major M x N
+template <typename T>
+static std::vector<typename accumulator<T>::type> naive_mult(mult_op op_A, const basic_matrix<T>& A, mult_op op_B,
+                                                             const basic_matrix<T>& B)
+{
+    typedef typename accumulator<T>::type acc_t;
+
+    uint64_t M = (op_A == OP_N) ? A.rows() : A.columns();
+    uint64_t K = (op_A == OP_N) ? A.columns() : A.rows();
+    uint64_t N = (op_B == OP_N) ? B.columns() : B.rows();
+    const T* a = A.data();
+    const T* b = B.data();
+
+    std::vector<acc_t> C(M * N, acc_t(0));
+    for (uint64_t row = 0; row < M; row++)
+        for (uint64_t col = 0; col < N; col++)
+            for (uint64_t k = 0; k < K; k++)
+                C[row * N + col] += (acc_t)op_element(op_A, a, A.columns(), row, k) * (acc_t)op_element(op_B, b, B.columns(), k, col);
+    return C;
+}
+
+// Exact match (a NaN never matches)
+template <typename T>
+static bool same_elements(const T* got, const std::vector<T>& want)
+{
+    for (uint64_t i = 0; i < want.size(); i++)
+        if (!(got[i] == want[i]))
+            return false;
+    return true;
+}
+
+// Value of C elements gemm with beta == 0 must not read
+template <typename T>
+static T unread_value()
+{
+    return std::numeric_limits<T>::has_quiet_NaN ? std::numeric_limits<T>::quiet_NaN() : std::numeric_limits<T>::max();
+}
+
+// C = alpha * A * B + beta * C for every shape, row-major and tiled C; beta == 0
+// with NaN (or garbage) in C, alpha == 0 only scales C
+template <typename T>
+static void check_gemm(const char* type, const block_mult_options& options, const char* path)
+{
+    const T scalars[][2] = {{1, 0}, {2, 0}, {-1, 1}, {2, 3}, {0, 2}};
+    for (const uint64_t* shape : SHAPES)
+        for (int tiled = 0; tiled < 2; tiled++)
+        {
+            uint64_t M = shape[0];
+            uint64_t K = shape[1];
+            uint64_t N = shape[2];
+            basic_matrix<T> A(K, M);
+            basic_matrix<T> B(N, K);
+            fill_small(A);
+            fill_small(B);
+            std::vector<T> product = naive_mult(OP_N, A, OP_N, B);
+
+            bool good = true;
+            for (const T* scalar : scalars)
+            {
+                T alpha = scalar[0];
+                T beta  = scalar[1];
+                basic_matrix<T> C(N, M);
+                if (beta == 0)
+                    std::fill_n(C.data(), M * N, unread_value<T>());
+                else
+                    fill_small(C);
+
+                std::vector<T> want(M * N);
+                for (uint64_t i = 0; i < M * N; i++)
+                    want[i] = alpha * product[i] + ((beta == 0) ? T(0) : beta * C.data()[i]);
+
+                if (tiled)
+                    C.set_layout(LAYOUT_TILED);
+                gemm(alpha, A, B, beta, C, 2, options);
+                good = good && C.layout() == (tiled ? LAYOUT_TILED : LAYOUT_ROW_MAJOR) && same_elements(C.data(), want);
+            }
+            report(good, "gemm %s %s, %s C, %lu x %lu x %lu", type, path, tiled ? "tiled" : "row-major", M, K, N);
+        }
+}
+
+// op(A) * op(B) for the four op pairs, row-major and tiled operands, and the
+// gemm form of the same; int8 products accumulate in int32
+template <typename T>
+static void check_transposed(const char* type)
+{
+    typedef typename accumulator<T>::type acc_t;
+    const char* names[2] = {"N", "T"};
+
+    for (const uint64_t* shape : SHAPES)
+        for (int ops = 0; ops < 4; ops++)
+        {
+            uint64_t M = shape[0];
+            uint64_t K = shape[1];
+            uint64_t N = shape[2];
+            mult_op op_A = (ops & 1) ? OP_T : OP_N;
+            mult_op op_B = (ops & 2) ? OP_T : OP_N;
+
+            // stored shapes: op(A) is M x K, op(B) is K x N
+            basic_matrix<T> A((op_A == OP_N) ? K : M, (op_A == OP_N) ? M : K);
+            basic_matrix<T> B((op_B == OP_N) ? N : K, (op_B == OP_N) ? K : N);
+            fill_small(A);
+            fill_small(B);
+            std::vector<acc_t> want = naive_mult(op_A, A, op_B, B);
+
+            basic_matrix<acc_t> C = block_mult(op_A, A, op_B, B, 2);
+            bool good = C.rows() == M && C.columns() == N && same_elements(C.data(), want);
+
+            A.set_layout(LAYOUT_TILED);
+            B.set_layout(LAYOUT_TILED);
+            basic_matrix<acc_t> C_tiled = block_mult(op_A, A, op_B, B, 2);
+            good = good && same_elements(C_tiled.data(), want);
+
+            if constexpr (std::is_same<T, acc_t>::value)
+            {
+                basic_matrix<T> D(N, M);
+                std::fill_n(D.data(), M * N, unread_value<T>());
+                gemm(op_A, op_B, T(1), A, B, T(0), D, 2);
+                good = good && same_elements(D.data(), want);
+            }
+
+            report(good, "op(A) * op(B) %s %s%s, %lu x %lu x %lu", type, names[op_A], names[op_B], M, K, N);
+        }
+}
+
+// CSR A times dense B (row-major and tiled): A has empty rows, a dense row and
+// scattered nonzeros, density 0 is an A without nonzeros
+template <typename T>
+static void check_sparse(const char* type)
+{
+    typedef typename accumulator<T>::type acc_t;
+    const int densities[] = {0, 10, 50};
+
+    for (const uint64_t* shape : SHAPES)
+        for (int density : densities)
+        {
+            uint64_t M = shape[0];
+            uint64_t K = shape[1];
+            uint64_t N = shape[2];
+            basic_matrix<T> A(K, M);
+            basic_matrix<T> B(N, K);
+            fill_small(A);
+            fill_small(B);
+            for (uint64_t row = 0; row < M; row++)
+                for (uint64_t col = 0; col < K; col++)
+                    if (density == 0 || row % 3 == 1 || (row != M / 2 && rand() % 100 >= density))
+                        A.data()[row * K + col] = T(0);
+
+            std::vector<acc_t> want = naive_mult(OP_N, A, OP_N, B);
+            basic_csr_matrix<T> A_sparse(A);
+
+            basic_matrix<acc_t> C = A_sparse.block_mult(B, 2);
+            bool good = C.rows() == M && C.columns() == N && same_elements(C.data(), want);
+            B.set_layout(LAYOUT_TILED);
+            basic_matrix<acc_t> C_tiled = A_sparse.block_mult(B, 2);
+            good = good && same_elements(C_tiled.data(), want);
+
+            report(good, "csr product %s, %lu nonzeros, %lu x %lu x %lu", type, A_sparse.nonzeros(), M, K, N);
+        }
+}
+
+// y = alpha * op(A) * x + beta * y for M x K A, and gemv_batch of 3 vectors at
+// padded strides (the padding must stay untouched); beta == 0 with NaN in y
+template <typename T>
+static void check_gemv(const char* type)
+{
+    typedef typename accumulator<T>::type acc_t;
+    const acc_t scalars[][2] = {{1, 0}, {2, 0}, {-1, 1}, {2, 3}};
+    const uint64_t count = 3;
+    const char* names[2] = {"N", "T"};
+
+    for (const uint64_t* shape : SHAPES)
+        for (int transposed = 0; transposed < 2; transposed++)
+        {
+            mult_op  op      = transposed ? OP_T : OP_N;
+            uint64_t in_len  = transposed ? shape[0] : shape[1];
+            uint64_t out_len = transposed ? shape[1] : shape[0];
+            uint64_t ldx     = in_len + 2;
+            uint64_t ldy     = out_len + 1;
+
+            basic_matrix<T> A(shape[1], shape[0]);
+            basic_matrix<T> X(1, count * ldx); // the vectors one after another
+            fill_small(A);
+            fill_small(X);
+
+            // op(A) * x of every vector
+            std::vector<std::vector<acc_t>> products;
+            for (uint64_t vec = 0; vec < count; vec++)
+            {
+                basic_matrix<T> x(1, in_len);
+                std::copy_n(X.data() + vec * ldx, in_len, x.data());
+                products.push_back(naive_mult(op, A, OP_N, x));
+            }
+
+            bool good = true;
+            for (const acc_t* scalar : scalars)
+            {
+                acc_t alpha = scalar[0];
+                acc_t beta  = scalar[1];
+                std::vector<acc_t> Y(count * ldy);
+                for (uint64_t i = 0; i < Y.size(); i++)
+                    Y[i] = (beta == 0 && i % ldy != out_len) ? unread_value<acc_t>() : acc_t(rand() % 7 - 3);
+
+                std::vector<acc_t> want = Y;
+                for (uint64_t vec = 0; vec < count; vec++)
+                    for (uint64_t i = 0; i < out_len; i++)
+                        want[vec * ldy + i] = alpha * products[vec][i] + ((beta == 0) ? acc_t(0) : beta * Y[vec * ldy + i]);
+
+                std::vector<acc_t> y(Y.begin(), Y.begin() + out_len);
+                gemv(op, alpha, A, X.data(), beta, y.data(), 2);
+                good = good && same_elements(y.data(), std::vector<acc_t>(want.begin(), want.begin() + out_len));
+
+                gemv_batch(op, alpha, A, X.data(), ldx, beta, Y.data(), ldy, count, 2);
+                good = good && same_elements(Y.data(), want);
+            }
+            report(good, "gemv %s %s, A %lu x %lu", type, names[op], shape[0], shape[1]);
+        }
+}
+
+// block_mult_async with the default blocking and with kc small enough for several
+// k-panels, tiled operands; mixed precision and tiled result are reset (the
+// product is exact and row-major)
+template <typename T>
+static void check_async(const char* type)
+{
+    typedef typename accumulator<T>::type acc_t;
+
+    block_mult_options panels;
+    panels.kc_ = 16;
+    panels.mixed_precision_ = true;
+    panels.tiled_result_    = true;
+
+    for (const uint64_t* shape : SHAPES)
+    {
+        uint64_t M = shape[0];
+        uint64_t K = shape[1];
+        uint64_t N = shape[2];
+        basic_matrix<T> A(K, M);
+        basic_matrix<T> B(N, K);
+        fill_small(A);
+        fill_small(B);
+        std::vector<acc_t> want = naive_mult(OP_N, A, OP_N, B);
+
+        std::future<basic_matrix<acc_t>> plain = block_mult_async(A, B, 2);
+        std::future<basic_matrix<acc_t>> split = block_mult_async(A, B, 2, panels);
+        basic_matrix<acc_t> C       = plain.get();
+        basic_matrix<acc_t> C_split = split.get();
+        bool good = C.rows() == M && C.columns() == N && C_split.layout() == LAYOUT_ROW_MAJOR &&
+                    same_elements(C.data(), want) && same_elements(C_split.data(), want);
+
+        A.set_layout(LAYOUT_TILED);
+        B.set_layout(LAYOUT_TILED);
+        basic_matrix<acc_t> C_tiled = block_mult_async(A, B, 2).get();
+        good = good && same_elements(C_tiled.data(), want);
+
+        report(good, "async %s, %lu x %lu x %lu", type, M, K, N);
+    }
+}
+
+// 1 + 2^-30 is exact in double and rounds to 1 in float: a product computed in
+// mixed precision loses the low part of every element
+static void check_async_precision()
+{
+    const uint64_t M = 33, K = 70, N = 17;
+    basic_matrix<double> A(K, M);
+    basic_matrix<double> B(N, K);
+    for (uint64_t i = 0; i < M * K; i++)
+        A.data()[i] = 1.0 + std::ldexp(1.0, -30);
+    for (uint64_t i = 0; i < K * N; i++)
+        B.data()[i] = 1.0;
+
+    block_mult_options options;
+    options.mixed_precision_ = true;
+    basic_matrix<double> C = block_mult_async(A, B, 2, options).get();
+
+    // the synchronous product does honour the option on the same data
+    basic_matrix<double> C_mixed = A.block_mult(B, 1, options);
+
+    bool good = C_mixed.data()[0] == K;
+    for (uint64_t i = 0; i < M * N; i++)
+        good = good && C.data()[i] == K * (1.0 + std::ldexp(1.0, -30));
+    report(good, "async double, mixed precision option ignored");
+}
+
+// chain_mult of row-major and partly tiled chains against left to right naive
+// products: odd dimensions, a single matrix, a K == 0 link; the result is
+// row-major unless a matrix is tiled or the options ask for a tiled result
+template <typename T>
+static void check_chain(const char* type)
+{
+    const std::vector<std::vector<uint64_t>> chains = {{7, 13, 5, 17}, {1, 37, 41, 1}, {30, 2, 40, 3, 25},
+                                                       {9, 11}, {5, 0, 7}, {17, 1, 33, 16, 8}};
+    block_mult_options options[3];
+    options[1].tiled_result_    = true;
+    options[2].mixed_precision_ = true;
+    const char* names[3] = {"default", "tiled result", "mixed precision"};
+
+    for (const std::vector<uint64_t>& dims : chains)
+        for (int choice = 0; choice < 3; choice++)
+            for (int tiled = 0; tiled < 2; tiled++)
+            {
+                std::vector<std::unique_ptr<basic_matrix<T>>> owned;
+                std::vector<basic_matrix<T>*> chain;
+                for (uint64_t i = 0; i + 1 < dims.size(); i++)
+                {
+                    owned.emplace_back(new basic_matrix<T>(dims[i + 1], dims[i]));
+                    fill_small(*owned.back());
+                    chain.push_back(owned.back().get());
+                }
+
+                // row-major rows x dims[i] product of the first i matrices
+                uint64_t rows = dims[0];
+                std::vector<T> want(chain[0]->data(), chain[0]->data() + rows * dims[1]);
+                for (uint64_t i = 1; i < chain.size(); i++)
+                {
+                    uint64_t K = dims[i];
+                    uint64_t N = dims[i + 1];
+                    const T* b = chain[i]->data();
+                    std::vector<T> next(rows * N, T(0));
+                    for (uint64_t row = 0; row < rows; row++)
+                        for (uint64_t col = 0; col < N; col++)
+                            for (uint64_t k = 0; k < K; k++)
+                                next[row * N + col] += want[row * K + k] * b[k * N + col];
+                    want.swap(next);
+                }
+
+                if (tiled)
+                    chain[chain.size() / 2]->set_layout(LAYOUT_TILED);
+                basic_matrix<T> C = chain_mult(chain, 2, options[choice]);
+
+                matrix_layout layout = (tiled || options[choice].tiled_result_) ? LAYOUT_TILED : LAYOUT_ROW_MAJOR;
+                bool good = C.rows() == dims.front() && C.columns() == dims.back() && C.layout() == layout;
+                good = good && same_elements(C.data(), want);
+
+                report(good, "chain %s, %zu matrices from %lu x %lu, %s%s", type, chain.size(), dims.front(),
+                       dims.back(), names[choice], tiled ? ", tiled operand" : "");
+            }
+
+    // the textbook example: (A1 A2) A3 costs 10 * 30 * 5 + 10 * 5 * 60
+    std::vector<uint64_t> split;
+    report(chain_order({10, 30, 5, 60}, &split) == 4500.0 && split[0 * 3 + 2] == 1, "chain order %s", type);
+}
+
+// M x K times K x N with M or N zero is an empty product, K zero - zeros
+static void check_empty_products()
+{
+    const uint64_t shapes[][3] = {{0, 5, 7}, {5, 5, 0}, {0, 5, 0}, {5, 0, 7}, {0, 0, 0}};
+    for (const uint64_t* shape : shapes)
+    {
+        uint64_t M = shape[0];
+        uint64_t K = shape[1];
+        uint64_t N = shape[2];
+        matrix A(K, M, 1.0);
+        matrix B(N, K, 1.0);
+        block_mult_options tiled;
+        tiled.tiled_result_ = true;
+
+        matrix C       = A.block_mult(B, 2);
+        matrix C_tiled = A.block_mult(B, 2, tiled);
+        bool good = C.rows() == M && C.columns() == N && C_tiled.rows() == M && C_tiled.columns() == N;
+        for (uint64_t i = 0; i < M * N && good; i++)
+            good = C.data()[i] == 0.0 && C_tiled.data()[i] == 0.0;
+
+        report(good, "empty product %lu x %lu x %lu", M, K, N);
+    }
+}
+
+// After the first of a run of same-shape products the workspace serves every
+// buffer from its cache, with and without huge pages (grids on huge pages are staggered)
+static void check_workspace_reuse()
+{
+    const uint64_t sizes[] = {128, 256, 600};
+    const huge_page_policy policies[] = {HUGE_PAGES_OFF, HUGE_PAGES_ADVISE};
+    const uint64_t count = 16;
+
+    workspace& arena = workspace::instance();
+    huge_page_policy saved = arena.huge_pages();
+    for (huge_page_policy policy : policies)
+        for (uint64_t size : sizes)
+        {
+            matrix A(size, size, 1.0);
+            matrix B(size, size, 1.0);
+            arena.set_huge_pages(policy);
+
+            workspace_stats before = arena.stats();
+            for (uint64_t i = 0; i < count; i++)
+                matrix C = A.block_mult(B, 1);
+            workspace_stats after = arena.stats();
+
+            uint64_t acquires    = after.acquires_ - before.acquires_;
+            uint64_t allocations = after.allocations_ - before.allocations_;
+            uint64_t reused      = after.reuse_hits_ - before.reuse_hits_;
+            report(allocations == acquires / count && reused == acquires - allocations,
+                   "workspace reuse n = %lu, huge pages %s: %lu of %lu buffers reused, %lu allocated", size,
+                   (policy == HUGE_PAGES_OFF) ? "off" : "advise", reused, acquires, allocations);
+        }
+
+    arena.set_huge_pages(saved);
+}
+
+int main()
+{
+    check_empty_products();
+
+    block_mult_options classic;
+    block_mult_options strassen;
+    strassen.algorithm_          = ALGO_STRASSEN;
+    strassen.strassen_crossover_ = 16;
+    check_gemm<double>("double", classic, "classic");
+    check_gemm<double>("double", strassen, "strassen");
+    check_gemm<float>("float", classic, "classic");
+    check_gemm<int32_t>("int32", classic, "classic");
+
+    check_transposed<double>("double");
+    check_transposed<float>("float");
+    check_transposed<int8_t>("int8");
+
+    check_sparse<double>("double");
+    check_sparse<float>("float");
+    check_sparse<int8_t>("int8");
+
+    check_gemv<double>("double");
+    check_gemv<float>("float");
+    check_gemv<int8_t>("int8");
+
+    check_async<double>("double");
+    check_async<float>("float");
+    check_async<int8_t>("int8");
+    check_async_precision();
+
+    check_chain<double>("double");
+    check_chain<float>("float");
+    check_chain<int32_t>("int32");
+
+    check_workspace_reuse();
+
+    if (failures != 0)
+    {
+        printf("%d checks FAILED\n", failures);
+        exit(EXIT_FAILURE);
+    }
+    printf("All checks passed\n");
+    return 0;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+enum errors{
+    E_SUCCESS  = 0,
+    E_ERROR    = -1,
+    E_BADALLOC = -2,
+    E_OPEN     = -3,
+    E_FORMAT   = -4,
+};
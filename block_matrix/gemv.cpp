@@ -0,0 +1,118 @@
+#include "block_matrix.hpp"
+#include "kernels.hpp"
+#include "thread_pool.hpp"
+#include <algorithm>
+#include <thread>
+
+// Elements of A per thread below which another thread costs more than it gives
+static const uint64_t GEMV_MIN_ELEMENTS = 1 << 15;
+// Chunks of y per thread: threads finishing early take chunks of the slow ones
+static const uint64_t GEMV_CHUNKS_PER_THREAD = 4;
+
+// y[first, last) of every vector by dot products with rows of A (cols elements each)
+template <typename T>
+static void gemv_rows(const T* A, uint64_t cols, uint64_t first, uint64_t last, typename accumulator<T>::type alpha,
+                      const T* x, uint64_t ldx, typename accumulator<T>::type beta, typename accumulator<T>::type* y,
+                      uint64_t ldy, uint64_t count)
+{
+    typedef typename accumulator<T>::type acc_t;
+    dot_kernel_t<T> dot = select_dot_kernel<T>();
+
+    for (uint64_t row = first; row < last; row++)
+        for (uint64_t vec = 0; vec < count; vec++)
+        {
+            acc_t* out = y + vec * ldy + row;
+            acc_t  sum = dot(cols, A + row * cols, x + vec * ldx);
+            *out = alpha * sum + ((beta == 0) ? acc_t(0) : beta * *out);
+        }
+}
+
+// y[first, last) of every vector = beta * y + alpha * sum of x[row] * A[row][first, last)
+template <typename T>
+static void gemtv_columns(const T* A, uint64_t rows, uint64_t cols, uint64_t first, uint64_t last,
+                          typename accumulator<T>::type alpha, const T* x, uint64_t ldx, typename accumulator<T>::type beta,
+                          typename accumulator<T>::type* y, uint64_t ldy, uint64_t count)
+{
+    typedef typename accumulator<T>::type acc_t;
+    axpy_kernel_t<T> axpy = select_axpy_kernel<T>();
+
+    // beta == 0 doesn't read y (it may hold NaNs)
+    for (uint64_t vec = 0; vec < count; vec++)
+    {
+        acc_t* out = y + vec * ldy;
+        for (uint64_t col = first; col < last; col++)
+            out[col] = (beta == 0) ? acc_t(0) : beta * out[col];
+    }
+
+    for (uint64_t row = 0; row < rows; row++)
+        for (uint64_t vec = 0; vec < count; vec++)
+            axpy(last - first, alpha * (acc_t)x[vec * ldx + row], A + row * cols + first, y + vec * ldy + first);
+}
+
+template <typename T>
+void gemv_batch(mult_op op_A, typename accumulator<T>::type alpha, const basic_matrix<T>& A, const T* x, uint64_t ldx,
+                typename accumulator<T>::type beta, typename accumulator<T>::type* y, uint64_t ldy, uint64_t count,
+                long int num_threads, thread_pool* pool)
+{
+    typedef typename accumulator<T>::type acc_t;
+
+    uint64_t rows = A.rows();
+    uint64_t cols = A.columns();
+    uint64_t M    = (op_A == OP_N) ? rows : cols;
+    uint64_t K    = (op_A == OP_N) ? cols : rows;
+
+    // empty vectors may have no storage
+    if (((x == nullptr && K != 0) || (y == nullptr && M != 0)) && count != 0)
+        throw std::invalid_argument("[gemv] Bad pointer to vectors\n");
+    if (num_threads < 0)
+        throw std::invalid_argument("[gemv] negative number of threads\n");
+
+    if (count == 0 || M == 0)
+        return;
+
+    const T* data = A.data();
+
+    if (num_threads == 0)
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    num_threads = std::min<uint64_t>(num_threads, std::max<uint64_t>(1, rows * cols * count / GEMV_MIN_ELEMENTS));
+
+    // chunks of y: rows of A for OP_N, columns of A for OP_T rounded to cache
+    // lines, so threads don't write the same lines of y
+    uint64_t unit       = (op_A == OP_N) ? 1 : CACHE_LINE_SIZE / sizeof(acc_t);
+    uint64_t num_units  = (M + unit - 1) / unit;
+    uint64_t num_chunks = std::min<uint64_t>(num_units, num_threads * GEMV_CHUNKS_PER_THREAD);
+
+    thread_pool& workers = (pool != nullptr) ? *pool : thread_pool::instance();
+    workers.reserve(num_threads);
+    workers.run(num_chunks, num_threads, [&](uint64_t chunk)
+    {
+        uint64_t first = std::min(M, chunk * num_units / num_chunks * unit);
+        uint64_t last  = std::min(M, (chunk + 1) * num_units / num_chunks * unit);
+
+        if (op_A == OP_N)
+            gemv_rows(data, cols, first, last, alpha, x, ldx, beta, y, ldy, count);
+        else
+            gemtv_columns(data, rows, cols, first, last, alpha, x, ldx, beta, y, ldy, count);
+    });
+}
+
+template <typename T>
+void gemv(mult_op op_A, typename accumulator<T>::type alpha, const basic_matrix<T>& A, const T* x,
+          typename accumulator<T>::type beta, typename accumulator<T>::type* y, long int num_threads, thread_pool* pool)
+{
+    gemv_batch(op_A, alpha, A, x, 0, beta, y, 0, 1, num_threads, pool);
+}
+
+template void gemv(mult_op, double, const matrix&, const double*, double, double*, long int, thread_pool*);
+template void gemv(mult_op, float, const matrix_f32&, const float*, float, float*, long int, thread_pool*);
+template void gemv(mult_op, int32_t, const matrix_i32&, const int32_t*, int32_t, int32_t*, long int, thread_pool*);
+template void gemv(mult_op, int32_t, const matrix_i8&, const int8_t*, int32_t, int32_t*, long int, thread_pool*);
+
+template void gemv_batch(mult_op, double, const matrix&, const double*, uint64_t, double, double*, uint64_t, uint64_t,
+                         long int, thread_pool*);
+template void gemv_batch(mult_op, float, const matrix_f32&, const float*, uint64_t, float, float*, uint64_t, uint64_t,
+                         long int, thread_pool*);
+template void gemv_batch(mult_op, int32_t, const matrix_i32&, const int32_t*, uint64_t, int32_t, int32_t*, uint64_t, uint64_t,
+                         long int, thread_pool*);
+template void gemv_batch(mult_op, int32_t, const matrix_i8&, const int8_t*, uint64_t, int32_t, int32_t*, uint64_t, uint64_t,
+                         long int, thread_pool*);
@@ -0,0 +1,378 @@
+#include "block_matrix.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <chrono>
+#include <string>
+#include <vector>
+
+// GFLOPS benchmark suite of block_mult on synthetic matrices: sweeps over shapes
+// and thread counts, median and p95 of repeated runs after a warmup, a naive
+// reference for small shapes, machine-readable output to compare builds
+
+struct bench_shape
+{
+    uint64_t M_;
+    uint64_t N_;
+    uint64_t K_;
+};
+
+struct bench_config
+{
+    std::vector<bench_shape> shapes_;
+    std::vector<long int>    threads_;
+    int                      repeats_   = 10;
+    int                      warmup_    = 2;
+    uint64_t                 naive_max_ = 512; // naive reference for shapes with all dimensions up to this
+    const char*              type_      = "double";
+    const char*              csv_file_  = nullptr;
+    const char*              json_file_ = nullptr;
+};
+
+struct bench_result
+{
+    bench_shape shape_;
+    const char* impl_;
+    long int    threads_;
+    double      median_;
+    double      p95_;
+    double      max_error_; // against the naive product, -1 if it wasn't run
+};
+
+static const uint64_t DEF_SIZES[]     = {256, 512, 1024};
+static const bench_shape DEF_SHAPES[] = {{2048, 2048, 128}, {128, 2048, 2048}, {2048, 128, 2048}};
+
+static void usage()
+{
+    printf("Try ./gflops.out [--sizes n,n,..] [--shapes MxNxK,..] [--threads t,t,..] [--repeats n] [--warmup n]\n");
+    printf("                 [--naive-max n] [--type double|float|int32|int8] [--csv file] [--json file]\n");
+    printf("Default: sizes 256,512,1024, three rectangular shapes, threads 1,2,4,.. up to hardware concurrency\n");
+}
+
+static bool parse_list(const char* text, std::vector<uint64_t>* values)
+{
+    while (*text != '\0')
+    {
+        char* end = nullptr;
+        uint64_t value = strtoull(text, &end, 10);
+        if (end == text || value == 0)
+            return false;
+        values->push_back(value);
+
+        text = end;
+        if (*text == ',')
+            text++;
+        else if (*text != '\0')
+            return false;
+    }
+
+    return !values->empty();
+}
+
+static bool parse_shapes(const char* text, std::vector<bench_shape>* shapes)
+{
+    while (*text != '\0')
+    {
+        bench_shape shape = {};
+        int length = 0;
+        if (sscanf(text, "%lux%lux%lu%n", &shape.M_, &shape.N_, &shape.K_, &length) != 3 ||
+            shape.M_ == 0 || shape.N_ == 0 || shape.K_ == 0)
+            return false;
+        shapes->push_back(shape);
+
+        text += length;
+        if (*text == ',')
+            text++;
+        else if (*text != '\0')
+            return false;
+    }
+
+    return !shapes->empty();
+}
+
+static bool parse_args(int argc, char* argv[], bench_config* config)
+{
+    std::vector<uint64_t> sizes;
+    std::vector<bench_shape> shapes;
+    std::vector<uint64_t> threads;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 == argc)
+            return false;
+        const char* value = argv[++i];
+
+        if (strcmp(argv[i - 1], "--sizes") == 0)
+        {
+            if (!parse_list(value, &sizes))
+                return false;
+        }
+        else if (strcmp(argv[i - 1], "--shapes") == 0)
+        {
+            if (!parse_shapes(value, &shapes))
+                return false;
+        }
+        else if (strcmp(argv[i - 1], "--threads") == 0)
+        {
+            if (!parse_list(value, &threads))
+                return false;
+        }
+        else if (strcmp(argv[i - 1], "--repeats") == 0)
+            config->repeats_ = atoi(value);
+        else if (strcmp(argv[i - 1], "--warmup") == 0)
+            config->warmup_ = atoi(value);
+        else if (strcmp(argv[i - 1], "--naive-max") == 0)
+            config->naive_max_ = strtoull(value, NULL, 10);
+        else if (strcmp(argv[i - 1], "--type") == 0)
+            config->type_ = value;
+        else if (strcmp(argv[i - 1], "--csv") == 0)
+            config->csv_file_ = value;
+        else if (strcmp(argv[i - 1], "--json") == 0)
+            config->json_file_ = value;
+        else
+            return false;
+    }
+    if (config->repeats_ <= 0 || config->warmup_ < 0)
+        return false;
+
+    // sizes and shapes given on the command line replace both default sets
+    if (sizes.empty() && shapes.empty())
+    {
+        sizes.assign(DEF_SIZES, DEF_SIZES + sizeof(DEF_SIZES) / sizeof(DEF_SIZES[0]));
+        shapes.assign(DEF_SHAPES, DEF_SHAPES + sizeof(DEF_SHAPES) / sizeof(DEF_SHAPES[0]));
+    }
+    for (uint64_t size : sizes)
+        config->shapes_.push_back({size, size, size});
+    config->shapes_.insert(config->shapes_.end(), shapes.begin(), shapes.end());
+
+    if (threads.empty())
+    {
+        long int hardware = std::max(1u, std::thread::hardware_concurrency());
+        for (long int count = 1; count < hardware; count *= 2)
+            threads.push_back(count);
+        threads.push_back(hardware);
+    }
+    config->threads_.assign(threads.begin(), threads.end());
+
+    return true;
+}
+
+// Median and 95th percentile (nearest rank) of the run times
+static void percentiles(std::vector<double> times, double* median, double* p95)
+{
+    std::sort(times.begin(), times.end());
+
+    size_t count = times.size();
+    *median = (count % 2 == 1) ? times[count / 2] : (times[count / 2 - 1] + times[count / 2]) / 2.0;
+    *p95    = times[(size_t)std::ceil(0.95 * count) - 1];
+}
+
+// Reference i-k-j triple loop on one thread
+template <typename T>
+static void naive_mult(const T* A, const T* B, typename accumulator<T>::type* C, uint64_t M, uint64_t N, uint64_t K)
+{
+    for (uint64_t i = 0; i < M * N; i++)
+        C[i] = 0;
+
+    for (uint64_t row = 0; row < M; row++)
+        for (uint64_t k = 0; k < K; k++)
+        {
+            typename accumulator<T>::type a = A[row * K + k];
+            for (uint64_t col = 0; col < N; col++)
+                C[row * N + col] += a * B[k * N + col];
+        }
+}
+
+template <typename Func>
+static std::vector<double> time_runs(const bench_config& config, const Func& func)
+{
+    std::vector<double> times;
+    for (int run = 0; run < config.warmup_ + config.repeats_; run++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        func();
+        std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+
+        if (run >= config.warmup_)
+            times.push_back(time.count());
+    }
+
+    return times;
+}
+
+static double gflops(const bench_shape& shape, double time)
+{
+    return 2.0 * shape.M_ * shape.N_ * shape.K_ / time * 1e-9;
+}
+
+static void print_result(const bench_result& result)
+{
+    printf("%-6s M = %5lu, N = %5lu, K = %5lu, threads = %3ld: median %lg s (%.2lf GFLOPS), p95 %lg s (%.2lf GFLOPS)",
+           result.impl_, result.shape_.M_, result.shape_.N_, result.shape_.K_, result.threads_, result.median_,
+           gflops(result.shape_, result.median_), result.p95_, gflops(result.shape_, result.p95_));
+    if (result.max_error_ >= 0.0)
+        printf(", max error %lg", result.max_error_);
+    printf("\n");
+}
+
+// Operands are small integers, so every type computes the exact product
+// and the block result must match the naive one
+template <typename T>
+static void bench_shape_sweep(const bench_config& config, const bench_shape& shape, std::vector<bench_result>* results)
+{
+    typedef typename accumulator<T>::type acc_t;
+
+    basic_matrix<T> A(shape.K_, shape.M_);
+    basic_matrix<T> B(shape.N_, shape.K_);
+    for (uint64_t i = 0; i < shape.M_ * shape.K_; i++)
+        A.data()[i] = (T)(rand() % 7 - 3);
+    for (uint64_t i = 0; i < shape.K_ * shape.N_; i++)
+        B.data()[i] = (T)(rand() % 7 - 3);
+
+    bool naive = std::max(shape.M_, std::max(shape.N_, shape.K_)) <= config.naive_max_;
+    std::vector<acc_t> reference;
+    if (naive)
+    {
+        reference.resize(shape.M_ * shape.N_);
+        std::vector<double> times = time_runs(config, [&]()
+        {
+            naive_mult(A.data(), B.data(), reference.data(), shape.M_, shape.N_, shape.K_);
+        });
+
+        bench_result result = {shape, "naive", 1, 0.0, 0.0, -1.0};
+        percentiles(times, &result.median_, &result.p95_);
+        print_result(result);
+        results->push_back(result);
+    }
+
+    for (long int threads : config.threads_)
+    {
+        std::vector<double> times = time_runs(config, [&]()
+        {
+            basic_matrix<acc_t> C = A.block_mult(B, threads);
+        });
+
+        bench_result result = {shape, "block", threads, 0.0, 0.0, -1.0};
+        percentiles(times, &result.median_, &result.p95_);
+        if (naive)
+        {
+            basic_matrix<acc_t> C = A.block_mult(B, threads);
+            result.max_error_ = 0.0;
+            for (uint64_t i = 0; i < shape.M_ * shape.N_; i++)
+                result.max_error_ = std::max(result.max_error_, std::fabs((double)C.data()[i] - (double)reference[i]));
+        }
+        print_result(result);
+        results->push_back(result);
+    }
+}
+
+template <typename T>
+static std::vector<bench_result> run_suite(const bench_config& config)
+{
+    std::vector<bench_result> results;
+    srand(1);
+    for (const bench_shape& shape : config.shapes_)
+        bench_shape_sweep<T>(config, shape, &results);
+
+    return results;
+}
+
+static bool write_csv(const char* file_name, const bench_config& config, const std::vector<bench_result>& results)
+{
+    FILE* output = fopen(file_name, "w");
+    if (output == nullptr)
+    {
+        perror("[write_csv] can't open output file\n");
+        return false;
+    }
+
+    fprintf(output, "type,impl,M,N,K,threads,repeats,median_s,p95_s,gflops_median,gflops_p95,max_error\n");
+    for (const bench_result& result : results)
+        fprintf(output, "%s,%s,%lu,%lu,%lu,%ld,%d,%.9lg,%.9lg,%.6lg,%.6lg,%lg\n", config.type_, result.impl_,
+                result.shape_.M_, result.shape_.N_, result.shape_.K_, result.threads_, config.repeats_, result.median_,
+                result.p95_, gflops(result.shape_, result.median_), gflops(result.shape_, result.p95_), result.max_error_);
+
+    return fclose(output) == 0;
+}
+
+static bool write_json(const char* file_name, const bench_config& config, const char* kernel,
+                       const std::vector<bench_result>& results)
+{
+    FILE* output = fopen(file_name, "w");
+    if (output == nullptr)
+    {
+        perror("[write_json] can't open output file\n");
+        return false;
+    }
+
+    fprintf(output, "{\n  \"type\": \"%s\",\n  \"kernel\": \"%s\",\n  \"compiler\": \"%s\",\n", config.type_, kernel, __VERSION__);
+    fprintf(output, "  \"hardware_concurrency\": %u,\n  \"repeats\": %d,\n  \"warmup\": %d,\n  \"results\": [\n",
+            std::thread::hardware_concurrency(), config.repeats_, config.warmup_);
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const bench_result& result = results[i];
+        fprintf(output, "    {\"impl\": \"%s\", \"M\": %lu, \"N\": %lu, \"K\": %lu, \"threads\": %ld, "
+                "\"median_s\": %.9lg, \"p95_s\": %.9lg, \"gflops_median\": %.6lg, \"gflops_p95\": %.6lg",
+                result.impl_, result.shape_.M_, result.shape_.N_, result.shape_.K_, result.threads_, result.median_,
+                result.p95_, gflops(result.shape_, result.median_), gflops(result.shape_, result.p95_));
+        if (result.max_error_ >= 0.0)
+            fprintf(output, ", \"max_error\": %lg", result.max_error_);
+        fprintf(output, "}%s\n", (i + 1 < results.size()) ? "," : "");
+    }
+    fprintf(output, "  ]\n}\n");
+
+    return fclose(output) == 0;
+}
+
+template <typename T>
+static bool run_and_report(const bench_config& config)
+{
+    const char* kernel = micro_kernel_name<T>();
+    printf("type %s, kernel %s, %d runs after %d warmup runs\n", config.type_, kernel, config.repeats_, config.warmup_);
+
+    std::vector<bench_result> results = run_suite<T>(config);
+
+    bool written = true;
+    if (config.csv_file_ != nullptr)
+        written = write_csv(config.csv_file_, config, results) && written;
+    if (config.json_file_ != nullptr)
+        written = write_json(config.json_file_, config, kernel, results) && written;
+
+    return written;
+}
+
+int main(int argc, char* argv[])
+{
+    bench_config config;
+    if (!parse_args(argc, argv, &config))
+    {
+        usage();
+        exit(EXIT_FAILURE);
+    }
+
+    bool written = false;
+    try
+    {
+        if (strcmp(config.type_, "double") == 0)
+            written = run_and_report<double>(config);
+        else if (strcmp(config.type_, "float") == 0)
+            written = run_and_report<float>(config);
+        else if (strcmp(config.type_, "int32") == 0)
+            written = run_and_report<int32_t>(config);
+        else if (strcmp(config.type_, "int8") == 0)
+            written = run_and_report<int8_t>(config);
+        else
+        {
+            usage();
+            exit(EXIT_FAILURE);
+        }
+    }
+    catch (std::exception &error)
+    {
+        std::cout << error.what();
+        exit(EXIT_FAILURE);
+    }
+
+    return written ? 0 : EXIT_FAILURE;
+}
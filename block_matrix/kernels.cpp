@@ -0,0 +1,1187 @@
+#include "kernels.hpp"
+#include <immintrin.h>
+#include <cstdlib>
+#include <cstring>
+
+static const uint32_t TILE_SIZE = KERNEL_DIM * KERNEL_DIM;
+
+// float, int32 and int8 tiles
+static const uint32_t WIDE_DIM  = block_traits<float>::tile_dim;
+static const uint32_t WIDE_SIZE = WIDE_DIM * WIDE_DIM;
+
+// Every kernel takes FIXED_K: 0 - num_k k tiles given at run time, otherwise
+// the k loop has FIXED_K iterations known at compile time and num_k is ignored
+
+template <typename T, uint32_t FIXED_K>
+static void kernel_scalar(uint64_t num_k, const T* A, const T* B, uint64_t B_stride, typename block_traits<T>::acc_t* C, bool accumulate)
+{
+    typedef typename block_traits<T>::acc_t acc_t;
+    const uint32_t dim  = block_traits<T>::tile_dim;
+    const uint32_t size = block_traits<T>::tile_size;
+
+    acc_t acc[dim][dim] = {};
+    if (accumulate)
+        for (uint32_t row = 0; row < dim; row++)
+            for (uint32_t col = 0; col < dim; col++)
+                acc[row][col] = C[row * dim + col];
+
+    for (uint64_t tile = 0; tile < (FIXED_K != 0 ? FIXED_K : num_k); tile++)
+    {
+        const T* A_tile = A + tile * size;
+        const T* B_tile = B + tile * B_stride;
+
+        for (uint32_t k = 0; k < dim; k++)
+            for (uint32_t row = 0; row < dim; row++)
+            {
+                acc_t a = A_tile[row * dim + k];
+                for (uint32_t col = 0; col < dim; col++)
+                    acc[row][col] += a * (acc_t)B_tile[k * dim + col];
+            }
+    }
+
+    for (uint32_t row = 0; row < dim; row++)
+        for (uint32_t col = 0; col < dim; col++)
+            C[row * dim + col] = acc[row][col];
+}
+
+// 16 ymm registers can't hold the whole 8x8 tile and operands, so the tile is
+// computed as two 4x8 halves, each one keeps 8 accumulators in registers
+template <uint32_t FIXED_K>
+__attribute__((target("avx2,fma")))
+static void kernel_avx2(uint64_t num_k, const double* A, const double* B, uint64_t B_stride, double* C, bool accumulate)
+{
+    for (uint32_t half = 0; half < KERNEL_DIM; half += 4)
+    {
+        double* C_row = C + half * KERNEL_DIM;
+
+        __m256d c00 = _mm256_setzero_pd(), c01 = _mm256_setzero_pd();
+        __m256d c10 = _mm256_setzero_pd(), c11 = _mm256_setzero_pd();
+        __m256d c20 = _mm256_setzero_pd(), c21 = _mm256_setzero_pd();
+        __m256d c30 = _mm256_setzero_pd(), c31 = _mm256_setzero_pd();
+        if (accumulate)
+        {
+            c00 = _mm256_load_pd(C_row + 0 * KERNEL_DIM); c01 = _mm256_load_pd(C_row + 0 * KERNEL_DIM + 4);
+            c10 = _mm256_load_pd(C_row + 1 * KERNEL_DIM); c11 = _mm256_load_pd(C_row + 1 * KERNEL_DIM + 4);
+            c20 = _mm256_load_pd(C_row + 2 * KERNEL_DIM); c21 = _mm256_load_pd(C_row + 2 * KERNEL_DIM + 4);
+            c30 = _mm256_load_pd(C_row + 3 * KERNEL_DIM); c31 = _mm256_load_pd(C_row + 3 * KERNEL_DIM + 4);
+        }
+
+        const double* A_row = A + half * KERNEL_DIM;
+        const double* B_row = B;
+
+        for (uint64_t tile = 0; tile < (FIXED_K != 0 ? FIXED_K : num_k); tile++)
+        {
+            for (uint32_t k = 0; k < KERNEL_DIM; k++)
+            {
+                __m256d b0 = _mm256_load_pd(B_row + k * KERNEL_DIM);
+                __m256d b1 = _mm256_load_pd(B_row + k * KERNEL_DIM + 4);
+                __m256d a;
+
+                a = _mm256_broadcast_sd(A_row + 0 * KERNEL_DIM + k);
+                c00 = _mm256_fmadd_pd(a, b0, c00);
+                c01 = _mm256_fmadd_pd(a, b1, c01);
+                a = _mm256_broadcast_sd(A_row + 1 * KERNEL_DIM + k);
+                c10 = _mm256_fmadd_pd(a, b0, c10);
+                c11 = _mm256_fmadd_pd(a, b1, c11);
+                a = _mm256_broadcast_sd(A_row + 2 * KERNEL_DIM + k);
+                c20 = _mm256_fmadd_pd(a, b0, c20);
+                c21 = _mm256_fmadd_pd(a, b1, c21);
+                a = _mm256_broadcast_sd(A_row + 3 * KERNEL_DIM + k);
+                c30 = _mm256_fmadd_pd(a, b0, c30);
+                c31 = _mm256_fmadd_pd(a, b1, c31);
+            }
+            A_row += TILE_SIZE;
+            B_row += B_stride;
+        }
+
+        _mm256_store_pd(C_row + 0 * KERNEL_DIM,     c00);
+        _mm256_store_pd(C_row + 0 * KERNEL_DIM + 4, c01);
+        _mm256_store_pd(C_row + 1 * KERNEL_DIM,     c10);
+        _mm256_store_pd(C_row + 1 * KERNEL_DIM + 4, c11);
+        _mm256_store_pd(C_row + 2 * KERNEL_DIM,     c20);
+        _mm256_store_pd(C_row + 2 * KERNEL_DIM + 4, c21);
+        _mm256_store_pd(C_row + 3 * KERNEL_DIM,     c30);
+        _mm256_store_pd(C_row + 3 * KERNEL_DIM + 4, c31);
+    }
+}
+
+// One zmm register per tile row: 8 independent FMA chains hide FMA latency
+template <uint32_t FIXED_K>
+__attribute__((target("avx512f")))
+static void kernel_avx512(uint64_t num_k, const double* A, const double* B, uint64_t B_stride, double* C, bool accumulate)
+{
+    __m512d c0 = _mm512_setzero_pd(), c1 = _mm512_setzero_pd();
+    __m512d c2 = _mm512_setzero_pd(), c3 = _mm512_setzero_pd();
+    __m512d c4 = _mm512_setzero_pd(), c5 = _mm512_setzero_pd();
+    __m512d c6 = _mm512_setzero_pd(), c7 = _mm512_setzero_pd();
+    if (accumulate)
+    {
+        c0 = _mm512_load_pd(C + 0 * KERNEL_DIM); c1 = _mm512_load_pd(C + 1 * KERNEL_DIM);
+        c2 = _mm512_load_pd(C + 2 * KERNEL_DIM); c3 = _mm512_load_pd(C + 3 * KERNEL_DIM);
+        c4 = _mm512_load_pd(C + 4 * KERNEL_DIM); c5 = _mm512_load_pd(C + 5 * KERNEL_DIM);
+        c6 = _mm512_load_pd(C + 6 * KERNEL_DIM); c7 = _mm512_load_pd(C + 7 * KERNEL_DIM);
+    }
+
+    for (uint64_t tile = 0; tile < (FIXED_K != 0 ? FIXED_K : num_k); tile++)
+    {
+        for (uint32_t k = 0; k < KERNEL_DIM; k++)
+        {
+            __m512d b = _mm512_load_pd(B + k * KERNEL_DIM);
+
+            c0 = _mm512_fmadd_pd(_mm512_set1_pd(A[0 * KERNEL_DIM + k]), b, c0);
+            c1 = _mm512_fmadd_pd(_mm512_set1_pd(A[1 * KERNEL_DIM + k]), b, c1);
+            c2 = _mm512_fmadd_pd(_mm512_set1_pd(A[2 * KERNEL_DIM + k]), b, c2);
+            c3 = _mm512_fmadd_pd(_mm512_set1_pd(A[3 * KERNEL_DIM + k]), b, c3);
+            c4 = _mm512_fmadd_pd(_mm512_set1_pd(A[4 * KERNEL_DIM + k]), b, c4);
+            c5 = _mm512_fmadd_pd(_mm512_set1_pd(A[5 * KERNEL_DIM + k]), b, c5);
+            c6 = _mm512_fmadd_pd(_mm512_set1_pd(A[6 * KERNEL_DIM + k]), b, c6);
+            c7 = _mm512_fmadd_pd(_mm512_set1_pd(A[7 * KERNEL_DIM + k]), b, c7);
+        }
+        A += TILE_SIZE;
+        B += B_stride;
+    }
+
+    _mm512_store_pd(C + 0 * KERNEL_DIM, c0);
+    _mm512_store_pd(C + 1 * KERNEL_DIM, c1);
+    _mm512_store_pd(C + 2 * KERNEL_DIM, c2);
+    _mm512_store_pd(C + 3 * KERNEL_DIM, c3);
+    _mm512_store_pd(C + 4 * KERNEL_DIM, c4);
+    _mm512_store_pd(C + 5 * KERNEL_DIM, c5);
+    _mm512_store_pd(C + 6 * KERNEL_DIM, c6);
+    _mm512_store_pd(C + 7 * KERNEL_DIM, c7);
+}
+
+// mixed_f32 tiles are floats: B rows are widened to double as they are loaded,
+// A elements as they are broadcast, the tile is accumulated in double as above
+static_assert(sizeof(mixed_f32) == sizeof(float), "mixed_f32 tiles are read as floats");
+
+template <uint32_t FIXED_K>
+__attribute__((target("avx512f")))
+static void kernel_avx512_mixed(uint64_t num_k, const mixed_f32* A_tiles, const mixed_f32* B_tiles, uint64_t B_stride,
+                                double* C, bool accumulate)
+{
+    const float* A = reinterpret_cast<const float*>(A_tiles);
+    const float* B = reinterpret_cast<const float*>(B_tiles);
+
+    __m512d c0 = _mm512_setzero_pd(), c1 = _mm512_setzero_pd();
+    __m512d c2 = _mm512_setzero_pd(), c3 = _mm512_setzero_pd();
+    __m512d c4 = _mm512_setzero_pd(), c5 = _mm512_setzero_pd();
+    __m512d c6 = _mm512_setzero_pd(), c7 = _mm512_setzero_pd();
+    if (accumulate)
+    {
+        c0 = _mm512_load_pd(C + 0 * KERNEL_DIM); c1 = _mm512_load_pd(C + 1 * KERNEL_DIM);
+        c2 = _mm512_load_pd(C + 2 * KERNEL_DIM); c3 = _mm512_load_pd(C + 3 * KERNEL_DIM);
+        c4 = _mm512_load_pd(C + 4 * KERNEL_DIM); c5 = _mm512_load_pd(C + 5 * KERNEL_DIM);
+        c6 = _mm512_load_pd(C + 6 * KERNEL_DIM); c7 = _mm512_load_pd(C + 7 * KERNEL_DIM);
+    }
+
+    // the A tile is widened a row at a time, broadcasts then read doubles from memory
+    // instead of converting every element on the FMA ports
+    alignas(VECTOR_BYTES) double A_wide[TILE_SIZE];
+    for (uint64_t tile = 0; tile < (FIXED_K != 0 ? FIXED_K : num_k); tile++)
+    {
+        for (uint32_t row = 0; row < KERNEL_DIM; row++)
+            _mm512_store_pd(A_wide + row * KERNEL_DIM, _mm512_cvtps_pd(_mm256_load_ps(A + row * KERNEL_DIM)));
+
+        for (uint32_t k = 0; k < KERNEL_DIM; k++)
+        {
+            __m512d b = _mm512_cvtps_pd(_mm256_load_ps(B + k * KERNEL_DIM));
+
+            c0 = _mm512_fmadd_pd(_mm512_set1_pd(A_wide[0 * KERNEL_DIM + k]), b, c0);
+            c1 = _mm512_fmadd_pd(_mm512_set1_pd(A_wide[1 * KERNEL_DIM + k]), b, c1);
+            c2 = _mm512_fmadd_pd(_mm512_set1_pd(A_wide[2 * KERNEL_DIM + k]), b, c2);
+            c3 = _mm512_fmadd_pd(_mm512_set1_pd(A_wide[3 * KERNEL_DIM + k]), b, c3);
+            c4 = _mm512_fmadd_pd(_mm512_set1_pd(A_wide[4 * KERNEL_DIM + k]), b, c4);
+            c5 = _mm512_fmadd_pd(_mm512_set1_pd(A_wide[5 * KERNEL_DIM + k]), b, c5);
+            c6 = _mm512_fmadd_pd(_mm512_set1_pd(A_wide[6 * KERNEL_DIM + k]), b, c6);
+            c7 = _mm512_fmadd_pd(_mm512_set1_pd(A_wide[7 * KERNEL_DIM + k]), b, c7);
+        }
+        A += TILE_SIZE;
+        B += B_stride;
+    }
+
+    _mm512_store_pd(C + 0 * KERNEL_DIM, c0);
+    _mm512_store_pd(C + 1 * KERNEL_DIM, c1);
+    _mm512_store_pd(C + 2 * KERNEL_DIM, c2);
+    _mm512_store_pd(C + 3 * KERNEL_DIM, c3);
+    _mm512_store_pd(C + 4 * KERNEL_DIM, c4);
+    _mm512_store_pd(C + 5 * KERNEL_DIM, c5);
+    _mm512_store_pd(C + 6 * KERNEL_DIM, c6);
+    _mm512_store_pd(C + 7 * KERNEL_DIM, c7);
+}
+
+// Two 4 x 8 halves as kernel_avx2
+template <uint32_t FIXED_K>
+__attribute__((target("avx2,fma")))
+static void kernel_avx2_mixed(uint64_t num_k, const mixed_f32* A_tiles, const mixed_f32* B_tiles, uint64_t B_stride,
+                              double* C, bool accumulate)
+{
+    for (uint32_t half = 0; half < KERNEL_DIM; half += 4)
+    {
+        double* C_row = C + half * KERNEL_DIM;
+
+        __m256d c00 = _mm256_setzero_pd(), c01 = _mm256_setzero_pd();
+        __m256d c10 = _mm256_setzero_pd(), c11 = _mm256_setzero_pd();
+        __m256d c20 = _mm256_setzero_pd(), c21 = _mm256_setzero_pd();
+        __m256d c30 = _mm256_setzero_pd(), c31 = _mm256_setzero_pd();
+        if (accumulate)
+        {
+            c00 = _mm256_load_pd(C_row + 0 * KERNEL_DIM); c01 = _mm256_load_pd(C_row + 0 * KERNEL_DIM + 4);
+            c10 = _mm256_load_pd(C_row + 1 * KERNEL_DIM); c11 = _mm256_load_pd(C_row + 1 * KERNEL_DIM + 4);
+            c20 = _mm256_load_pd(C_row + 2 * KERNEL_DIM); c21 = _mm256_load_pd(C_row + 2 * KERNEL_DIM + 4);
+            c30 = _mm256_load_pd(C_row + 3 * KERNEL_DIM); c31 = _mm256_load_pd(C_row + 3 * KERNEL_DIM + 4);
+        }
+
+        const float* A_row = reinterpret_cast<const float*>(A_tiles) + half * KERNEL_DIM;
+        const float* B_row = reinterpret_cast<const float*>(B_tiles);
+
+        for (uint64_t tile = 0; tile < (FIXED_K != 0 ? FIXED_K : num_k); tile++)
+        {
+            for (uint32_t k = 0; k < KERNEL_DIM; k++)
+            {
+                __m256d b0 = _mm256_cvtps_pd(_mm_load_ps(B_row + k * KERNEL_DIM));
+                __m256d b1 = _mm256_cvtps_pd(_mm_load_ps(B_row + k * KERNEL_DIM + 4));
+                __m256d a;
+
+                a = _mm256_set1_pd(A_row[0 * KERNEL_DIM + k]);
+                c00 = _mm256_fmadd_pd(a, b0, c00);
+                c01 = _mm256_fmadd_pd(a, b1, c01);
+                a = _mm256_set1_pd(A_row[1 * KERNEL_DIM + k]);
+                c10 = _mm256_fmadd_pd(a, b0, c10);
+                c11 = _mm256_fmadd_pd(a, b1, c11);
+                a = _mm256_set1_pd(A_row[2 * KERNEL_DIM + k]);
+                c20 = _mm256_fmadd_pd(a, b0, c20);
+                c21 = _mm256_fmadd_pd(a, b1, c21);
+                a = _mm256_set1_pd(A_row[3 * KERNEL_DIM + k]);
+                c30 = _mm256_fmadd_pd(a, b0, c30);
+                c31 = _mm256_fmadd_pd(a, b1, c31);
+            }
+            A_row += TILE_SIZE;
+            B_row += B_stride;
+        }
+
+        _mm256_store_pd(C_row + 0 * KERNEL_DIM,     c00);
+        _mm256_store_pd(C_row + 0 * KERNEL_DIM + 4, c01);
+        _mm256_store_pd(C_row + 1 * KERNEL_DIM,     c10);
+        _mm256_store_pd(C_row + 1 * KERNEL_DIM + 4, c11);
+        _mm256_store_pd(C_row + 2 * KERNEL_DIM,     c20);
+        _mm256_store_pd(C_row + 2 * KERNEL_DIM + 4, c21);
+        _mm256_store_pd(C_row + 3 * KERNEL_DIM,     c30);
+        _mm256_store_pd(C_row + 3 * KERNEL_DIM + 4, c31);
+    }
+}
+
+// 16 x 16 float tile: one zmm accumulator per row, 16 of 32 registers
+template <uint32_t FIXED_K>
+__attribute__((target("avx512f")))
+static void kernel_avx512_f32(uint64_t num_k, const float* A, const float* B, uint64_t B_stride, float* C, bool accumulate)
+{
+    __m512 c[WIDE_DIM];
+#pragma GCC unroll 16
+    for (uint32_t row = 0; row < WIDE_DIM; row++)
+        c[row] = accumulate ? _mm512_load_ps(C + row * WIDE_DIM) : _mm512_setzero_ps();
+
+    for (uint64_t tile = 0; tile < (FIXED_K != 0 ? FIXED_K : num_k); tile++)
+    {
+        for (uint32_t k = 0; k < WIDE_DIM; k++)
+        {
+            __m512 b = _mm512_load_ps(B + k * WIDE_DIM);
+#pragma GCC unroll 16
+            for (uint32_t row = 0; row < WIDE_DIM; row++)
+                c[row] = _mm512_fmadd_ps(_mm512_set1_ps(A[row * WIDE_DIM + k]), b, c[row]);
+        }
+        A += WIDE_SIZE;
+        B += B_stride;
+    }
+
+#pragma GCC unroll 16
+    for (uint32_t row = 0; row < WIDE_DIM; row++)
+        _mm512_store_ps(C + row * WIDE_DIM, c[row]);
+}
+
+// 16 x 16 float tile as four 4 x 16 quarters, 8 ymm accumulators each
+template <uint32_t FIXED_K>
+__attribute__((target("avx2,fma")))
+static void kernel_avx2_f32(uint64_t num_k, const float* A, const float* B, uint64_t B_stride, float* C, bool accumulate)
+{
+    for (uint32_t quarter = 0; quarter < WIDE_DIM; quarter += 4)
+    {
+        float* C_row = C + quarter * WIDE_DIM;
+
+        __m256 c[4][2];
+#pragma GCC unroll 4
+        for (uint32_t row = 0; row < 4; row++)
+        {
+            c[row][0] = accumulate ? _mm256_load_ps(C_row + row * WIDE_DIM)     : _mm256_setzero_ps();
+            c[row][1] = accumulate ? _mm256_load_ps(C_row + row * WIDE_DIM + 8) : _mm256_setzero_ps();
+        }
+
+        const float* A_row = A + quarter * WIDE_DIM;
+        const float* B_row = B;
+
+        for (uint64_t tile = 0; tile < (FIXED_K != 0 ? FIXED_K : num_k); tile++)
+        {
+            for (uint32_t k = 0; k < WIDE_DIM; k++)
+            {
+                __m256 b0 = _mm256_load_ps(B_row + k * WIDE_DIM);
+                __m256 b1 = _mm256_load_ps(B_row + k * WIDE_DIM + 8);
+#pragma GCC unroll 4
+                for (uint32_t row = 0; row < 4; row++)
+                {
+                    __m256 a = _mm256_broadcast_ss(A_row + row * WIDE_DIM + k);
+                    c[row][0] = _mm256_fmadd_ps(a, b0, c[row][0]);
+                    c[row][1] = _mm256_fmadd_ps(a, b1, c[row][1]);
+                }
+            }
+            A_row += WIDE_SIZE;
+            B_row += B_stride;
+        }
+
+#pragma GCC unroll 4
+        for (uint32_t row = 0; row < 4; row++)
+        {
+            _mm256_store_ps(C_row + row * WIDE_DIM,     c[row][0]);
+            _mm256_store_ps(C_row + row * WIDE_DIM + 8, c[row][1]);
+        }
+    }
+}
+
+template <uint32_t FIXED_K>
+__attribute__((target("avx512f")))
+static void kernel_avx512_i32(uint64_t num_k, const int32_t* A, const int32_t* B, uint64_t B_stride, int32_t* C, bool accumulate)
+{
+    __m512i c[WIDE_DIM];
+#pragma GCC unroll 16
+    for (uint32_t row = 0; row < WIDE_DIM; row++)
+        c[row] = accumulate ? _mm512_load_si512(C + row * WIDE_DIM) : _mm512_setzero_si512();
+
+    for (uint64_t tile = 0; tile < (FIXED_K != 0 ? FIXED_K : num_k); tile++)
+    {
+        for (uint32_t k = 0; k < WIDE_DIM; k++)
+        {
+            __m512i b = _mm512_load_si512(B + k * WIDE_DIM);
+#pragma GCC unroll 16
+            for (uint32_t row = 0; row < WIDE_DIM; row++)
+                c[row] = _mm512_add_epi32(c[row], _mm512_mullo_epi32(_mm512_set1_epi32(A[row * WIDE_DIM + k]), b));
+        }
+        A += WIDE_SIZE;
+        B += B_stride;
+    }
+
+#pragma GCC unroll 16
+    for (uint32_t row = 0; row < WIDE_DIM; row++)
+        _mm512_store_si512(C + row * WIDE_DIM, c[row]);
+}
+
+template <uint32_t FIXED_K>
+__attribute__((target("avx2")))
+static void kernel_avx2_i32(uint64_t num_k, const int32_t* A, const int32_t* B, uint64_t B_stride, int32_t* C, bool accumulate)
+{
+    for (uint32_t quarter = 0; quarter < WIDE_DIM; quarter += 4)
+    {
+        int32_t* C_row = C + quarter * WIDE_DIM;
+
+        __m256i c[4][2];
+#pragma GCC unroll 4
+        for (uint32_t row = 0; row < 4; row++)
+        {
+            c[row][0] = accumulate ? _mm256_load_si256((const __m256i*)(C_row + row * WIDE_DIM))     : _mm256_setzero_si256();
+            c[row][1] = accumulate ? _mm256_load_si256((const __m256i*)(C_row + row * WIDE_DIM + 8)) : _mm256_setzero_si256();
+        }
+
+        const int32_t* A_row = A + quarter * WIDE_DIM;
+        const int32_t* B_row = B;
+
+        for (uint64_t tile = 0; tile < (FIXED_K != 0 ? FIXED_K : num_k); tile++)
+        {
+            for (uint32_t k = 0; k < WIDE_DIM; k++)
+            {
+                __m256i b0 = _mm256_load_si256((const __m256i*)(B_row + k * WIDE_DIM));
+                __m256i b1 = _mm256_load_si256((const __m256i*)(B_row + k * WIDE_DIM + 8));
+#pragma GCC unroll 4
+                for (uint32_t row = 0; row < 4; row++)
+                {
+                    __m256i a = _mm256_set1_epi32(A_row[row * WIDE_DIM + k]);
+                    c[row][0] = _mm256_add_epi32(c[row][0], _mm256_mullo_epi32(a, b0));
+                    c[row][1] = _mm256_add_epi32(c[row][1], _mm256_mullo_epi32(a, b1));
+                }
+            }
+            A_row += WIDE_SIZE;
+            B_row += B_stride;
+        }
+
+#pragma GCC unroll 4
+        for (uint32_t row = 0; row < 4; row++)
+        {
+            _mm256_store_si256((__m256i*)(C_row + row * WIDE_DIM),     c[row][0]);
+            _mm256_store_si256((__m256i*)(C_row + row * WIDE_DIM + 8), c[row][1]);
+        }
+    }
+}
+
+// Two A elements of a row widened to int16 and packed into one int32 lane
+static inline int32_t pair_i8(const int8_t* A_row, uint32_t k)
+{
+    return (int32_t)((uint32_t)(uint16_t)(int16_t)A_row[k] | ((uint32_t)(uint16_t)(int16_t)A_row[k + 1] << 16));
+}
+
+// B rows k and k + 1 widened to int16 and interleaved column by column:
+// madd_epi16 then gives a[k] * b[k][col] + a[k + 1] * b[k + 1][col] in int32 lanes
+__attribute__((target("avx2")))
+static inline void interleave_i8(const int8_t* B_row, __m256i* low_cols, __m256i* high_cols)
+{
+    __m256i b0 = _mm256_cvtepi8_epi16(_mm_load_si128((const __m128i*)B_row));
+    __m256i b1 = _mm256_cvtepi8_epi16(_mm_load_si128((const __m128i*)(B_row + WIDE_DIM)));
+    __m256i lo = _mm256_unpacklo_epi16(b0, b1); // columns 0-3 and 8-11
+    __m256i hi = _mm256_unpackhi_epi16(b0, b1); // columns 4-7 and 12-15
+    *low_cols  = _mm256_permute2x128_si256(lo, hi, 0x20);
+    *high_cols = _mm256_permute2x128_si256(lo, hi, 0x31);
+}
+
+// int8 tile is multiplied two k at a time by vpmaddwd into int32 accumulators
+template <uint32_t FIXED_K>
+__attribute__((target("avx512f,avx512bw,avx2")))
+static void kernel_avx512_i8(uint64_t num_k, const int8_t* A, const int8_t* B, uint64_t B_stride, int32_t* C, bool accumulate)
+{
+    __m512i c[WIDE_DIM];
+#pragma GCC unroll 16
+    for (uint32_t row = 0; row < WIDE_DIM; row++)
+        c[row] = accumulate ? _mm512_load_si512(C + row * WIDE_DIM) : _mm512_setzero_si512();
+
+    for (uint64_t tile = 0; tile < (FIXED_K != 0 ? FIXED_K : num_k); tile++)
+    {
+        for (uint32_t k = 0; k < WIDE_DIM; k += 2)
+        {
+            __m256i low_cols, high_cols;
+            interleave_i8(B + k * WIDE_DIM, &low_cols, &high_cols);
+            __m512i b = _mm512_inserti64x4(_mm512_castsi256_si512(low_cols), high_cols, 1);
+#pragma GCC unroll 16
+            for (uint32_t row = 0; row < WIDE_DIM; row++)
+                c[row] = _mm512_add_epi32(c[row], _mm512_madd_epi16(_mm512_set1_epi32(pair_i8(A + row * WIDE_DIM, k)), b));
+        }
+        A += WIDE_SIZE;
+        B += B_stride;
+    }
+
+#pragma GCC unroll 16
+    for (uint32_t row = 0; row < WIDE_DIM; row++)
+        _mm512_store_si512(C + row * WIDE_DIM, c[row]);
+}
+
+template <uint32_t FIXED_K>
+__attribute__((target("avx2")))
+static void kernel_avx2_i8(uint64_t num_k, const int8_t* A, const int8_t* B, uint64_t B_stride, int32_t* C, bool accumulate)
+{
+    for (uint32_t quarter = 0; quarter < WIDE_DIM; quarter += 4)
+    {
+        int32_t* C_row = C + quarter * WIDE_DIM;
+
+        __m256i c[4][2];
+#pragma GCC unroll 4
+        for (uint32_t row = 0; row < 4; row++)
+        {
+            c[row][0] = accumulate ? _mm256_load_si256((const __m256i*)(C_row + row * WIDE_DIM))     : _mm256_setzero_si256();
+            c[row][1] = accumulate ? _mm256_load_si256((const __m256i*)(C_row + row * WIDE_DIM + 8)) : _mm256_setzero_si256();
+        }
+
+        const int8_t* A_row = A + quarter * WIDE_DIM;
+        const int8_t* B_row = B;
+
+        for (uint64_t tile = 0; tile < (FIXED_K != 0 ? FIXED_K : num_k); tile++)
+        {
+            for (uint32_t k = 0; k < WIDE_DIM; k += 2)
+            {
+                __m256i b0, b1;
+                interleave_i8(B_row + k * WIDE_DIM, &b0, &b1);
+#pragma GCC unroll 4
+                for (uint32_t row = 0; row < 4; row++)
+                {
+                    __m256i a = _mm256_set1_epi32(pair_i8(A_row + row * WIDE_DIM, k));
+                    c[row][0] = _mm256_add_epi32(c[row][0], _mm256_madd_epi16(a, b0));
+                    c[row][1] = _mm256_add_epi32(c[row][1], _mm256_madd_epi16(a, b1));
+                }
+            }
+            A_row += WIDE_SIZE;
+            B_row += B_stride;
+        }
+
+#pragma GCC unroll 4
+        for (uint32_t row = 0; row < 4; row++)
+        {
+            _mm256_store_si256((__m256i*)(C_row + row * WIDE_DIM),     c[row][0]);
+            _mm256_store_si256((__m256i*)(C_row + row * WIDE_DIM + 8), c[row][1]);
+        }
+    }
+}
+
+// Row k of a panel of B for the sparse kernels
+template <typename T>
+static inline const T* csr_row(const T* B, uint64_t B_stride, uint32_t k)
+{
+    const uint32_t dim = block_traits<T>::tile_dim;
+    return B + (k / dim) * B_stride + (k % dim) * dim;
+}
+
+template <typename T>
+static void csr_kernel_scalar(uint64_t count, const uint32_t* col_idx, const T* values, const T* B, uint64_t B_stride,
+                              typename block_traits<T>::acc_t* C)
+{
+    typedef typename block_traits<T>::acc_t acc_t;
+    const uint32_t dim = block_traits<T>::tile_dim;
+
+    acc_t acc[dim] = {};
+    for (uint64_t i = 0; i < count; i++)
+    {
+        const T* B_row = csr_row(B, B_stride, col_idx[i]);
+        for (uint32_t col = 0; col < dim; col++)
+            acc[col] += (acc_t)values[i] * (acc_t)B_row[col];
+    }
+
+    for (uint32_t col = 0; col < dim; col++)
+        C[col] = acc[col];
+}
+
+// Floating point sparse kernels keep two sums to hide the FMA latency
+__attribute__((target("avx512f")))
+static void csr_kernel_avx512(uint64_t count, const uint32_t* col_idx, const double* values, const double* B, uint64_t B_stride,
+                              double* C)
+{
+    __m512d c0 = _mm512_setzero_pd(), c1 = _mm512_setzero_pd();
+
+    uint64_t i = 0;
+    for (; i + 1 < count; i += 2)
+    {
+        c0 = _mm512_fmadd_pd(_mm512_set1_pd(values[i]),     _mm512_loadu_pd(csr_row(B, B_stride, col_idx[i])),     c0);
+        c1 = _mm512_fmadd_pd(_mm512_set1_pd(values[i + 1]), _mm512_loadu_pd(csr_row(B, B_stride, col_idx[i + 1])), c1);
+    }
+    if (i < count)
+        c0 = _mm512_fmadd_pd(_mm512_set1_pd(values[i]), _mm512_loadu_pd(csr_row(B, B_stride, col_idx[i])), c0);
+
+    _mm512_storeu_pd(C, _mm512_add_pd(c0, c1));
+}
+
+__attribute__((target("avx2,fma")))
+static void csr_kernel_avx2(uint64_t count, const uint32_t* col_idx, const double* values, const double* B, uint64_t B_stride,
+                            double* C)
+{
+    __m256d c0 = _mm256_setzero_pd(), c1 = _mm256_setzero_pd();
+
+    for (uint64_t i = 0; i < count; i++)
+    {
+        const double* B_row = csr_row(B, B_stride, col_idx[i]);
+        __m256d a = _mm256_set1_pd(values[i]);
+        c0 = _mm256_fmadd_pd(a, _mm256_loadu_pd(B_row),     c0);
+        c1 = _mm256_fmadd_pd(a, _mm256_loadu_pd(B_row + 4), c1);
+    }
+
+    _mm256_storeu_pd(C,     c0);
+    _mm256_storeu_pd(C + 4, c1);
+}
+
+__attribute__((target("avx512f")))
+static void csr_kernel_avx512_f32(uint64_t count, const uint32_t* col_idx, const float* values, const float* B, uint64_t B_stride,
+                                  float* C)
+{
+    __m512 c0 = _mm512_setzero_ps(), c1 = _mm512_setzero_ps();
+
+    uint64_t i = 0;
+    for (; i + 1 < count; i += 2)
+    {
+        c0 = _mm512_fmadd_ps(_mm512_set1_ps(values[i]),     _mm512_loadu_ps(csr_row(B, B_stride, col_idx[i])),     c0);
+        c1 = _mm512_fmadd_ps(_mm512_set1_ps(values[i + 1]), _mm512_loadu_ps(csr_row(B, B_stride, col_idx[i + 1])), c1);
+    }
+    if (i < count)
+        c0 = _mm512_fmadd_ps(_mm512_set1_ps(values[i]), _mm512_loadu_ps(csr_row(B, B_stride, col_idx[i])), c0);
+
+    _mm512_storeu_ps(C, _mm512_add_ps(c0, c1));
+}
+
+__attribute__((target("avx2,fma")))
+static void csr_kernel_avx2_f32(uint64_t count, const uint32_t* col_idx, const float* values, const float* B, uint64_t B_stride,
+                                float* C)
+{
+    __m256 c0 = _mm256_setzero_ps(), c1 = _mm256_setzero_ps();
+
+    for (uint64_t i = 0; i < count; i++)
+    {
+        const float* B_row = csr_row(B, B_stride, col_idx[i]);
+        __m256 a = _mm256_set1_ps(values[i]);
+        c0 = _mm256_fmadd_ps(a, _mm256_loadu_ps(B_row),     c0);
+        c1 = _mm256_fmadd_ps(a, _mm256_loadu_ps(B_row + 8), c1);
+    }
+
+    _mm256_storeu_ps(C,     c0);
+    _mm256_storeu_ps(C + 8, c1);
+}
+
+__attribute__((target("avx512f")))
+static void csr_kernel_avx512_i32(uint64_t count, const uint32_t* col_idx, const int32_t* values, const int32_t* B,
+                                  uint64_t B_stride, int32_t* C)
+{
+    __m512i c = _mm512_setzero_si512();
+    for (uint64_t i = 0; i < count; i++)
+    {
+        __m512i b = _mm512_loadu_si512(csr_row(B, B_stride, col_idx[i]));
+        c = _mm512_add_epi32(c, _mm512_mullo_epi32(_mm512_set1_epi32(values[i]), b));
+    }
+    _mm512_storeu_si512(C, c);
+}
+
+__attribute__((target("avx2")))
+static void csr_kernel_avx2_i32(uint64_t count, const uint32_t* col_idx, const int32_t* values, const int32_t* B,
+                                uint64_t B_stride, int32_t* C)
+{
+    __m256i c0 = _mm256_setzero_si256(), c1 = _mm256_setzero_si256();
+    for (uint64_t i = 0; i < count; i++)
+    {
+        const int32_t* B_row = csr_row(B, B_stride, col_idx[i]);
+        __m256i a = _mm256_set1_epi32(values[i]);
+        c0 = _mm256_add_epi32(c0, _mm256_mullo_epi32(a, _mm256_loadu_si256((const __m256i*)B_row)));
+        c1 = _mm256_add_epi32(c1, _mm256_mullo_epi32(a, _mm256_loadu_si256((const __m256i*)(B_row + 8))));
+    }
+    _mm256_storeu_si256((__m256i*)C,       c0);
+    _mm256_storeu_si256((__m256i*)(C + 8), c1);
+}
+
+// int8 rows of B are widened to int32 lanes
+__attribute__((target("avx512f")))
+static void csr_kernel_avx512_i8(uint64_t count, const uint32_t* col_idx, const int8_t* values, const int8_t* B,
+                                 uint64_t B_stride, int32_t* C)
+{
+    __m512i c = _mm512_setzero_si512();
+    for (uint64_t i = 0; i < count; i++)
+    {
+        __m512i b = _mm512_cvtepi8_epi32(_mm_loadu_si128((const __m128i*)csr_row(B, B_stride, col_idx[i])));
+        c = _mm512_add_epi32(c, _mm512_mullo_epi32(_mm512_set1_epi32(values[i]), b));
+    }
+    _mm512_storeu_si512(C, c);
+}
+
+__attribute__((target("avx2")))
+static void csr_kernel_avx2_i8(uint64_t count, const uint32_t* col_idx, const int8_t* values, const int8_t* B,
+                               uint64_t B_stride, int32_t* C)
+{
+    __m256i c0 = _mm256_setzero_si256(), c1 = _mm256_setzero_si256();
+    for (uint64_t i = 0; i < count; i++)
+    {
+        __m128i b = _mm_loadu_si128((const __m128i*)csr_row(B, B_stride, col_idx[i]));
+        __m256i a = _mm256_set1_epi32(values[i]);
+        c0 = _mm256_add_epi32(c0, _mm256_mullo_epi32(a, _mm256_cvtepi8_epi32(b)));
+        c1 = _mm256_add_epi32(c1, _mm256_mullo_epi32(a, _mm256_cvtepi8_epi32(_mm_srli_si128(b, 8))));
+    }
+    _mm256_storeu_si256((__m256i*)C,       c0);
+    _mm256_storeu_si256((__m256i*)(C + 8), c1);
+}
+
+template <typename T>
+static typename block_traits<T>::acc_t dot_kernel_scalar(uint64_t count, const T* a, const T* b)
+{
+    typedef typename block_traits<T>::acc_t acc_t;
+
+    acc_t sum = 0;
+    for (uint64_t i = 0; i < count; i++)
+        sum += (acc_t)a[i] * (acc_t)b[i];
+    return sum;
+}
+
+template <typename T>
+static void axpy_kernel_scalar(uint64_t count, typename block_traits<T>::acc_t alpha, const T* a, typename block_traits<T>::acc_t* y)
+{
+    typedef typename block_traits<T>::acc_t acc_t;
+
+    for (uint64_t i = 0; i < count; i++)
+        y[i] += alpha * (acc_t)a[i];
+}
+
+// Dot products keep several vector sums to hide the latency, the avx512 ones
+// (but int8) finish the tail with masked loads
+__attribute__((target("avx512f")))
+static double dot_kernel_avx512(uint64_t count, const double* a, const double* b)
+{
+    __m512d c0 = _mm512_setzero_pd(), c1 = _mm512_setzero_pd(), c2 = _mm512_setzero_pd(), c3 = _mm512_setzero_pd();
+
+    uint64_t i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        c0 = _mm512_fmadd_pd(_mm512_loadu_pd(a + i),      _mm512_loadu_pd(b + i),      c0);
+        c1 = _mm512_fmadd_pd(_mm512_loadu_pd(a + i + 8),  _mm512_loadu_pd(b + i + 8),  c1);
+        c2 = _mm512_fmadd_pd(_mm512_loadu_pd(a + i + 16), _mm512_loadu_pd(b + i + 16), c2);
+        c3 = _mm512_fmadd_pd(_mm512_loadu_pd(a + i + 24), _mm512_loadu_pd(b + i + 24), c3);
+    }
+    for (; i < count; i += 8)
+    {
+        __mmask8 mask = (count - i >= 8) ? 0xff : (__mmask8)((1u << (count - i)) - 1);
+        c0 = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(mask, a + i), _mm512_maskz_loadu_pd(mask, b + i), c0);
+    }
+
+    return _mm512_reduce_add_pd(_mm512_add_pd(_mm512_add_pd(c0, c1), _mm512_add_pd(c2, c3)));
+}
+
+__attribute__((target("avx2,fma")))
+static double dot_kernel_avx2(uint64_t count, const double* a, const double* b)
+{
+    __m256d c0 = _mm256_setzero_pd(), c1 = _mm256_setzero_pd(), c2 = _mm256_setzero_pd(), c3 = _mm256_setzero_pd();
+
+    uint64_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        c0 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i),      _mm256_loadu_pd(b + i),      c0);
+        c1 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i + 4),  _mm256_loadu_pd(b + i + 4),  c1);
+        c2 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i + 8),  _mm256_loadu_pd(b + i + 8),  c2);
+        c3 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i + 12), _mm256_loadu_pd(b + i + 12), c3);
+    }
+
+    alignas(32) double lanes[4];
+    _mm256_store_pd(lanes, _mm256_add_pd(_mm256_add_pd(c0, c1), _mm256_add_pd(c2, c3)));
+    double sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    for (; i < count; i++)
+        sum += a[i] * b[i];
+    return sum;
+}
+
+__attribute__((target("avx512f")))
+static float dot_kernel_avx512_f32(uint64_t count, const float* a, const float* b)
+{
+    __m512 c0 = _mm512_setzero_ps(), c1 = _mm512_setzero_ps(), c2 = _mm512_setzero_ps(), c3 = _mm512_setzero_ps();
+
+    uint64_t i = 0;
+    for (; i + 64 <= count; i += 64)
+    {
+        c0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i),      _mm512_loadu_ps(b + i),      c0);
+        c1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), c1);
+        c2 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 32), _mm512_loadu_ps(b + i + 32), c2);
+        c3 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 48), _mm512_loadu_ps(b + i + 48), c3);
+    }
+    for (; i < count; i += 16)
+    {
+        __mmask16 mask = (count - i >= 16) ? 0xffff : (__mmask16)((1u << (count - i)) - 1);
+        c0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i), c0);
+    }
+
+    return _mm512_reduce_add_ps(_mm512_add_ps(_mm512_add_ps(c0, c1), _mm512_add_ps(c2, c3)));
+}
+
+__attribute__((target("avx2,fma")))
+static float dot_kernel_avx2_f32(uint64_t count, const float* a, const float* b)
+{
+    __m256 c0 = _mm256_setzero_ps(), c1 = _mm256_setzero_ps(), c2 = _mm256_setzero_ps(), c3 = _mm256_setzero_ps();
+
+    uint64_t i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        c0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i),      _mm256_loadu_ps(b + i),      c0);
+        c1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8),  _mm256_loadu_ps(b + i + 8),  c1);
+        c2 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 16), _mm256_loadu_ps(b + i + 16), c2);
+        c3 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 24), _mm256_loadu_ps(b + i + 24), c3);
+    }
+
+    alignas(32) float lanes[8];
+    _mm256_store_ps(lanes, _mm256_add_ps(_mm256_add_ps(c0, c1), _mm256_add_ps(c2, c3)));
+    float sum = 0;
+    for (uint32_t lane = 0; lane < 8; lane++)
+        sum += lanes[lane];
+    for (; i < count; i++)
+        sum += a[i] * b[i];
+    return sum;
+}
+
+__attribute__((target("avx512f")))
+static int32_t dot_kernel_avx512_i32(uint64_t count, const int32_t* a, const int32_t* b)
+{
+    __m512i c0 = _mm512_setzero_si512(), c1 = _mm512_setzero_si512();
+
+    uint64_t i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        c0 = _mm512_add_epi32(c0, _mm512_mullo_epi32(_mm512_loadu_si512(a + i),      _mm512_loadu_si512(b + i)));
+        c1 = _mm512_add_epi32(c1, _mm512_mullo_epi32(_mm512_loadu_si512(a + i + 16), _mm512_loadu_si512(b + i + 16)));
+    }
+    for (; i < count; i += 16)
+    {
+        __mmask16 mask = (count - i >= 16) ? 0xffff : (__mmask16)((1u << (count - i)) - 1);
+        c0 = _mm512_add_epi32(c0, _mm512_mullo_epi32(_mm512_maskz_loadu_epi32(mask, a + i), _mm512_maskz_loadu_epi32(mask, b + i)));
+    }
+
+    return _mm512_reduce_add_epi32(_mm512_add_epi32(c0, c1));
+}
+
+__attribute__((target("avx2")))
+static int32_t dot_kernel_avx2_i32(uint64_t count, const int32_t* a, const int32_t* b)
+{
+    __m256i c0 = _mm256_setzero_si256(), c1 = _mm256_setzero_si256();
+
+    uint64_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        c0 = _mm256_add_epi32(c0, _mm256_mullo_epi32(_mm256_loadu_si256((const __m256i*)(a + i)),
+                                                     _mm256_loadu_si256((const __m256i*)(b + i))));
+        c1 = _mm256_add_epi32(c1, _mm256_mullo_epi32(_mm256_loadu_si256((const __m256i*)(a + i + 8)),
+                                                     _mm256_loadu_si256((const __m256i*)(b + i + 8))));
+    }
+
+    alignas(32) int32_t lanes[8];
+    _mm256_store_si256((__m256i*)lanes, _mm256_add_epi32(c0, c1));
+    int32_t sum = 0;
+    for (uint32_t lane = 0; lane < 8; lane++)
+        sum += lanes[lane];
+    for (; i < count; i++)
+        sum += a[i] * b[i];
+    return sum;
+}
+
+// int8 elements are widened to int16, vpmaddwd sums pairs of products into int32 lanes
+__attribute__((target("avx512f,avx512bw")))
+static int32_t dot_kernel_avx512_i8(uint64_t count, const int8_t* a, const int8_t* b)
+{
+    __m512i c0 = _mm512_setzero_si512(), c1 = _mm512_setzero_si512();
+
+    uint64_t i = 0;
+    for (; i + 64 <= count; i += 64)
+    {
+        __m512i a0 = _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i*)(a + i)));
+        __m512i b0 = _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i*)(b + i)));
+        __m512i a1 = _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i*)(a + i + 32)));
+        __m512i b1 = _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i*)(b + i + 32)));
+        c0 = _mm512_add_epi32(c0, _mm512_madd_epi16(a0, b0));
+        c1 = _mm512_add_epi32(c1, _mm512_madd_epi16(a1, b1));
+    }
+
+    int32_t sum = _mm512_reduce_add_epi32(_mm512_add_epi32(c0, c1));
+    for (; i < count; i++)
+        sum += (int32_t)a[i] * (int32_t)b[i];
+    return sum;
+}
+
+__attribute__((target("avx2")))
+static int32_t dot_kernel_avx2_i8(uint64_t count, const int8_t* a, const int8_t* b)
+{
+    __m256i c0 = _mm256_setzero_si256(), c1 = _mm256_setzero_si256();
+
+    uint64_t i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        __m256i a0 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(a + i)));
+        __m256i b0 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(b + i)));
+        __m256i a1 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(a + i + 16)));
+        __m256i b1 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(b + i + 16)));
+        c0 = _mm256_add_epi32(c0, _mm256_madd_epi16(a0, b0));
+        c1 = _mm256_add_epi32(c1, _mm256_madd_epi16(a1, b1));
+    }
+
+    alignas(32) int32_t lanes[8];
+    _mm256_store_si256((__m256i*)lanes, _mm256_add_epi32(c0, c1));
+    int32_t sum = 0;
+    for (uint32_t lane = 0; lane < 8; lane++)
+        sum += lanes[lane];
+    for (; i < count; i++)
+        sum += (int32_t)a[i] * (int32_t)b[i];
+    return sum;
+}
+
+// y += alpha * a, tails are left to the scalar loop
+__attribute__((target("avx512f")))
+static void axpy_kernel_avx512(uint64_t count, double alpha, const double* a, double* y)
+{
+    __m512d scale = _mm512_set1_pd(alpha);
+
+    uint64_t i = 0;
+    for (; i + 8 <= count; i += 8)
+        _mm512_storeu_pd(y + i, _mm512_fmadd_pd(scale, _mm512_loadu_pd(a + i), _mm512_loadu_pd(y + i)));
+    for (; i < count; i++)
+        y[i] += alpha * a[i];
+}
+
+__attribute__((target("avx2,fma")))
+static void axpy_kernel_avx2(uint64_t count, double alpha, const double* a, double* y)
+{
+    __m256d scale = _mm256_set1_pd(alpha);
+
+    uint64_t i = 0;
+    for (; i + 4 <= count; i += 4)
+        _mm256_storeu_pd(y + i, _mm256_fmadd_pd(scale, _mm256_loadu_pd(a + i), _mm256_loadu_pd(y + i)));
+    for (; i < count; i++)
+        y[i] += alpha * a[i];
+}
+
+__attribute__((target("avx512f")))
+static void axpy_kernel_avx512_f32(uint64_t count, float alpha, const float* a, float* y)
+{
+    __m512 scale = _mm512_set1_ps(alpha);
+
+    uint64_t i = 0;
+    for (; i + 16 <= count; i += 16)
+        _mm512_storeu_ps(y + i, _mm512_fmadd_ps(scale, _mm512_loadu_ps(a + i), _mm512_loadu_ps(y + i)));
+    for (; i < count; i++)
+        y[i] += alpha * a[i];
+}
+
+__attribute__((target("avx2,fma")))
+static void axpy_kernel_avx2_f32(uint64_t count, float alpha, const float* a, float* y)
+{
+    __m256 scale = _mm256_set1_ps(alpha);
+
+    uint64_t i = 0;
+    for (; i + 8 <= count; i += 8)
+        _mm256_storeu_ps(y + i, _mm256_fmadd_ps(scale, _mm256_loadu_ps(a + i), _mm256_loadu_ps(y + i)));
+    for (; i < count; i++)
+        y[i] += alpha * a[i];
+}
+
+__attribute__((target("avx512f")))
+static void axpy_kernel_avx512_i32(uint64_t count, int32_t alpha, const int32_t* a, int32_t* y)
+{
+    __m512i scale = _mm512_set1_epi32(alpha);
+
+    uint64_t i = 0;
+    for (; i + 16 <= count; i += 16)
+        _mm512_storeu_si512(y + i, _mm512_add_epi32(_mm512_loadu_si512(y + i), _mm512_mullo_epi32(scale, _mm512_loadu_si512(a + i))));
+    for (; i < count; i++)
+        y[i] += alpha * a[i];
+}
+
+__attribute__((target("avx2")))
+static void axpy_kernel_avx2_i32(uint64_t count, int32_t alpha, const int32_t* a, int32_t* y)
+{
+    __m256i scale = _mm256_set1_epi32(alpha);
+
+    uint64_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i product = _mm256_mullo_epi32(scale, _mm256_loadu_si256((const __m256i*)(a + i)));
+        _mm256_storeu_si256((__m256i*)(y + i), _mm256_add_epi32(_mm256_loadu_si256((const __m256i*)(y + i)), product));
+    }
+    for (; i < count; i++)
+        y[i] += alpha * a[i];
+}
+
+__attribute__((target("avx512f")))
+static void axpy_kernel_avx512_i8(uint64_t count, int32_t alpha, const int8_t* a, int32_t* y)
+{
+    __m512i scale = _mm512_set1_epi32(alpha);
+
+    uint64_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m512i product = _mm512_mullo_epi32(scale, _mm512_cvtepi8_epi32(_mm_loadu_si128((const __m128i*)(a + i))));
+        _mm512_storeu_si512(y + i, _mm512_add_epi32(_mm512_loadu_si512(y + i), product));
+    }
+    for (; i < count; i++)
+        y[i] += alpha * (int32_t)a[i];
+}
+
+__attribute__((target("avx2")))
+static void axpy_kernel_avx2_i8(uint64_t count, int32_t alpha, const int8_t* a, int32_t* y)
+{
+    __m256i scale = _mm256_set1_epi32(alpha);
+
+    uint64_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i product = _mm256_mullo_epi32(scale, _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)(a + i))));
+        _mm256_storeu_si256((__m256i*)(y + i), _mm256_add_epi32(_mm256_loadu_si256((const __m256i*)(y + i)), product));
+    }
+    for (; i < count; i++)
+        y[i] += alpha * (int32_t)a[i];
+}
+
+template <typename T>
+struct kernel_choice
+{
+    micro_kernel_t<T>        kernel_;
+    const micro_kernel_t<T>* small_; // SMALL_K_TILES kernels, entry i has i + 1 k tiles fixed
+    csr_kernel_t<T>          csr_;
+    dot_kernel_t<T>          dot_;
+    axpy_kernel_t<T>         axpy_;
+    const char*              name_;
+};
+
+// Entry i of a table is the kernel with i + 1 k tiles fixed at compile time
+#define FIXED_K_TABLE(kernel) {kernel<1>, kernel<2>, kernel<3>, kernel<4>, kernel<5>, kernel<6>, kernel<7>, kernel<8>, \
+                               kernel<9>, kernel<10>, kernel<11>, kernel<12>, kernel<13>, kernel<14>, kernel<15>, kernel<16>}
+
+static_assert(SMALL_K_TILES == 16, "FIXED_K_TABLE lists SMALL_K_TILES kernels");
+
+static const micro_kernel_t<double>  small_avx512_f64[] = FIXED_K_TABLE(kernel_avx512);
+static const micro_kernel_t<double>  small_avx2_f64[]   = FIXED_K_TABLE(kernel_avx2);
+static const micro_kernel_t<float>   small_avx512_f32[] = FIXED_K_TABLE(kernel_avx512_f32);
+static const micro_kernel_t<float>   small_avx2_f32[]   = FIXED_K_TABLE(kernel_avx2_f32);
+static const micro_kernel_t<int32_t> small_avx512_i32[] = FIXED_K_TABLE(kernel_avx512_i32);
+static const micro_kernel_t<int32_t> small_avx2_i32[]   = FIXED_K_TABLE(kernel_avx2_i32);
+static const micro_kernel_t<int8_t>  small_avx512_i8[]  = FIXED_K_TABLE(kernel_avx512_i8);
+static const micro_kernel_t<int8_t>  small_avx2_i8[]    = FIXED_K_TABLE(kernel_avx2_i8);
+static const micro_kernel_t<mixed_f32> small_avx512_mixed[] = FIXED_K_TABLE(kernel_avx512_mixed);
+static const micro_kernel_t<mixed_f32> small_avx2_mixed[]   = FIXED_K_TABLE(kernel_avx2_mixed);
+
+// kernel_scalar takes T first, so its table is built from this one-parameter wrapper
+template <typename T>
+struct scalar_kernels
+{
+    template <uint32_t FIXED_K>
+    static void kernel(uint64_t num_k, const T* A, const T* B, uint64_t B_stride, typename block_traits<T>::acc_t* C, bool accumulate)
+    {
+        kernel_scalar<T, FIXED_K>(num_k, A, B, B_stride, C, accumulate);
+    }
+
+    static constexpr micro_kernel_t<T> small_[] = FIXED_K_TABLE(kernel);
+};
+
+#undef FIXED_K_TABLE
+
+// Kernels of one element type and the CPU features they need
+template <typename T>
+struct kernel_set
+{
+    micro_kernel_t<T>        avx512_;
+    const micro_kernel_t<T>* avx512_small_;
+    csr_kernel_t<T>          avx512_csr_;
+    dot_kernel_t<T>          avx512_dot_;
+    axpy_kernel_t<T>         avx512_axpy_;
+    bool                     avx512_supported_;
+    micro_kernel_t<T>        avx2_;
+    const micro_kernel_t<T>* avx2_small_;
+    csr_kernel_t<T>          avx2_csr_;
+    dot_kernel_t<T>          avx2_dot_;
+    axpy_kernel_t<T>         avx2_axpy_;
+    bool                     avx2_supported_;
+};
+
+template <typename T> static kernel_set<T> kernels_of();
+
+template <> kernel_set<double> kernels_of<double>()
+{
+    return {kernel_avx512<0>, small_avx512_f64, csr_kernel_avx512,
+            dot_kernel_avx512, axpy_kernel_avx512, __builtin_cpu_supports("avx512f") != 0,
+            kernel_avx2<0>, small_avx2_f64, csr_kernel_avx2,
+            dot_kernel_avx2, axpy_kernel_avx2, __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")};
+}
+
+template <> kernel_set<float> kernels_of<float>()
+{
+    return {kernel_avx512_f32<0>, small_avx512_f32, csr_kernel_avx512_f32,
+            dot_kernel_avx512_f32, axpy_kernel_avx512_f32, __builtin_cpu_supports("avx512f") != 0,
+            kernel_avx2_f32<0>, small_avx2_f32, csr_kernel_avx2_f32,
+            dot_kernel_avx2_f32, axpy_kernel_avx2_f32, __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")};
+}
+
+template <> kernel_set<int32_t> kernels_of<int32_t>()
+{
+    return {kernel_avx512_i32<0>, small_avx512_i32, csr_kernel_avx512_i32,
+            dot_kernel_avx512_i32, axpy_kernel_avx512_i32, __builtin_cpu_supports("avx512f") != 0,
+            kernel_avx2_i32<0>, small_avx2_i32, csr_kernel_avx2_i32,
+            dot_kernel_avx2_i32, axpy_kernel_avx2_i32, __builtin_cpu_supports("avx2") != 0};
+}
+
+template <> kernel_set<int8_t> kernels_of<int8_t>()
+{
+    return {kernel_avx512_i8<0>, small_avx512_i8, csr_kernel_avx512_i8,
+            dot_kernel_avx512_i8, axpy_kernel_avx512_i8, __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"),
+            kernel_avx2_i8<0>, small_avx2_i8, csr_kernel_avx2_i8,
+            dot_kernel_avx2_i8, axpy_kernel_avx2_i8, __builtin_cpu_supports("avx2") != 0};
+}
+
+// Only the tile kernels are vectorized: the sparse and vector products don't take mixed_f32
+template <> kernel_set<mixed_f32> kernels_of<mixed_f32>()
+{
+    return {kernel_avx512_mixed<0>, small_avx512_mixed, csr_kernel_scalar<mixed_f32>,
+            dot_kernel_scalar<mixed_f32>, axpy_kernel_scalar<mixed_f32>, __builtin_cpu_supports("avx512f") != 0,
+            kernel_avx2_mixed<0>, small_avx2_mixed, csr_kernel_scalar<mixed_f32>,
+            dot_kernel_scalar<mixed_f32>, axpy_kernel_scalar<mixed_f32>, __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")};
+}
+
+// BLOCK_MATRIX_KERNEL=scalar|avx2 limits the choice (for testing narrower paths)
+template <typename T>
+static kernel_choice<T> detect_kernel()
+{
+    __builtin_cpu_init();
+
+    const char* limit = getenv("BLOCK_MATRIX_KERNEL");
+    bool allow_avx512 = limit == nullptr || *limit == '\0';
+    bool allow_avx2   = allow_avx512 || strcmp(limit, "avx2") == 0;
+
+    kernel_set<T> set = kernels_of<T>();
+    if (allow_avx512 && set.avx512_supported_)
+        return {set.avx512_, set.avx512_small_, set.avx512_csr_, set.avx512_dot_, set.avx512_axpy_, "avx512"};
+    if (allow_avx2 && set.avx2_supported_)
+        return {set.avx2_, set.avx2_small_, set.avx2_csr_, set.avx2_dot_, set.avx2_axpy_, "avx2"};
+
+    return {kernel_scalar<T, 0>, scalar_kernels<T>::small_, csr_kernel_scalar<T>, dot_kernel_scalar<T>,
+            axpy_kernel_scalar<T>, "scalar"};
+}
+
+template <typename T>
+static const kernel_choice<T>& chosen_kernel()
+{
+    static const kernel_choice<T> choice = detect_kernel<T>();
+    return choice;
+}
+
+template <typename T>
+micro_kernel_t<T> select_micro_kernel()
+{
+    return chosen_kernel<T>().kernel_;
+}
+
+template <typename T>
+micro_kernel_t<T> select_small_kernel(uint64_t num_k)
+{
+    if (num_k == 0 || num_k > SMALL_K_TILES)
+        return nullptr;
+    return chosen_kernel<T>().small_[num_k - 1];
+}
+
+template <typename T>
+csr_kernel_t<T> select_csr_kernel()
+{
+    return chosen_kernel<T>().csr_;
+}
+
+template <typename T>
+dot_kernel_t<T> select_dot_kernel()
+{
+    return chosen_kernel<T>().dot_;
+}
+
+template <typename T>
+axpy_kernel_t<T> select_axpy_kernel()
+{
+    return chosen_kernel<T>().axpy_;
+}
+
+template <typename T>
+const char* micro_kernel_name()
+{
+    return chosen_kernel<T>().name_;
+}
+
+template micro_kernel_t<double>  select_micro_kernel<double>();
+template micro_kernel_t<float>   select_micro_kernel<float>();
+template micro_kernel_t<int32_t> select_micro_kernel<int32_t>();
+template micro_kernel_t<int8_t>  select_micro_kernel<int8_t>();
+template micro_kernel_t<mixed_f32> select_micro_kernel<mixed_f32>();
+
+template micro_kernel_t<double>  select_small_kernel<double>(uint64_t);
+template micro_kernel_t<float>   select_small_kernel<float>(uint64_t);
+template micro_kernel_t<int32_t> select_small_kernel<int32_t>(uint64_t);
+template micro_kernel_t<int8_t>  select_small_kernel<int8_t>(uint64_t);
+template micro_kernel_t<mixed_f32> select_small_kernel<mixed_f32>(uint64_t);
+
+template csr_kernel_t<double>  select_csr_kernel<double>();
+template csr_kernel_t<float>   select_csr_kernel<float>();
+template csr_kernel_t<int32_t> select_csr_kernel<int32_t>();
+template csr_kernel_t<int8_t>  select_csr_kernel<int8_t>();
+
+template dot_kernel_t<double>  select_dot_kernel<double>();
+template dot_kernel_t<float>   select_dot_kernel<float>();
+template dot_kernel_t<int32_t> select_dot_kernel<int32_t>();
+template dot_kernel_t<int8_t>  select_dot_kernel<int8_t>();
+
+template axpy_kernel_t<double>  select_axpy_kernel<double>();
+template axpy_kernel_t<float>   select_axpy_kernel<float>();
+template axpy_kernel_t<int32_t> select_axpy_kernel<int32_t>();
+template axpy_kernel_t<int8_t>  select_axpy_kernel<int8_t>();
+
+template const char* micro_kernel_name<double>();
+template const char* micro_kernel_name<float>();
+template const char* micro_kernel_name<int32_t>();
+template const char* micro_kernel_name<int8_t>();
+template const char* micro_kernel_name<mixed_f32>();
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstdint>
+
+// Width of the widest vector register the kernels use (zmm), equal to a cache line
+const uint32_t VECTOR_BYTES = 64;
+
+// Products of T are summed in accumulator<T>::type: int8 would overflow after a few terms
+template <typename T> struct accumulator { typedef T type; };
+template <> struct accumulator<int8_t> { typedef int32_t type; };
+
+// Packed element of mixed precision double products (block_mult_options::mixed_precision_):
+// the tiles keep floats, half the traffic of double ones, the kernels widen them and
+// accumulate in double. C tiles are double, so the tiles are 8 x 8
+struct mixed_f32
+{
+    float value_;
+
+    mixed_f32() = default;
+    mixed_f32(double value): value_((float)value) {}
+    operator double() const { return value_; }
+};
+template <> struct accumulator<mixed_f32> { typedef double type; };
+
+// A row of C tile fills one vector register, so the tile is 8 x 8 for double and
+// 16 x 16 for float, int32 and int8 (accumulated in int32). A and B tiles of the
+// product have the same dimension as C tiles
+template <typename T>
+struct block_traits
+{
+    typedef typename accumulator<T>::type acc_t;
+
+    static constexpr uint32_t tile_dim  = VECTOR_BYTES / sizeof(acc_t);
+    static constexpr uint32_t tile_size = tile_dim * tile_dim;
+};
+
+// Tile dimension of double matrices (also used by tiled .matb files)
+const uint32_t KERNEL_DIM = block_traits<double>::tile_dim;
+
+// Register-blocked micro-kernel: computes one tile_dim x tile_dim tile of C
+// as the product of a row panel of A and a column panel of B.
+// A - num_k row-major A tiles placed one after another
+// B - num_k row-major (k x col) B tiles, B_stride elements from one to the next
+//     (tile size for packed B panels, a whole tile row for a tiled matrix)
+// C - row-major result tile, overwritten or accumulated into if accumulate is set
+template <typename T>
+using micro_kernel_t = void (*)(uint64_t num_k, const T* A, const T* B, uint64_t B_stride, typename block_traits<T>::acc_t* C, bool accumulate);
+
+// Picks the widest kernel for T supported by the running CPU (checked once by CPUID)
+template <typename T> micro_kernel_t<T> select_micro_kernel();
+template <typename T> const char*       micro_kernel_name();
+
+// The same kernel with num_k fixed at compile time (the k loop is fully known to
+// the compiler), for products of small matrices. nullptr for num_k out of [1, SMALL_K_TILES]
+const uint32_t SMALL_K_TILES = 16;
+template <typename T> micro_kernel_t<T> select_small_kernel(uint64_t num_k);
+
+// Sparse row kernel of csr_matrix::block_mult: C (tile_dim elements) = sum of
+// values[i] * row col_idx[i] of a B panel over count nonzeros. Row k of the panel
+// is row k % tile_dim of its tile k / tile_dim, B_stride elements from one tile to the next
+template <typename T>
+using csr_kernel_t = void (*)(uint64_t count, const uint32_t* col_idx, const T* values, const T* B, uint64_t B_stride,
+                              typename block_traits<T>::acc_t* C);
+
+template <typename T> csr_kernel_t<T> select_csr_kernel();
+
+// Vector kernels of gemv: dot product of count elements and y += alpha * a
+template <typename T>
+using dot_kernel_t = typename block_traits<T>::acc_t (*)(uint64_t count, const T* a, const T* b);
+template <typename T>
+using axpy_kernel_t = void (*)(uint64_t count, typename block_traits<T>::acc_t alpha, const T* a, typename block_traits<T>::acc_t* y);
+
+template <typename T> dot_kernel_t<T>  select_dot_kernel();
+template <typename T> axpy_kernel_t<T> select_axpy_kernel();
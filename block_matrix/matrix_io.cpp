@@ -0,0 +1,454 @@
+#include "matrix_io.hpp"
+#include "errors.hpp"
+#include "kernels.hpp"
+#include "thread_pool.hpp"
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <atomic>
+#include <charconv>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+bool is_matb_file(const char* file_name)
+{
+    FILE* input = fopen(file_name, "rb");
+    if (input == nullptr)
+        return false;
+
+    char magic[sizeof(MATB_MAGIC)] = {};
+    size_t ret = fread(magic, 1, sizeof(magic), input);
+    fclose(input);
+
+    return ret == sizeof(magic) && memcmp(magic, MATB_MAGIC, sizeof(magic)) == 0;
+}
+
+uint64_t matb_num_elements(const matb_header& header)
+{
+    if (header.layout_ == LAYOUT_TILED)
+    {
+        uint64_t tile_rows = (header.rows_ + header.tile_dim_ - 1) / header.tile_dim_;
+        uint64_t tile_cols = (header.cols_ + header.tile_dim_ - 1) / header.tile_dim_;
+        return tile_rows * tile_cols * header.tile_dim_ * header.tile_dim_;
+    }
+
+    return header.rows_ * header.cols_;
+}
+
+static int check_matb_header(const matb_header& header, uint64_t file_size)
+{
+    if (memcmp(header.magic_, MATB_MAGIC, sizeof(MATB_MAGIC)) != 0)
+    {
+        fprintf(stderr, "[check_matb_header] bad magic\n");
+        return E_FORMAT;
+    }
+    if (header.version_ != MATB_VERSION)
+    {
+        fprintf(stderr, "[check_matb_header] unsupported version %u\n", header.version_);
+        return E_FORMAT;
+    }
+    if (header.dtype_ != MATB_F64)
+    {
+        fprintf(stderr, "[check_matb_header] unsupported dtype %u\n", header.dtype_);
+        return E_FORMAT;
+    }
+    if (header.layout_ != LAYOUT_ROW_MAJOR && !(header.layout_ == LAYOUT_TILED && header.tile_dim_ != 0))
+    {
+        fprintf(stderr, "[check_matb_header] unsupported layout %u\n", header.layout_);
+        return E_FORMAT;
+    }
+    if (header.data_offset_ < sizeof(header) || header.data_offset_ % sizeof(double) != 0 ||
+        file_size < header.data_offset_ || (file_size - header.data_offset_) / sizeof(double) < matb_num_elements(header))
+    {
+        fprintf(stderr, "[check_matb_header] file is shorter than its data\n");
+        return E_FORMAT;
+    }
+
+    return E_SUCCESS;
+}
+
+int map_matb_file(const char* file_name, matb_header* header, void** mapping, size_t* mapping_size, double** data)
+{
+    errno = 0;
+    int fd = open(file_name, O_RDONLY);
+    if (fd < 0)
+    {
+        perror("[map_matb_file] open file error\n");
+        return E_OPEN;
+    }
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || (uint64_t)file_stat.st_size < sizeof(*header))
+    {
+        fprintf(stderr, "[map_matb_file] can't get size of %s or it is too short\n", file_name);
+        close(fd);
+        return E_FORMAT;
+    }
+
+    // private writable mapping: the matrix may be changed without touching the file
+    void* base = mmap(nullptr, file_stat.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        perror("[map_matb_file] mmap error\n");
+        return E_BADALLOC;
+    }
+
+    memcpy(header, base, sizeof(*header));
+    int err = check_matb_header(*header, file_stat.st_size);
+    if (err != E_SUCCESS)
+    {
+        munmap(base, file_stat.st_size);
+        return err;
+    }
+
+    // packing walks the data front to back
+    madvise(base, file_stat.st_size, MADV_SEQUENTIAL);
+
+    *mapping      = base;
+    *mapping_size = file_stat.st_size;
+    *data         = (double*)((char*)base + header->data_offset_);
+
+    return E_SUCCESS;
+}
+
+static void fill_matb_header(matb_header* header, uint64_t rows, uint64_t cols, matrix_layout layout)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic_, MATB_MAGIC, sizeof(MATB_MAGIC));
+    header->version_     = MATB_VERSION;
+    header->dtype_       = MATB_F64;
+    header->layout_      = layout;
+    header->alignment_   = MATB_DEF_ALIGNMENT;
+    header->tile_dim_    = (layout == LAYOUT_TILED) ? KERNEL_DIM : 0;
+    header->rows_        = rows;
+    header->cols_        = cols;
+    header->data_offset_ = MATB_DEF_ALIGNMENT;
+}
+
+int create_matb_file(const char* file_name, uint64_t rows, uint64_t cols, int* fd, uint64_t* data_offset)
+{
+    matb_header header;
+    fill_matb_header(&header, rows, cols, LAYOUT_ROW_MAJOR);
+
+    errno = 0;
+    int out = open(file_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (out < 0)
+    {
+        perror("[create_matb_file] open file error\n");
+        return E_OPEN;
+    }
+
+    if (pwrite(out, &header, sizeof(header), 0) != sizeof(header) ||
+        ftruncate(out, header.data_offset_ + rows * cols * sizeof(double)) != 0)
+    {
+        perror("[create_matb_file] write error\n");
+        close(out);
+        return E_ERROR;
+    }
+
+    *fd          = out;
+    *data_offset = header.data_offset_;
+    return E_SUCCESS;
+}
+
+int write_matb_file(const char* file_name, const double* data, uint64_t rows, uint64_t cols, matrix_layout layout)
+{
+    matb_header header;
+    fill_matb_header(&header, rows, cols, layout);
+
+    errno = 0;
+    FILE* output = fopen(file_name, "wb");
+    if (output == nullptr)
+    {
+        perror("[write_matb_file] fopen file error\n");
+        return E_OPEN;
+    }
+
+    std::vector<char> padding(header.data_offset_ - sizeof(header), 0);
+    bool ok = fwrite(&header, sizeof(header), 1, output) == 1 &&
+              fwrite(padding.data(), 1, padding.size(), output) == padding.size();
+
+    if (layout == LAYOUT_ROW_MAJOR)
+    {
+        ok = ok && fwrite(data, sizeof(double), rows * cols, output) == rows * cols;
+    }
+    else
+    {
+        // one row of tiles is assembled at a time
+        uint64_t tile_dim  = header.tile_dim_;
+        uint64_t tile_cols = (cols + tile_dim - 1) / tile_dim;
+        std::vector<double> tile_row(tile_cols * tile_dim * tile_dim);
+
+        for (uint64_t row_first = 0; ok && row_first < rows; row_first += tile_dim)
+        {
+            std::fill(tile_row.begin(), tile_row.end(), 0.0);
+
+            uint64_t num_rows = std::min(tile_dim, rows - row_first);
+            for (uint64_t row = 0; row < num_rows; row++)
+                for (uint64_t col = 0; col < cols; col++)
+                    tile_row[(col / tile_dim) * tile_dim * tile_dim + row * tile_dim + col % tile_dim] = data[(row_first + row) * cols + col];
+
+            ok = fwrite(tile_row.data(), sizeof(double), tile_row.size(), output) == tile_row.size();
+        }
+    }
+
+    if (fclose(output) != 0)
+        ok = false;
+    if (!ok)
+    {
+        perror("[write_matb_file] write error\n");
+        return E_ERROR;
+    }
+
+    return E_SUCCESS;
+}
+
+// Chunks per thread for the text reader/writer, more chunks - better balance
+static const uint64_t TEXT_CHUNKS_PER_THREAD = 4;
+static const uint64_t TEXT_MIN_CHUNK_BYTES   = 1 << 16;
+static const uint64_t TEXT_WRITE_CHUNK_ELEMS = 1 << 16;
+// enough for the shortest round trip form of any double and a separator
+static const uint64_t TEXT_MAX_ELEM_CHARS    = 32;
+
+static bool is_space(char c)
+{
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static const char* skip_spaces(const char* cur, const char* end)
+{
+    while (cur < end && is_space(*cur))
+        cur++;
+    return cur;
+}
+
+static uint64_t count_tokens(const char* cur, const char* end)
+{
+    uint64_t num_tokens = 0;
+    bool in_token = false;
+    for (; cur < end; cur++)
+    {
+        bool space = is_space(*cur);
+        if (!space && !in_token)
+            num_tokens++;
+        in_token = !space;
+    }
+
+    return num_tokens;
+}
+
+// Parses all numbers of [cur, end) into data, false on a bad token
+static bool parse_tokens(const char* cur, const char* end, double* data)
+{
+    while (true)
+    {
+        cur = skip_spaces(cur, end);
+        if (cur == end)
+            return true;
+
+        // from_chars doesn't take a leading '+', fscanf used to
+        if (*cur == '+' && cur + 1 < end && !is_space(cur[1]))
+            cur++;
+
+        std::from_chars_result res = std::from_chars(cur, end, *data);
+        if (res.ec != std::errc() || (res.ptr != end && !is_space(*res.ptr)))
+            return false;
+
+        cur = res.ptr;
+        data++;
+    }
+}
+
+static bool parse_dim(const char** cur, const char* end, uint64_t* dim)
+{
+    *cur = skip_spaces(*cur, end);
+    std::from_chars_result res = std::from_chars(*cur, end, *dim);
+    if (res.ec != std::errc() || (res.ptr != end && !is_space(*res.ptr)))
+        return false;
+
+    *cur = res.ptr;
+    return true;
+}
+
+int read_matr_text(const char* file_name, double** data, uint64_t* rows, uint64_t* cols)
+{
+    errno = 0;
+    int fd = open(file_name, O_RDONLY);
+    if (fd < 0)
+    {
+        perror("[read_matr_text] open file errror\n");
+        return E_OPEN;
+    }
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0)
+    {
+        fprintf(stderr, "[read_matr_text] can't get size of %s or it is empty\n", file_name);
+        close(fd);
+        return E_FORMAT;
+    }
+
+    uint64_t file_size = file_stat.st_size;
+    char* text = (char*)mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (text == MAP_FAILED)
+    {
+        perror("[read_matr_text] mmap error\n");
+        return E_BADALLOC;
+    }
+    madvise(text, file_size, MADV_WILLNEED);
+
+    const char* cur = text;
+    const char* end = text + file_size;
+    uint64_t num_rows = 0;
+    uint64_t num_cols = 0;
+    if (!parse_dim(&cur, end, &num_rows) || !parse_dim(&cur, end, &num_cols))
+    {
+        fprintf(stderr, "[read_matr_text] can't read number of rows/columns\n");
+        munmap(text, file_size);
+        return E_FORMAT;
+    }
+
+    thread_pool& pool = thread_pool::instance();
+    long int num_threads = pool.num_workers() + 1;
+
+    // chunks are cut right after a newline, so no number is split between them
+    uint64_t body_size  = end - cur;
+    uint64_t num_chunks = std::max<uint64_t>(1, std::min<uint64_t>(num_threads * TEXT_CHUNKS_PER_THREAD, body_size / TEXT_MIN_CHUNK_BYTES));
+    std::vector<const char*> bounds(num_chunks + 1);
+    bounds[0]          = cur;
+    bounds[num_chunks] = end;
+    for (uint64_t i = 1; i < num_chunks; i++)
+    {
+        const char* nominal = std::max(bounds[i - 1], cur + i * body_size / num_chunks);
+        const char* newline = (const char*)memchr(nominal, '\n', end - nominal);
+        bounds[i] = (newline == nullptr) ? end : newline + 1;
+    }
+
+    std::vector<uint64_t> offsets(num_chunks + 1, 0);
+    pool.run(num_chunks, num_threads, [&](uint64_t chunk) { offsets[chunk + 1] = count_tokens(bounds[chunk], bounds[chunk + 1]); });
+    for (uint64_t i = 0; i < num_chunks; i++)
+        offsets[i + 1] += offsets[i];
+
+    if (offsets[num_chunks] != num_rows * num_cols)
+    {
+        fprintf(stderr, "[read_matr_text] Bad input matrix format: %lu numbers instead of %lu\n", offsets[num_chunks], num_rows * num_cols);
+        munmap(text, file_size);
+        return E_FORMAT;
+    }
+
+    double* buffer = nullptr;
+    try
+    {
+        buffer = new double[num_rows * num_cols];
+    }
+    catch (std::exception& error)
+    {
+        fprintf(stderr, "[read_matr_text] Bad alloc array for data\n");
+        munmap(text, file_size);
+        return E_BADALLOC;
+    }
+
+    std::atomic<bool> parsed(true);
+    pool.run(num_chunks, num_threads, [&](uint64_t chunk)
+    {
+        if (!parse_tokens(bounds[chunk], bounds[chunk + 1], buffer + offsets[chunk]))
+            parsed.store(false, std::memory_order_relaxed);
+    });
+    munmap(text, file_size);
+
+    if (!parsed.load())
+    {
+        fprintf(stderr, "[read_matr_text] Bad input matrix format: not a number\n");
+        delete[] buffer;
+        return E_FORMAT;
+    }
+
+    *data = buffer;
+    *rows = num_rows;
+    *cols = num_cols;
+
+    return E_SUCCESS;
+}
+
+// Prints rows [first, last) into out, returns number of chars
+static uint64_t format_rows(const double* data, uint64_t cols, uint64_t first, uint64_t last, char* out)
+{
+    char* cur = out;
+    for (uint64_t row = first; row < last; row++)
+        for (uint64_t col = 0; col < cols; col++)
+        {
+            std::to_chars_result res = std::to_chars(cur, cur + TEXT_MAX_ELEM_CHARS - 1, data[row * cols + col]);
+            cur    = res.ptr;
+            *cur++ = (col != cols - 1) ? ' ' : '\n';
+        }
+
+    return cur - out;
+}
+
+int write_matr_text(const char* file_name, const double* data, uint64_t rows, uint64_t cols)
+{
+    errno = 0;
+    int fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        perror("[write_matr_text] open file error\n");
+        return E_OPEN;
+    }
+
+    char header[64];
+    int header_size = snprintf(header, sizeof(header), "%lu\n%lu\n", rows, cols);
+    if (pwrite(fd, header, header_size, 0) != header_size)
+    {
+        perror("[write_matr_text] write error\n");
+        close(fd);
+        return E_ERROR;
+    }
+
+    thread_pool& pool = thread_pool::instance();
+    uint64_t num_slots = pool.num_workers() + 1;
+
+    // every slot formats a chunk of rows into its own buffer, the buffers are
+    // reused round after round and land in the file in parallel via pwrite
+    uint64_t chunk_rows = std::max<uint64_t>(1, TEXT_WRITE_CHUNK_ELEMS / std::max<uint64_t>(1, cols));
+    std::vector<std::vector<char>> buffers(num_slots, std::vector<char>(chunk_rows * cols * TEXT_MAX_ELEM_CHARS));
+    std::vector<uint64_t> sizes(num_slots);
+    std::vector<uint64_t> offsets(num_slots);
+    std::atomic<bool> written(true);
+
+    uint64_t file_offset = header_size;
+    for (uint64_t round_first = 0; round_first < rows && cols != 0; round_first += num_slots * chunk_rows)
+    {
+        uint64_t num_chunks = std::min(num_slots, (rows - round_first + chunk_rows - 1) / chunk_rows);
+
+        pool.run(num_chunks, num_slots, [&](uint64_t slot)
+        {
+            uint64_t first = round_first + slot * chunk_rows;
+            uint64_t last  = std::min(first + chunk_rows, rows);
+            sizes[slot] = format_rows(data, cols, first, last, buffers[slot].data());
+        });
+
+        for (uint64_t slot = 0; slot < num_chunks; slot++)
+        {
+            offsets[slot] = file_offset;
+            file_offset  += sizes[slot];
+        }
+
+        pool.run(num_chunks, num_slots, [&](uint64_t slot)
+        {
+            if (pwrite(fd, buffers[slot].data(), sizes[slot], offsets[slot]) != (ssize_t)sizes[slot])
+                written.store(false, std::memory_order_relaxed);
+        });
+    }
+
+    if (close(fd) != 0 || !written.load())
+    {
+        perror("[write_matr_text] write error\n");
+        return E_ERROR;
+    }
+
+    return E_SUCCESS;
+}
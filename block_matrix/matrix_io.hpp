@@ -0,0 +1,56 @@
+#pragma once
+
+#include "block_matrix.hpp"
+#include <cstddef>
+#include <cstdint>
+
+// Binary matrix file (.matb): 64 byte header followed by raw little-endian
+// elements starting at data_offset_, which is a multiple of alignment_.
+// LAYOUT_ROW_MAJOR - rows_ x cols_ elements,
+// LAYOUT_TILED     - grid of tile_dim_ x tile_dim_ row-major tiles in row-major
+//                    order, edge tiles are padded with zeros
+const char     MATB_MAGIC[4]     = {'M', 'A', 'T', 'B'};
+const uint16_t MATB_VERSION      = 1;
+const uint32_t MATB_DEF_ALIGNMENT = 4096;
+
+enum matb_dtype
+{
+    MATB_F64 = 1,
+};
+
+struct matb_header
+{
+    char     magic_[4];
+    uint16_t version_;
+    uint8_t  dtype_;
+    uint8_t  layout_;
+    uint32_t alignment_;
+    uint32_t tile_dim_;
+    uint64_t rows_;
+    uint64_t cols_;
+    uint64_t data_offset_;
+    uint8_t  reserved_[24];
+};
+
+static_assert(sizeof(matb_header) == 64, "matb header must be 64 bytes");
+
+bool is_matb_file(const char* file_name);
+
+// Elements stored in the file after the header (tiles are counted with padding)
+uint64_t matb_num_elements(const matb_header& header);
+
+// Maps the whole file privately (writes stay in memory), *data points to the first element
+int map_matb_file(const char* file_name, matb_header* header, void** mapping, size_t* mapping_size, double** data);
+
+int write_matb_file(const char* file_name, const double* data, uint64_t rows, uint64_t cols, matrix_layout layout);
+
+// Creates row-major file of full size with the header only, data is written by the caller at *data_offset
+int create_matb_file(const char* file_name, uint64_t rows, uint64_t cols, int* fd, uint64_t* data_offset);
+
+// Text .matr file: number of rows and columns, then rows x cols numbers separated
+// by whitespace. Both functions split the work over thread_pool::instance() and
+// use std::from_chars / std::to_chars, so they don't depend on the locale.
+// The reader maps the file and cuts it at newlines; the writer prints the
+// shortest representation that reads back to the same double
+int read_matr_text(const char* file_name, double** data, uint64_t* rows, uint64_t* cols);
+int write_matr_text(const char* file_name, const double* data, uint64_t rows, uint64_t cols);
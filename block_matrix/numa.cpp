@@ -0,0 +1,173 @@
+#include "numa.hpp"
+#include "thread_pool.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <dirent.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+// Parses cpulist format of sysfs: "0-3,8,10-11"
+static std::vector<int> read_cpu_list(const char* file_name)
+{
+    std::vector<int> cpus;
+
+    FILE* input = fopen(file_name, "r");
+    if (input == nullptr)
+        return cpus;
+
+    int first = 0;
+    while (fscanf(input, "%d", &first) == 1)
+    {
+        int last = first;
+        int separator = fgetc(input);
+        if (separator == '-')
+        {
+            if (fscanf(input, "%d", &last) != 1)
+                break;
+            separator = fgetc(input);
+        }
+
+        for (int cpu = first; cpu <= last; cpu++)
+            cpus.push_back(cpu);
+
+        if (separator != ',')
+            break;
+    }
+    fclose(input);
+
+    return cpus;
+}
+
+static numa_topology read_numa_topology()
+{
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            CPU_SET(cpu, &allowed);
+
+    std::vector<int> ids;
+    DIR* dir = opendir("/sys/devices/system/node");
+    if (dir != nullptr)
+    {
+        struct dirent* entry = nullptr;
+        while ((entry = readdir(dir)) != nullptr)
+        {
+            int id = 0;
+            char tail = 0;
+            if (sscanf(entry->d_name, "node%d%c", &id, &tail) == 1)
+                ids.push_back(id);
+        }
+        closedir(dir);
+    }
+    std::sort(ids.begin(), ids.end());
+
+    numa_topology topology;
+    for (size_t i = 0; i < ids.size(); i++)
+    {
+        char file_name[128];
+        snprintf(file_name, sizeof(file_name), "/sys/devices/system/node/node%d/cpulist", ids[i]);
+
+        std::vector<int> cpus;
+        for (int cpu : read_cpu_list(file_name))
+            if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+                cpus.push_back(cpu);
+
+        // memory-only nodes get no workers
+        if (cpus.empty())
+            continue;
+
+        topology.node_ids_.push_back(ids[i]);
+        topology.node_cpus_.push_back(cpus);
+    }
+
+    if (topology.node_cpus_.empty())
+    {
+        std::vector<int> cpus;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            if (CPU_ISSET(cpu, &allowed))
+                cpus.push_back(cpu);
+
+        topology.node_ids_.push_back(0);
+        topology.node_cpus_.push_back(cpus);
+    }
+
+    for (size_t node = 0; node < topology.node_cpus_.size(); node++)
+        for (int cpu : topology.node_cpus_[node])
+        {
+            if ((size_t)cpu >= topology.cpu_node_.size())
+                topology.cpu_node_.resize(cpu + 1, -1);
+            topology.cpu_node_[cpu] = node;
+        }
+
+    return topology;
+}
+
+const numa_topology& get_numa_topology()
+{
+    static const numa_topology topology = read_numa_topology();
+    return topology;
+}
+
+int current_numa_node()
+{
+    const numa_topology& topology = get_numa_topology();
+
+    int cpu = sched_getcpu();
+    if (cpu < 0 || (size_t)cpu >= topology.cpu_node_.size() || topology.cpu_node_[cpu] < 0)
+        return 0;
+
+    return topology.cpu_node_[cpu];
+}
+
+void query_page_nodes(const void* const* addresses, uint64_t count, int* nodes)
+{
+    const numa_topology& topology = get_numa_topology();
+    uint64_t page = sysconf(_SC_PAGESIZE);
+
+    std::vector<void*> pages(count);
+    for (uint64_t i = 0; i < count; i++)
+        pages[i] = (void*)((uint64_t)addresses[i] / page * page);
+
+    // move_pages without target nodes only reports where the pages are
+    std::vector<int> status(count, -1);
+    if (count != 0 && syscall(SYS_move_pages, 0, count, pages.data(), nullptr, status.data(), 0) != 0)
+        std::fill(status.begin(), status.end(), -1);
+
+    for (uint64_t i = 0; i < count; i++)
+    {
+        nodes[i] = -1;
+        for (size_t node = 0; node < topology.node_ids_.size(); node++)
+            if (status[i] == topology.node_ids_[node])
+                nodes[i] = node;
+    }
+}
+
+static std::vector<int> interleaved_cpus()
+{
+    const numa_topology& topology = get_numa_topology();
+
+    std::vector<int> cpus;
+    for (size_t i = 0; ; i++)
+    {
+        size_t before = cpus.size();
+        for (size_t node = 0; node < topology.node_cpus_.size(); node++)
+            if (i < topology.node_cpus_[node].size())
+                cpus.push_back(topology.node_cpus_[node][i]);
+
+        if (cpus.size() == before)
+            break;
+    }
+
+    return cpus;
+}
+
+thread_pool& numa_thread_pool()
+{
+    static std::vector<int> cpus = interleaved_cpus();
+    static thread_pool pool((long int)cpus.size() - 1, cpus);
+    return pool;
+}
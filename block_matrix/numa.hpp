@@ -0,0 +1,32 @@
+#pragma once
+
+// NUMA topology and page placement queries of the NUMA mode of block_mult
+
+#include <cstdint>
+#include <vector>
+
+class thread_pool;
+
+// Nodes are numbered densely in the order of /sys/devices/system/node/node*,
+// only cpus the process may run on are listed. Without the sysfs directory
+// the machine is one node with all cpus
+struct numa_topology
+{
+    std::vector<int>              node_ids_;  // kernel number of every node
+    std::vector<std::vector<int>> node_cpus_;
+    std::vector<int>              cpu_node_; // index - cpu, -1 for cpus the process can't use
+};
+
+const numa_topology& get_numa_topology();
+
+// Node of the cpu the calling thread runs on right now
+int current_numa_node();
+
+// nodes[i] - node (dense number) of the page holding addresses[i], -1 if the
+// page isn't placed yet or the kernel can't tell
+void query_page_nodes(const void* const* addresses, uint64_t count, int* nodes);
+
+// Process-wide pool of the NUMA mode: a worker per usable cpu (the caller is
+// the last one), worker i is pinned to the i-th cpu taken from nodes in turn,
+// so the workers are spread evenly over all nodes
+thread_pool& numa_thread_pool();
@@ -0,0 +1,68 @@
+#include "perf_counters.hpp"
+#include <cstring>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+static int open_counter(uint32_t type, uint64_t config)
+{
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size           = sizeof(attr);
+    attr.type           = type;
+    attr.config         = config;
+    attr.disabled       = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+
+    // fails without PMU access (perf_event_paranoid, containers, VMs): the counter is skipped
+    int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd < 0)
+        return -1;
+
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    return fd;
+}
+
+static int64_t read_counter(int fd)
+{
+    if (fd < 0)
+        return -1;
+
+    uint64_t value = 0;
+    if (read(fd, &value, sizeof(value)) != sizeof(value))
+        return -1;
+    return value;
+}
+
+void perf_counters_open(perf_counters* counters)
+{
+    counters->cycles_fd_ = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    counters->llc_misses_fd_ = open_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                                                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    counters->dtlb_misses_fd_ = open_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                                                 (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+}
+
+void perf_counters_read(const perf_counters* counters, int64_t* cycles, int64_t* llc_misses, int64_t* dtlb_misses)
+{
+    *cycles      = read_counter(counters->cycles_fd_);
+    *llc_misses  = read_counter(counters->llc_misses_fd_);
+    *dtlb_misses = read_counter(counters->dtlb_misses_fd_);
+}
+
+void perf_counters_close(perf_counters* counters)
+{
+    if (counters->cycles_fd_ >= 0)
+        close(counters->cycles_fd_);
+    if (counters->llc_misses_fd_ >= 0)
+        close(counters->llc_misses_fd_);
+    if (counters->dtlb_misses_fd_ >= 0)
+        close(counters->dtlb_misses_fd_);
+
+    counters->cycles_fd_      = -1;
+    counters->llc_misses_fd_  = -1;
+    counters->dtlb_misses_fd_ = -1;
+}
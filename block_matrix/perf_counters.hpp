@@ -0,0 +1,18 @@
+#pragma once
+
+// Hardware counters of the calling thread through perf_event_open
+
+#include <cstdint>
+
+struct perf_counters
+{
+    int cycles_fd_;     // -1 if the counter couldn't be opened
+    int llc_misses_fd_;
+    int dtlb_misses_fd_; // data TLB load misses (page walks)
+};
+
+// Opens and starts the counters for the calling thread (user space only)
+void perf_counters_open(perf_counters* counters);
+// Values counted since perf_counters_open, -1 for counters that aren't open
+void perf_counters_read(const perf_counters* counters, int64_t* cycles, int64_t* llc_misses, int64_t* dtlb_misses);
+void perf_counters_close(perf_counters* counters);
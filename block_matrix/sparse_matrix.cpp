@@ -0,0 +1,165 @@
+#include "sparse_matrix.hpp"
+#include "block_internal.hpp"
+#include "errors.hpp"
+#include "thread_pool.hpp"
+#include <cstdio>
+#include <cstring>
+#include <limits>
+
+// Row ranges per thread: threads finishing early take ranges of the slow ones
+static const uint64_t RANGES_PER_THREAD = 4;
+
+template <typename T>
+basic_csr_matrix<T>::basic_csr_matrix(uint64_t col, uint64_t row, std::vector<uint64_t> row_ptr, std::vector<uint32_t> col_idx,
+                                      std::vector<T> values):
+    columns_(col),
+    rows_(row),
+    row_ptr_(std::move(row_ptr)),
+    col_idx_(std::move(col_idx)),
+    values_(std::move(values))
+{
+    if (columns_ > std::numeric_limits<uint32_t>::max())
+        throw std::invalid_argument("[csr_matrix] too many columns for 32-bit column indices\n");
+    if (row_ptr_.size() != rows_ + 1 || row_ptr_[0] != 0 || row_ptr_[rows_] != values_.size() ||
+        col_idx_.size() != values_.size())
+        throw std::invalid_argument("[csr_matrix] inconsistent sizes of CSR arrays\n");
+
+    for (uint64_t i = 0; i < rows_; i++)
+        if (row_ptr_[i] > row_ptr_[i + 1])
+            throw std::invalid_argument("[csr_matrix] decreasing row offsets\n");
+    for (uint32_t index : col_idx_)
+        if (index >= columns_)
+            throw std::invalid_argument("[csr_matrix] column index out of matrix\n");
+}
+
+template <typename T>
+basic_csr_matrix<T>::basic_csr_matrix(const basic_matrix<T>& dense):
+    columns_(dense.columns()),
+    rows_(dense.rows()),
+    row_ptr_(1, 0)
+{
+    if (columns_ > std::numeric_limits<uint32_t>::max())
+        throw std::invalid_argument("[csr_matrix] too many columns for 32-bit column indices\n");
+
+    const T* data = dense.data();
+    row_ptr_.reserve(rows_ + 1);
+    for (uint64_t row = 0; row < rows_; row++)
+    {
+        for (uint64_t col = 0; col < columns_; col++)
+            if (data[row * columns_ + col] != T(0))
+            {
+                col_idx_.push_back(col);
+                values_.push_back(data[row * columns_ + col]);
+            }
+        row_ptr_.push_back(values_.size());
+    }
+}
+
+// Bounds of at most num_ranges row ranges of about the same cost, a row costs
+// its nonzeros and one more for writing it. A row is never split, so a heavy
+// row makes its range longer
+static std::vector<uint64_t> split_by_nonzeros(const std::vector<uint64_t>& row_ptr, uint64_t num_ranges)
+{
+    uint64_t num_rows = row_ptr.size() - 1;
+    uint64_t total    = row_ptr[num_rows] + num_rows;
+
+    std::vector<uint64_t> bounds(1, 0);
+    uint64_t range = 1;
+    for (uint64_t row = 1; row < num_rows && range < num_ranges; row++)
+        if (row_ptr[row] + row >= total * range / num_ranges)
+        {
+            bounds.push_back(row);
+            while (range < num_ranges && row_ptr[row] + row >= total * range / num_ranges)
+                range++;
+        }
+    bounds.push_back(num_rows);
+
+    return bounds;
+}
+
+// C rows [first_row, last_row) = A rows * B, a panel of tile_dim columns of C at a
+// time: the panel of B stays in cache for all the rows, a piece of C row - in registers.
+// Tile of B rows k_tile * tile_dim.. in the panel is tile k_tile * k_step + panel * panel_step
+template <typename T>
+static void csr_rows_product(const uint64_t* row_ptr, const uint32_t* col_idx, const T* values, uint64_t first_row,
+                             uint64_t last_row, const matrix_of_blocks<T>* B, bool B_transposed, uint64_t N,
+                             typename block_traits<T>::acc_t* C)
+{
+    typedef typename block_traits<T>::acc_t acc_t;
+    uint64_t dim  = block_traits<T>::tile_dim;
+    uint64_t size = block_traits<T>::tile_size;
+
+    csr_kernel_t<T> kernel = select_csr_kernel<T>();
+    uint64_t k_step     = B_transposed ? 1 : B->cols_;
+    uint64_t panel_step = B_transposed ? B->cols_ : 1;
+    uint64_t num_panels = (N + dim - 1) / dim;
+
+    alignas(CACHE_LINE_SIZE) acc_t edge[block_traits<T>::tile_dim];
+    for (uint64_t panel = 0; panel < num_panels; panel++)
+    {
+        const T* panel_tiles = B->data_ + panel * panel_step * size;
+        uint64_t width = std::min(dim, N - panel * dim);
+
+        for (uint64_t row = first_row; row < last_row; row++)
+        {
+            // the last panel of C is narrower than the kernel writes
+            acc_t* dest = (width == dim) ? C + row * N + panel * dim : edge;
+            kernel(row_ptr[row + 1] - row_ptr[row], col_idx + row_ptr[row], values + row_ptr[row], panel_tiles,
+                   k_step * size, dest);
+            if (width != dim)
+                memcpy(C + row * N + panel * dim, edge, width * sizeof(acc_t));
+        }
+    }
+}
+
+template <typename T>
+basic_matrix<typename accumulator<T>::type> basic_csr_matrix<T>::block_mult(basic_matrix<T>& B, long int num_threads,
+                                                                            thread_pool* pool) const
+{
+    if (B.rows_ != columns_)
+        throw std::invalid_argument("[csr_matrix::block_mult] incompatible matrix format\n");
+    if (num_threads < 0)
+        throw std::invalid_argument("[csr_matrix::block_mult] negative number of threads\n");
+
+    uint64_t N = B.columns_;
+    if (values_.empty() || N == 0)
+        return basic_matrix<acc_t>(N, rows_, acc_t(0));
+
+    if (num_threads == 0)
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    thread_pool& workers = (pool != nullptr) ? *pool : thread_pool::instance();
+    workers.reserve(num_threads);
+
+    // a tiled B is read in place
+    matrix_of_blocks<T>* B_tiles = B.tiled_;
+    if (B_tiles == nullptr)
+        B_tiles = produce_trans_block(N, columns_, B.data_, N, num_threads, &workers);
+    if (B_tiles == nullptr)
+        throw std::runtime_error("[csr_matrix::block_mult] multiplication returned error " + std::to_string(E_BADALLOC) + "\n");
+
+    basic_matrix<acc_t> C(N, rows_);
+    std::vector<uint64_t> bounds = split_by_nonzeros(row_ptr_, num_threads * RANGES_PER_THREAD);
+    try
+    {
+        workers.run(bounds.size() - 1, num_threads, [&](uint64_t range)
+        {
+            csr_rows_product(row_ptr_.data(), col_idx_.data(), values_.data(), bounds[range], bounds[range + 1], B_tiles,
+                             B.tiled_ == nullptr, N, C.data_);
+        });
+    }
+    catch (...)
+    {
+        if (B.tiled_ == nullptr)
+            block_distruct(B_tiles);
+        throw;
+    }
+
+    if (B.tiled_ == nullptr)
+        block_distruct(B_tiles);
+    return C;
+}
+
+template class basic_csr_matrix<double>;
+template class basic_csr_matrix<float>;
+template class basic_csr_matrix<int32_t>;
+template class basic_csr_matrix<int8_t>;
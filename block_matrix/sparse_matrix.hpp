@@ -0,0 +1,52 @@
+#pragma once
+
+// Compressed sparse row (CSR) matrices and their products with dense matrices
+
+#include "block_matrix.hpp"
+#include <cstdint>
+#include <vector>
+
+class thread_pool;
+
+// rows x columns matrix of float, double, int32 or int8 elements: nonzeros of
+// row i are values_[row_ptr_[i]] .. values_[row_ptr_[i + 1] - 1], in columns
+// col_idx_[] of the same positions
+template <typename T>
+class basic_csr_matrix
+{
+    typedef typename accumulator<T>::type acc_t;
+
+    uint64_t columns_;
+    uint64_t rows_;
+
+    std::vector<uint64_t> row_ptr_; // rows_ + 1 offsets
+    std::vector<uint32_t> col_idx_;
+    std::vector<T>        values_;
+public:
+     basic_csr_matrix(uint64_t col, uint64_t row, std::vector<uint64_t> row_ptr, std::vector<uint32_t> col_idx,
+                      std::vector<T> values);
+     // Nonzero elements of a dense matrix
+     explicit basic_csr_matrix(const basic_matrix<T>& dense);
+     basic_csr_matrix() = delete;
+
+     uint64_t rows() const { return rows_; }
+     uint64_t columns() const { return columns_; }
+     uint64_t nonzeros() const { return values_.size(); }
+
+     const uint64_t* row_ptr() const { return row_ptr_.data(); }
+     const uint32_t* col_idx() const { return col_idx_.data(); }
+     const T*        values() const { return values_.data(); }
+
+     // Dense row-major product this * B. B is taken as the transposed tile grid of
+     // block_mult (a tiled B is read in place), where a panel of tile_dim columns
+     // is a contiguous strip: every nonzero adds one vector-wide row of the strip
+     // to the panel piece of its C row. Rows are split into ranges of about the
+     // same nonzero count, several per thread, which threads take as they finish.
+     // num_threads == 0 takes hardware concurrency, pool == nullptr - thread_pool::instance()
+     basic_matrix<acc_t> block_mult(basic_matrix<T>& B, long int num_threads, thread_pool* pool = nullptr) const;
+};
+
+typedef basic_csr_matrix<double>  csr_matrix;
+typedef basic_csr_matrix<float>   csr_matrix_f32;
+typedef basic_csr_matrix<int32_t> csr_matrix_i32;
+typedef basic_csr_matrix<int8_t>  csr_matrix_i8;
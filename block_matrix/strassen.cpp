@@ -0,0 +1,297 @@
+#include "block_matrix.hpp"
+#include "block_internal.hpp"
+#include "errors.hpp"
+#include "thread_pool.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+// Deeper recursion saves little and the rounding error grows with every level
+static const int STRASSEN_MAX_DEPTH = 4;
+
+// Elementwise passes shorter than this are not split between threads
+static const uint64_t STRASSEN_PAR_ELEMS = 1 << 16;
+
+// Row-major view of a matrix part
+template <typename T>
+struct strassen_view
+{
+    T*       data_;
+    uint64_t ld_;
+};
+
+template <typename T>
+static strassen_view<T> quarter(strassen_view<T> whole, uint64_t half_rows, uint64_t half_cols, int row, int col)
+{
+    strassen_view<T> part = {whole.data_ + row * half_rows * whole.ld_ + col * half_cols, whole.ld_};
+    return part;
+}
+
+// Workspace of one recursion level (S1..S4, T1..T4, P1, P6, P7) and of its 7 children
+static uint64_t workspace_size(uint64_t M, uint64_t K, uint64_t N, int depth)
+{
+    if (depth == 0)
+        return 0;
+
+    uint64_t hm = M / 2;
+    uint64_t hk = K / 2;
+    uint64_t hn = N / 2;
+    return 4 * hm * hk + 4 * hk * hn + 3 * hm * hn + 7 * workspace_size(hm, hk, hn, depth - 1);
+}
+
+// Runs func(first_row, last_row) over row chunks on the pool for large passes
+template <typename Func>
+static void for_rows(thread_pool& pool, long int num_threads, uint64_t rows, uint64_t cols, const Func& func)
+{
+    uint64_t num_chunks = std::min<uint64_t>(num_threads, rows * cols / STRASSEN_PAR_ELEMS);
+    if (num_chunks <= 1)
+    {
+        func(0, rows);
+        return;
+    }
+
+    pool.run(num_chunks, num_threads, [&](uint64_t chunk)
+    {
+        func(rows * chunk / num_chunks, rows * (chunk + 1) / num_chunks);
+    });
+}
+
+template <typename T>
+static int strassen_level(strassen_view<T> A, strassen_view<T> B, strassen_view<T> C, uint64_t M, uint64_t K, uint64_t N,
+                          int depth, T* workspace, thread_pool& pool, long int num_threads,
+                          const block_mult_options& options)
+{
+    if (depth == 0)
+        return block_mult_view(A.data_, A.ld_, B.data_, B.ld_, C.data_, C.ld_, M, K, N, num_threads, options);
+
+    uint64_t hm = M / 2;
+    uint64_t hk = K / 2;
+    uint64_t hn = N / 2;
+
+    T* S_parts[4];
+    T* T_parts[4];
+    T* P_parts[3];
+    T* cur = workspace;
+    for (int i = 0; i < 4; i++, cur += hm * hk)
+        S_parts[i] = cur;
+    for (int i = 0; i < 4; i++, cur += hk * hn)
+        T_parts[i] = cur;
+    for (int i = 0; i < 3; i++, cur += hm * hn)
+        P_parts[i] = cur;
+    T* children = cur;
+    uint64_t child_size = workspace_size(hm, hk, hn, depth - 1);
+
+    strassen_view<T> A11 = quarter(A, hm, hk, 0, 0), A12 = quarter(A, hm, hk, 0, 1);
+    strassen_view<T> A21 = quarter(A, hm, hk, 1, 0), A22 = quarter(A, hm, hk, 1, 1);
+    strassen_view<T> B11 = quarter(B, hk, hn, 0, 0), B12 = quarter(B, hk, hn, 0, 1);
+    strassen_view<T> B21 = quarter(B, hk, hn, 1, 0), B22 = quarter(B, hk, hn, 1, 1);
+    strassen_view<T> C11 = quarter(C, hm, hn, 0, 0), C12 = quarter(C, hm, hn, 0, 1);
+    strassen_view<T> C21 = quarter(C, hm, hn, 1, 0), C22 = quarter(C, hm, hn, 1, 1);
+
+    // S1 = A21 + A22, S2 = S1 - A11, S3 = A11 - A21, S4 = A12 - S2
+    for_rows(pool, num_threads, hm, hk, [&](uint64_t first, uint64_t last)
+    {
+        for (uint64_t row = first; row < last; row++)
+        {
+            const T* a11 = A11.data_ + row * A.ld_;
+            const T* a12 = A12.data_ + row * A.ld_;
+            const T* a21 = A21.data_ + row * A.ld_;
+            const T* a22 = A22.data_ + row * A.ld_;
+            T* s1 = S_parts[0] + row * hk;
+            T* s2 = S_parts[1] + row * hk;
+            T* s3 = S_parts[2] + row * hk;
+            T* s4 = S_parts[3] + row * hk;
+            for (uint64_t col = 0; col < hk; col++)
+            {
+                s1[col] = a21[col] + a22[col];
+                s2[col] = s1[col] - a11[col];
+                s3[col] = a11[col] - a21[col];
+                s4[col] = a12[col] - s2[col];
+            }
+        }
+    });
+
+    // T1 = B12 - B11, T2 = B22 - T1, T3 = B22 - B12, T4 = T2 - B21
+    for_rows(pool, num_threads, hk, hn, [&](uint64_t first, uint64_t last)
+    {
+        for (uint64_t row = first; row < last; row++)
+        {
+            const T* b11 = B11.data_ + row * B.ld_;
+            const T* b12 = B12.data_ + row * B.ld_;
+            const T* b21 = B21.data_ + row * B.ld_;
+            const T* b22 = B22.data_ + row * B.ld_;
+            T* t1 = T_parts[0] + row * hn;
+            T* t2 = T_parts[1] + row * hn;
+            T* t3 = T_parts[2] + row * hn;
+            T* t4 = T_parts[3] + row * hn;
+            for (uint64_t col = 0; col < hn; col++)
+            {
+                t1[col] = b12[col] - b11[col];
+                t2[col] = b22[col] - t1[col];
+                t3[col] = b22[col] - b12[col];
+                t4[col] = t2[col] - b21[col];
+            }
+        }
+    });
+
+    // P2, P3, P4, P5 go straight into C quarters, P1, P6, P7 - into the workspace
+    strassen_view<T> S1 = {S_parts[0], hk}, S2 = {S_parts[1], hk}, S3 = {S_parts[2], hk}, S4 = {S_parts[3], hk};
+    strassen_view<T> T1 = {T_parts[0], hn}, T2 = {T_parts[1], hn}, T3 = {T_parts[2], hn}, T4 = {T_parts[3], hn};
+    strassen_view<T> P1 = {P_parts[0], hn}, P6 = {P_parts[1], hn}, P7 = {P_parts[2], hn};
+
+    struct product
+    {
+        strassen_view<T> left_;
+        strassen_view<T> right_;
+        strassen_view<T> result_;
+    };
+    const product products[7] =
+    {
+        {A11, B11, P1},  // P1 = A11 * B11
+        {A12, B21, C11}, // P2 = A12 * B21
+        {S4,  B22, C12}, // P3 = S4 * B22
+        {A22, T4,  C21}, // P4 = A22 * T4
+        {S1,  T1,  C22}, // P5 = S1 * T1
+        {S2,  T2,  P6},  // P6 = S2 * T2
+        {S3,  T3,  P7},  // P7 = S3 * T3
+    };
+
+    // the 7 products are independent tasks, each splits its share of threads further
+    long int child_threads = std::max<long int>(1, (num_threads + 6) / 7);
+    std::atomic<int> error(E_SUCCESS);
+    pool.run(7, num_threads, [&](uint64_t index)
+    {
+        const product& cur_product = products[index];
+        int ret = strassen_level(cur_product.left_, cur_product.right_, cur_product.result_, hm, hk, hn, depth - 1,
+                                 children + index * child_size, pool, child_threads, options);
+        if (ret != E_SUCCESS)
+            error.store(ret);
+    });
+    if (error.load() != E_SUCCESS)
+        return error.load();
+
+    // U2 = P1 + P6, U3 = U2 + P7
+    // C11 = P1 + P2, C12 = U2 + P5 + P3, C21 = U3 - P4, C22 = U3 + P5
+    for_rows(pool, num_threads, hm, hn, [&](uint64_t first, uint64_t last)
+    {
+        for (uint64_t row = first; row < last; row++)
+        {
+            const T* p1 = P_parts[0] + row * hn;
+            const T* p6 = P_parts[1] + row * hn;
+            const T* p7 = P_parts[2] + row * hn;
+            T* c11 = C11.data_ + row * C.ld_;
+            T* c12 = C12.data_ + row * C.ld_;
+            T* c21 = C21.data_ + row * C.ld_;
+            T* c22 = C22.data_ + row * C.ld_;
+            for (uint64_t col = 0; col < hn; col++)
+            {
+                T u2 = p1[col] + p6[col];
+                T u3 = u2 + p7[col];
+                T p5 = c22[col];
+                c11[col] += p1[col];
+                c12[col] += u2 + p5;
+                c21[col]  = u3 - c21[col];
+                c22[col]  = u3 + p5;
+            }
+        }
+    });
+
+    return E_SUCCESS;
+}
+
+template <typename T>
+static void copy_padded(const T* src, uint64_t ld_src, uint64_t rows, uint64_t cols,
+                        T* dst, uint64_t ld_dst, uint64_t dst_rows)
+{
+    for (uint64_t row = 0; row < dst_rows; row++)
+    {
+        T* dst_row = dst + row * ld_dst;
+        if (row < rows)
+        {
+            memcpy(dst_row, src + row * ld_src, cols * sizeof(T));
+            std::fill(dst_row + cols, dst_row + ld_dst, (T)0);
+        }
+        else
+            std::fill(dst_row, dst_row + ld_dst, (T)0);
+    }
+}
+
+template <typename T>
+int strassen_mult(const T* A, uint64_t lda, const T* B, uint64_t ldb, T* C, uint64_t ldc,
+                  uint64_t M, uint64_t K, uint64_t N, long int num_threads, const block_mult_options& options)
+{
+    uint64_t crossover = (options.strassen_crossover_ != 0) ? options.strassen_crossover_ : STRASSEN_DEF_CROSSOVER;
+
+    int depth = 0;
+    uint64_t smallest = std::min(M, std::min(K, N));
+    while (smallest > crossover && depth < STRASSEN_MAX_DEPTH)
+    {
+        smallest = (smallest + 1) / 2;
+        depth++;
+    }
+
+    if (depth == 0)
+        return block_mult_view(A, lda, B, ldb, C, ldc, M, K, N, num_threads, options);
+
+    if (options.timings_ != nullptr)
+        *options.timings_ = block_mult_timings();
+    if (options.numa_stats_ != nullptr)
+        *options.numa_stats_ = block_mult_numa_stats();
+    if (options.stats_ != nullptr)
+    {
+        std::fill(options.stats_->phase_begin_, options.stats_->phase_begin_ + PHASE_COUNT, 0.0);
+        std::fill(options.stats_->phase_end_, options.stats_->phase_end_ + PHASE_COUNT, 0.0);
+        options.stats_->threads_.clear();
+    }
+
+    thread_pool& pool = (options.pool_ != nullptr) ? *options.pool_ : thread_pool::instance();
+    pool.reserve(num_threads);
+
+    // every level halves the dimensions, so they are padded with zeros to multiples of 2^depth
+    uint64_t step = (uint64_t)1 << depth;
+    uint64_t Mp = (M + step - 1) / step * step;
+    uint64_t Kp = (K + step - 1) / step * step;
+    uint64_t Np = (N + step - 1) / step * step;
+    bool padded = (Mp != M || Kp != K || Np != N);
+
+    uint64_t level_size = workspace_size(Mp, Kp, Np, depth);
+    uint64_t pad_size   = padded ? Mp * Kp + Kp * Np + Mp * Np : 0;
+
+    // from the arena of the packed buffers, so steady calls reuse it and trim() frees it
+    workspace& arena = workspace::instance();
+    T* scratch = (T*)arena.acquire((level_size + pad_size) * sizeof(T));
+    if (scratch == nullptr)
+        return E_BADALLOC;
+
+    strassen_view<T> A_view = {const_cast<T*>(A), lda};
+    strassen_view<T> B_view = {const_cast<T*>(B), ldb};
+    strassen_view<T> C_view = {C, ldc};
+    if (padded)
+    {
+        T* pad = scratch + level_size;
+        A_view = {pad, Kp};
+        B_view = {pad + Mp * Kp, Np};
+        C_view = {pad + Mp * Kp + Kp * Np, Np};
+        copy_padded(A, lda, M, K, A_view.data_, Kp, Mp);
+        copy_padded(B, ldb, K, N, B_view.data_, Np, Kp);
+    }
+
+    // leaves run concurrently, stage timings and traffic of one of them would mean nothing
+    block_mult_options leaf_options = options;
+    leaf_options.timings_    = nullptr;
+    leaf_options.numa_stats_ = nullptr;
+    leaf_options.stats_      = nullptr;
+
+    int ret = strassen_level(A_view, B_view, C_view, Mp, Kp, Np, depth, scratch, pool, num_threads, leaf_options);
+    if (ret == E_SUCCESS && padded)
+        for (uint64_t row = 0; row < M; row++)
+            memcpy(C + row * ldc, C_view.data_ + row * Np, N * sizeof(T));
+
+    arena.release(scratch);
+    return ret;
+}
+
+template int strassen_mult(const double*, uint64_t, const double*, uint64_t, double*, uint64_t,
+                           uint64_t, uint64_t, uint64_t, long int, const block_mult_options&);
+template int strassen_mult(const float*, uint64_t, const float*, uint64_t, float*, uint64_t,
+                           uint64_t, uint64_t, uint64_t, long int, const block_mult_options&);
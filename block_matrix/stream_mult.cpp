@@ -0,0 +1,225 @@
+#include "block_matrix.hpp"
+#include "block_internal.hpp"
+#include "errors.hpp"
+#include "kernels.hpp"
+#include "matrix_io.hpp"
+#include <cstdio>
+#include <future>
+#include <vector>
+#include <sys/mman.h>
+
+struct stream_operand
+{
+    matb_header header_;
+    void*       mapping_;
+    size_t      mapping_size_;
+    double*     data_;
+};
+
+static uint64_t round_up(uint64_t value, uint64_t step)
+{
+    return (value + step - 1) / step * step;
+}
+
+// Page-aligned part of [first, first + count) elements, used to hint the kernel
+static void advise_range(const double* first, uint64_t count, int advice)
+{
+    uint64_t page  = sysconf(_SC_PAGESIZE);
+    uint64_t begin = round_up((uint64_t)first, page);
+    uint64_t end   = ((uint64_t)(first + count)) / page * page;
+    if (end > begin)
+        madvise((void*)begin, end - begin, advice);
+}
+
+static void open_operand(const char* file_name, stream_operand* operand)
+{
+    if (file_name == nullptr)
+        throw std::invalid_argument("[stream_block_mult] Bad pointer to file_name\n");
+
+    int err = map_matb_file(file_name, &operand->header_, &operand->mapping_, &operand->mapping_size_, &operand->data_);
+    if (err != E_SUCCESS)
+        throw std::runtime_error("[stream_block_mult] map_matb_file return " + std::to_string(err) + "\n");
+
+    if (operand->header_.layout_ != LAYOUT_ROW_MAJOR)
+    {
+        munmap(operand->mapping_, operand->mapping_size_);
+        throw std::invalid_argument("[stream_block_mult] only row-major .matb files can be streamed\n");
+    }
+}
+
+static int write_c_panel(int fd, uint64_t data_offset, const double* panel, uint64_t row_first, uint64_t height,
+                         uint64_t col_first, uint64_t width, uint64_t N)
+{
+    // full-width panel is one contiguous range of the file
+    if (width == N)
+    {
+        ssize_t size = height * width * sizeof(double);
+        if (pwrite(fd, panel, size, data_offset + row_first * N * sizeof(double)) != size)
+            return E_ERROR;
+        return E_SUCCESS;
+    }
+
+    ssize_t size = width * sizeof(double);
+    for (uint64_t row = 0; row < height; row++)
+        if (pwrite(fd, panel + row * width, size, data_offset + ((row_first + row) * N + col_first) * sizeof(double)) != size)
+            return E_ERROR;
+
+    return E_SUCCESS;
+}
+
+void stream_block_mult(const char* A_file, const char* B_file, const char* C_file, long int num_threads, const stream_mult_options& options)
+{
+    if (C_file == nullptr)
+        throw std::invalid_argument("[stream_block_mult] Bad pointer to C_file\n");
+    if (num_threads < 0)
+        throw std::invalid_argument("[stream_block_mult] negative number of threads\n");
+
+    stream_operand A;
+    stream_operand B;
+    open_operand(A_file, &A);
+    try
+    {
+        open_operand(B_file, &B);
+    }
+    catch (...)
+    {
+        munmap(A.mapping_, A.mapping_size_);
+        throw;
+    }
+
+    uint64_t M = A.header_.rows_;
+    uint64_t K = A.header_.cols_;
+    uint64_t N = B.header_.cols_;
+    if (B.header_.rows_ != K)
+    {
+        munmap(A.mapping_, A.mapping_size_);
+        munmap(B.mapping_, B.mapping_size_);
+        throw std::invalid_argument("[stream_block_mult] incompatible matrix format\n");
+    }
+
+    uint64_t budget = options.memory_budget_;
+    if (budget == 0)
+        budget = (uint64_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) / 2;
+
+    // B panel (K x width) takes up to a half of the budget, the rest is for
+    // two A panels (current and read-ahead), packed C panel and two C buffers
+    uint64_t tile     = KERNEL_DIM;
+    uint64_t K_padded = round_up(K, tile);
+    uint64_t width    = std::max<uint64_t>(tile, (budget / 2) / (K_padded * sizeof(double)) / tile * tile);
+    width = std::min(width, N);
+
+    uint64_t B_bytes = K_padded * round_up(width, tile) * sizeof(double);
+    uint64_t rest    = (budget > B_bytes) ? budget - B_bytes : 0;
+    uint64_t height  = std::max<uint64_t>(tile, rest / (sizeof(double) * (2 * K_padded + 3 * round_up(width, tile))) / tile * tile);
+    height = std::min(height, M);
+
+    uint64_t min_bytes = sizeof(double) * (K_padded * tile * 3 + 3 * tile * tile);
+    if (budget < min_bytes)
+        fprintf(stderr, "[stream_block_mult] memory budget %lu is below the minimum %lu, the minimum is used\n", budget, min_bytes);
+
+    long int panel_threads = num_threads;
+    block_mult_options resolved = resolve_options(options.block_, height, width, K, &panel_threads);
+
+    int fd = -1;
+    uint64_t data_offset = 0;
+    int err = create_matb_file(C_file, M, N, &fd, &data_offset);
+    if (err != E_SUCCESS)
+    {
+        munmap(A.mapping_, A.mapping_size_);
+        munmap(B.mapping_, B.mapping_size_);
+        throw std::runtime_error("[stream_block_mult] create_matb_file return " + std::to_string(err) + "\n");
+    }
+
+    auto pack_A = [&A, K, M, height](uint64_t row_first) -> matrix_of_blocks<double>*
+    {
+        uint64_t num_rows = std::min(height, M - row_first);
+        const double* panel = A.data_ + row_first * K;
+
+        matrix_of_blocks<double>* packed = produce_block_matrix(K, num_rows, panel, K);
+        // the panel is re-read from the file for the next B panel
+        advise_range(panel, num_rows * K, MADV_DONTNEED);
+        return packed;
+    };
+
+    std::vector<double> C_buffers[2] = {std::vector<double>(height * width), std::vector<double>(height * width)};
+    std::future<int> written;
+    int ret = E_SUCCESS;
+    uint64_t num_panels = 0;
+
+    for (uint64_t col_first = 0; col_first < N && ret == E_SUCCESS; col_first += width)
+    {
+        uint64_t num_cols = std::min(width, N - col_first);
+
+        matrix_of_blocks<double>* B_panel = produce_trans_block(num_cols, K, B.data_ + col_first, N, panel_threads, resolved.pool_);
+        if (B_panel == nullptr)
+        {
+            ret = E_BADALLOC;
+            break;
+        }
+        if (num_cols == N)
+            advise_range(B.data_, K * N, MADV_DONTNEED);
+
+        advise_range(A.data_, std::min(height, M) * K, MADV_WILLNEED);
+        std::future<matrix_of_blocks<double>*> next_A = std::async(std::launch::async, pack_A, 0);
+
+        for (uint64_t row_first = 0; row_first < M; row_first += height)
+        {
+            uint64_t num_rows = std::min(height, M - row_first);
+
+            matrix_of_blocks<double>* A_panel = next_A.get();
+            if (row_first + height < M)
+            {
+                uint64_t next_first = row_first + height;
+                advise_range(A.data_ + next_first * K, std::min(height, M - next_first) * K, MADV_WILLNEED);
+                next_A = std::async(std::launch::async, pack_A, next_first);
+            }
+
+            matrix_of_blocks<double>* C_panel = produce_block_matrix<double>(num_cols, num_rows, nullptr, num_cols, panel_threads, resolved.pool_);
+            if (A_panel == nullptr || C_panel == nullptr)
+                ret = E_BADALLOC;
+            else
+                ret = mult_prep_block_matr_multitread(A_panel, B_panel, C_panel, panel_threads, resolved);
+
+            if (A_panel != nullptr)
+                block_distruct(A_panel);
+
+            if (ret == E_SUCCESS)
+            {
+                // the buffer was used two panels ago, its write must be finished
+                std::vector<double>& buffer = C_buffers[num_panels % 2];
+                if (written.valid() && written.get() != E_SUCCESS)
+                    ret = E_ERROR;
+
+                fill_matrix_from_block_matrix(buffer.data(), num_rows, num_cols, num_cols, C_panel, panel_threads, resolved.pool_);
+                written = std::async(std::launch::async, write_c_panel, fd, data_offset, buffer.data(),
+                                     row_first, num_rows, col_first, num_cols, N);
+                num_panels++;
+            }
+
+            if (C_panel != nullptr)
+                block_distruct(C_panel);
+
+            if (ret != E_SUCCESS)
+                break;
+        }
+
+        if (next_A.valid())
+        {
+            matrix_of_blocks<double>* unused = next_A.get();
+            if (unused != nullptr)
+                block_distruct(unused);
+        }
+        block_distruct(B_panel);
+    }
+
+    if (written.valid() && written.get() != E_SUCCESS)
+        ret = E_ERROR;
+
+    if (close(fd) != 0 && ret == E_SUCCESS)
+        ret = E_ERROR;
+    munmap(A.mapping_, A.mapping_size_);
+    munmap(B.mapping_, B.mapping_size_);
+
+    if (ret != E_SUCCESS)
+        throw std::runtime_error("[stream_block_mult] panel product returned " + std::to_string(ret) + "\n");
+}
@@ -0,0 +1,250 @@
+#include "thread_pool.hpp"
+#include <chrono>
+#include <cstdio>
+#include <pthread.h>
+#include <sched.h>
+
+thread_pool::thread_pool(long int num_workers, const std::vector<int>& cpus):
+    cpus_(cpus),
+    stop_(false),
+    max_queue_depth_(0),
+    jobs_(0),
+    tasks_(0)
+{
+    add_workers(num_workers);
+}
+
+thread_pool::~thread_pool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    work_cv_.notify_all();
+
+    for (size_t i = 0; i < workers_.size(); i++)
+        workers_[i].thread_.join();
+
+    // submitted jobs no worker got to
+    for (job* cur_job : queue_)
+        if (cur_job->detached_)
+            delete cur_job;
+}
+
+thread_pool& thread_pool::instance()
+{
+    static thread_pool pool((long int)std::thread::hardware_concurrency() - 1);
+    return pool;
+}
+
+void thread_pool::add_workers(long int num_workers)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    for (long int i = 0; i < num_workers; i++)
+    {
+        size_t index = workers_.size();
+        workers_.push_back(worker());
+        workers_[index].idle_seconds_ = 0.0;
+        workers_[index].busy_seconds_ = 0.0;
+        workers_[index].thread_ = std::thread(&thread_pool::worker_routine, this, index);
+        pin(index);
+    }
+}
+
+void thread_pool::reserve(long int num_threads)
+{
+    long int missing = num_threads - 1 - num_workers();
+    if (missing > 0)
+        add_workers(missing);
+}
+
+long int thread_pool::num_workers()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return workers_.size();
+}
+
+// mutex_ must be held
+void thread_pool::pin(size_t index)
+{
+    if (cpus_.empty())
+        return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpus_[index % cpus_.size()], &set);
+
+    int err = pthread_setaffinity_np(workers_[index].thread_.native_handle(), sizeof(set), &set);
+    if (err != 0)
+        fprintf(stderr, "[thread_pool::pin] pthread_setaffinity_np returned %d for cpu %d\n", err, cpus_[index % cpus_.size()]);
+}
+
+void thread_pool::set_affinity(const std::vector<int>& cpus)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    cpus_ = cpus;
+    if (cpus_.empty())
+    {
+        // back to all cpus of the process
+        cpu_set_t set;
+        if (sched_getaffinity(0, sizeof(set), &set) != 0)
+            return;
+        for (size_t i = 0; i < workers_.size(); i++)
+            pthread_setaffinity_np(workers_[i].thread_.native_handle(), sizeof(set), &set);
+        return;
+    }
+
+    for (size_t i = 0; i < workers_.size(); i++)
+        pin(i);
+}
+
+void thread_pool::execute(job* cur_job)
+{
+    uint64_t task = 0;
+    while ((task = cur_job->next_.fetch_add(1, std::memory_order_relaxed)) < cur_job->num_tasks_)
+    {
+        try
+        {
+            (*cur_job->func_)(task);
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!cur_job->error_)
+                cur_job->error_ = std::current_exception();
+        }
+
+        tasks_.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void thread_pool::worker_routine(size_t index)
+{
+    typedef std::chrono::steady_clock clock;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true)
+    {
+        clock::time_point park = clock::now();
+        work_cv_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+        clock::time_point wake = clock::now();
+        workers_[index].idle_seconds_ += std::chrono::duration<double>(wake - park).count();
+
+        if (stop_)
+            return;
+
+        job* cur_job = queue_.front();
+        if (cur_job->next_.load(std::memory_order_relaxed) >= cur_job->num_tasks_)
+        {
+            // every task is already taken, nothing to join
+            queue_.pop_front();
+            continue;
+        }
+        cur_job->joined_++;
+        cur_job->active_++;
+        if (cur_job->joined_ >= cur_job->max_workers_)
+            queue_.pop_front();
+
+        lock.unlock();
+        execute(cur_job);
+        lock.lock();
+
+        // the caller waits for active_ == 0 before the job leaves its stack
+        cur_job->active_--;
+        if (cur_job->active_ == 0 && cur_job->detached_)
+            delete cur_job;
+        else if (cur_job->active_ == 0)
+            done_cv_.notify_all();
+
+        workers_[index].busy_seconds_ += std::chrono::duration<double>(clock::now() - wake).count();
+    }
+}
+
+void thread_pool::run(uint64_t num_tasks, long int max_threads, const std::function<void(uint64_t)>& func)
+{
+    if (num_tasks == 0)
+        return;
+
+    job cur_job;
+    cur_job.func_        = &func;
+    cur_job.num_tasks_   = num_tasks;
+    cur_job.next_        = 0;
+    cur_job.max_workers_ = (long int)std::min<uint64_t>(max_threads > 0 ? max_threads - 1 : 0, num_tasks - 1);
+    cur_job.joined_      = 0;
+    cur_job.active_      = 0;
+    cur_job.detached_    = false;
+
+    if (cur_job.max_workers_ > 0)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queue_.push_back(&cur_job);
+        jobs_++;
+        max_queue_depth_ = std::max<uint64_t>(max_queue_depth_, queue_.size());
+    }
+    else
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        jobs_++;
+    }
+
+    for (long int i = 0; i < cur_job.max_workers_; i++)
+        work_cv_.notify_one();
+
+    execute(&cur_job);
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (std::deque<job*>::iterator it = queue_.begin(); it != queue_.end(); ++it)
+        if (*it == &cur_job)
+        {
+            queue_.erase(it);
+            break;
+        }
+
+    done_cv_.wait(lock, [&cur_job] { return cur_job.active_ == 0; });
+
+    if (cur_job.error_)
+        std::rethrow_exception(cur_job.error_);
+}
+
+void thread_pool::submit(std::function<void()> func)
+{
+    reserve(2);
+
+    job* cur_job = new job;
+    cur_job->owned_func_ = [func](uint64_t) { func(); };
+    cur_job->func_        = &cur_job->owned_func_;
+    cur_job->num_tasks_   = 1;
+    cur_job->next_        = 0;
+    cur_job->max_workers_ = 1;
+    cur_job->joined_      = 0;
+    cur_job->active_      = 0;
+    cur_job->detached_    = true;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queue_.push_back(cur_job);
+        jobs_++;
+        max_queue_depth_ = std::max<uint64_t>(max_queue_depth_, queue_.size());
+    }
+    work_cv_.notify_one();
+}
+
+thread_pool_stats thread_pool::stats()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    thread_pool_stats result;
+    result.queue_depth_     = queue_.size();
+    result.max_queue_depth_ = max_queue_depth_;
+    result.jobs_            = jobs_;
+    result.tasks_           = tasks_.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < workers_.size(); i++)
+    {
+        result.idle_seconds_.push_back(workers_[i].idle_seconds_);
+        result.busy_seconds_.push_back(workers_[i].busy_seconds_);
+    }
+
+    return result;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <exception>
+
+struct thread_pool_stats
+{
+    uint64_t            queue_depth_;     // jobs waiting for workers right now
+    uint64_t            max_queue_depth_;
+    uint64_t            jobs_;            // jobs submitted with run()
+    uint64_t            tasks_;           // tasks executed by workers and callers
+    std::vector<double> idle_seconds_;    // per worker: time parked between jobs
+    std::vector<double> busy_seconds_;    // per worker: time spent in jobs
+};
+
+// Long-lived workers parked on a condition variable between jobs.
+// A job is a range of tasks, callers of run() execute tasks of their own job
+// too, so run() may be called from a task (nested jobs) and from many threads
+class thread_pool
+{
+private:
+
+    struct job
+    {
+        const std::function<void(uint64_t)>* func_;
+        uint64_t              num_tasks_;
+        std::atomic<uint64_t> next_;
+        long int              max_workers_; // workers allowed to join besides the caller
+        long int              joined_;      // guarded by mutex_
+        long int              active_;      // guarded by mutex_
+        std::exception_ptr    error_;       // guarded by mutex_
+
+        // submit(): nobody waits for the job, it owns its function and is
+        // deleted by the worker finishing it
+        bool                            detached_;
+        std::function<void(uint64_t)>   owned_func_;
+    };
+
+    struct worker
+    {
+        std::thread thread_;
+        double      idle_seconds_;
+        double      busy_seconds_;
+    };
+
+    std::mutex              mutex_;
+    std::condition_variable work_cv_;
+    std::condition_variable done_cv_;
+    std::deque<job*>        queue_;
+    std::deque<worker>      workers_;
+    std::vector<int>        cpus_;
+    bool                    stop_;
+
+    uint64_t                max_queue_depth_;
+    uint64_t                jobs_;
+    std::atomic<uint64_t>   tasks_;
+
+    void worker_routine(size_t index);
+    void execute(job* cur_job);
+    void pin(size_t index);
+
+public:
+
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    // cpus: worker i is pinned to cpus[i % cpus.size()], empty - no pinning
+    explicit thread_pool(long int num_workers, const std::vector<int>& cpus = std::vector<int>());
+    ~thread_pool();
+
+    // Process-wide pool, hardware_concurrency - 1 workers at start
+    static thread_pool& instance();
+
+    // Runs func(task) for every task in [0, num_tasks) on at most
+    // max_threads threads (caller included) and waits for all of them
+    void run(uint64_t num_tasks, long int max_threads, const std::function<void(uint64_t)>& func);
+
+    // Runs func on a worker and returns at once (at least one worker is started
+    // for it). func must not throw: its errors have nowhere to go
+    void submit(std::function<void()> func);
+
+    void     add_workers(long int num_workers);
+    // Makes at least num_threads threads (caller included) available to run()
+    void     reserve(long int num_threads);
+    long int num_workers();
+    void     set_affinity(const std::vector<int>& cpus);
+
+    thread_pool_stats stats();
+};
@@ -0,0 +1,180 @@
+#include "workspace.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
+
+// Alignment of regions below HUGE_PAGE_SIZE: a cache line (and a zmm vector)
+static const uint64_t REGION_ALIGNMENT = 64;
+// A cached region serves requests down to 1 / REUSE_SLACK of its size, smaller
+// ones would hold a large buffer the next large request needs
+static const uint64_t REUSE_SLACK = 2;
+
+static huge_page_policy policy_from_env()
+{
+    const char* value = getenv("BLOCK_MATRIX_HUGE_PAGES");
+    if (value == nullptr || *value == '\0' || strcmp(value, "advise") == 0)
+        return HUGE_PAGES_ADVISE;
+    if (strcmp(value, "off") == 0)
+        return HUGE_PAGES_OFF;
+    if (strcmp(value, "hugetlb") == 0)
+        return HUGE_PAGES_HUGETLB;
+
+    fprintf(stderr, "[workspace] unknown BLOCK_MATRIX_HUGE_PAGES=%s, using advise\n", value);
+    return HUGE_PAGES_ADVISE;
+}
+
+workspace::workspace():
+    huge_pages_(policy_from_env()),
+    stats_()
+{
+}
+
+workspace::~workspace()
+{
+    trim();
+}
+
+workspace& workspace::instance()
+{
+    static workspace* arena = new workspace();
+    return *arena;
+}
+
+// mutex_ must be held
+void workspace::drop(std::multimap<uint64_t, region>::iterator cached)
+{
+    stats_.cached_bytes_ -= cached->first;
+    if (cached->second.mapped_)
+        munmap(cached->second.base_, cached->first);
+    else
+        free(cached->second.base_);
+    cached_.erase(cached);
+}
+
+// mutex_ must be held
+void* workspace::allocate(uint64_t size, uint64_t alignment, bool* mapped)
+{
+    *mapped = false;
+    if (size < HUGE_PAGE_SIZE || huge_pages_ == HUGE_PAGES_OFF)
+        return aligned_alloc(alignment, size);
+
+    stats_.huge_regions_++;
+    if (huge_pages_ == HUGE_PAGES_HUGETLB)
+    {
+        void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (base != MAP_FAILED)
+        {
+            *mapped = true;
+            return base;
+        }
+        // no reserved pages (vm.nr_hugepages) or no hugetlb support
+        stats_.hugetlb_fallbacks_++;
+    }
+
+    void* base = aligned_alloc(alignment, size);
+    // the kernel may refuse (THP disabled), regular pages work as well
+    if (base != nullptr)
+        madvise(base, size, MADV_HUGEPAGE);
+    return base;
+}
+
+void* workspace::acquire(uint64_t bytes)
+{
+    uint64_t alignment = (bytes >= HUGE_PAGE_SIZE) ? HUGE_PAGE_SIZE : REGION_ALIGNMENT;
+    uint64_t size      = (bytes + alignment - 1) / alignment * alignment;
+    if (size == 0)
+        size = alignment;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.acquires_++;
+
+    region found = {nullptr, false};
+    std::multimap<uint64_t, region>::iterator fit = cached_.lower_bound(size);
+    if (fit != cached_.end() && fit->first <= REUSE_SLACK * size)
+    {
+        size  = fit->first;
+        found = fit->second;
+        stats_.cached_bytes_ -= size;
+        cached_.erase(fit);
+        stats_.reuse_hits_++;
+    }
+    else
+    {
+        // this shape outgrew the smaller regions, they go back to the system
+        while (!cached_.empty() && cached_.begin()->first < size)
+            drop(cached_.begin());
+
+        errno = 0;
+        found.base_ = allocate(size, alignment, &found.mapped_);
+        if (found.base_ == nullptr)
+        {
+            perror("[workspace::acquire] allocation returned error\n");
+            return nullptr;
+        }
+        stats_.allocations_++;
+    }
+
+    in_use_[found.base_] = size;
+    if (found.mapped_)
+        mapped_[found.base_] = true;
+    stats_.bytes_in_use_ += size;
+    if (stats_.bytes_in_use_ > stats_.peak_bytes_)
+        stats_.peak_bytes_ = stats_.bytes_in_use_;
+
+    return found.base_;
+}
+
+void workspace::release(void* base)
+{
+    if (base == nullptr)
+        return;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::unordered_map<void*, uint64_t>::iterator used = in_use_.find(base);
+    if (used == in_use_.end())
+    {
+        fprintf(stderr, "[workspace::release] %p is not a region of this workspace\n", base);
+        return;
+    }
+
+    uint64_t size  = used->second;
+    region   freed = {base, mapped_.erase(base) != 0};
+    in_use_.erase(used);
+    stats_.bytes_in_use_ -= size;
+
+    cached_.insert(std::make_pair(size, freed));
+    stats_.cached_bytes_ += size;
+
+    // the cache never holds more than the largest working set seen
+    while (stats_.cached_bytes_ > stats_.peak_bytes_)
+        drop(cached_.begin());
+}
+
+void workspace::trim()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    while (!cached_.empty())
+        drop(cached_.begin());
+}
+
+void workspace::set_huge_pages(huge_page_policy policy)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    huge_pages_ = policy;
+    while (!cached_.empty())
+        drop(cached_.begin());
+}
+
+huge_page_policy workspace::huge_pages()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return huge_pages_;
+}
+
+workspace_stats workspace::stats()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+
+struct workspace_stats
+{
+    uint64_t bytes_in_use_;  // regions handed out and not released yet
+    uint64_t peak_bytes_;    // largest bytes_in_use_ seen
+    uint64_t cached_bytes_;  // released regions kept for reuse
+    uint64_t acquires_;
+    uint64_t reuse_hits_;    // acquires served by a cached region
+    uint64_t allocations_;   // acquires that had to allocate
+    uint64_t huge_regions_;  // allocated regions asked to be backed by huge pages
+    uint64_t hugetlb_fallbacks_; // HUGE_PAGES_HUGETLB regions the reserved pool couldn't hold
+};
+
+// Regions this large are aligned to (and rounded up to) huge pages
+const uint64_t HUGE_PAGE_SIZE = 2 << 20;
+
+// Backing of regions of HUGE_PAGE_SIZE and more. Packed tiles are walked with
+// strides of whole tile rows, 4 KiB pages cost a TLB miss on most of the steps
+enum huge_page_policy
+{
+    HUGE_PAGES_OFF     = 0, // regular pages
+    HUGE_PAGES_ADVISE  = 1, // madvise(MADV_HUGEPAGE): transparent huge pages if the kernel allows them
+    HUGE_PAGES_HUGETLB = 2, // mmap(MAP_HUGETLB) from the reserved pool, HUGE_PAGES_ADVISE when it is empty
+};
+
+// Arena of the packed tile buffers: released regions are kept and handed out
+// again to requests of about the same size, so steady products don't allocate
+// and don't fault fresh pages in. It grows with the shapes seen: a request
+// larger than every cached region drops the smaller ones and allocates.
+// Regions are 64-byte aligned, huge page aligned from HUGE_PAGE_SIZE on.
+// Thread safe: packed matrices are made and freed on different threads
+class workspace
+{
+private:
+
+    struct region
+    {
+        void* base_;
+        bool  mapped_; // MAP_HUGETLB mapping, freed by munmap
+    };
+
+    std::mutex                            mutex_;
+    std::multimap<uint64_t, region>       cached_;  // size -> region
+    std::unordered_map<void*, uint64_t>   in_use_;  // base -> size
+    std::unordered_map<void*, bool>       mapped_;  // bases of MAP_HUGETLB regions in use
+    huge_page_policy                      huge_pages_;
+    workspace_stats                       stats_;
+
+    void  drop(std::multimap<uint64_t, region>::iterator cached);
+    void* allocate(uint64_t size, uint64_t alignment, bool* mapped);
+
+public:
+
+    workspace(const workspace&) = delete;
+    workspace& operator=(const workspace&) = delete;
+
+    // The policy is HUGE_PAGES_ADVISE unless BLOCK_MATRIX_HUGE_PAGES=off|advise|hugetlb says otherwise
+    workspace();
+    // Frees the cached regions, the ones in use must be released before
+    ~workspace();
+
+    // Process-wide arena of the packed matrices, never destroyed (matrices with
+    // tiles may be destroyed after static destructors run)
+    static workspace& instance();
+
+    // nullptr if the allocation fails (errno is set)
+    void* acquire(uint64_t bytes);
+    void  release(void* region);
+    // Frees the cached regions
+    void  trim();
+
+    // Regions allocated from now on follow the policy (the cached ones are freed)
+    void             set_huge_pages(huge_page_policy policy);
+    huge_page_policy huge_pages();
+
+    workspace_stats stats();
+};